@@ -4,10 +4,15 @@
 #include "bootinfo.h"
 #include "compiler.h"
 #include "config.h"
+#include "delta.h"
 #include "framebuffer.h"
+#include "inet4.h"
+#include "inet6.h"
 #include "loadelf.h"
 #include "netboot.h"
+#include "netifc.h"
 #include "printf.h"
+#include "sha256.h"
 #include "string.h"
 #include "uniboot.h"
 #include <xefi.h>
@@ -22,6 +27,9 @@ static uint8_t ACPI_RSD_PTR[8] = "RSD PTR ";
 #define MSR_EXT_FEATURES_LONG_MODE BIT(8) // Long mode (64 bits)
 #define MSR_EXT_FEATURES_NO_EXECUTE BIT(11) // enables NXE paging bit
 
+// module pages, from the range UEFI leaves to the OS loader, reported as UNIBOOT_MEM_MODULE
+#define EFI_MODULE_MEMORY_TYPE 0x80000000
+
 static uint64_t x86_rdmsr(uint32_t id) {
     uint32_t eax, edx;
     __asm__ volatile("rdmsr" : "=a"(eax), "=d"(edx) : "c"(id));
@@ -132,6 +140,10 @@ static void read_memory_map(void) {
             type = UNIBOOT_MEM_NVS;
             break;
 
+        case EFI_MODULE_MEMORY_TYPE:
+            type = UNIBOOT_MEM_MODULE;
+            break;
+
         default:
             printf("Invalid EFI memory descriptor type (0x%x)!\n", desc->Type);
             continue;
@@ -170,26 +182,545 @@ static __attribute__((noreturn)) void jump_to_app(uniboot_entry_point_t start_ap
     __builtin_unreachable();
 }
 
-#define KBUFSIZE (32 * 1024 * 1024)
-#define RBUFSIZE (512 * 1024 * 1024)
+#define APP_MAX_SIZE (1024 * 1024 * 1024)
+
+// The application is loaded while it is being received, segments land right at their final addresses.
+// Packet checksums are verified as the data is copied there.
+static struct elf_stream app_stream;
+
+static int app_write(void *cookie, const void *data, size_t len, size_t offset) {
+    return elf_stream_write(cookie, data, len, offset);
+}
+
+// The last netbooted image is kept on the boot volume together with its SHA-256. A host that
+// offers the same image again gets it booted from there instead of sending it.
+#define APP_CACHE_FILE L"netboot.elf"
+#define APP_CACHE_HASH_FILE L"netboot.sha"
+#define APP_CACHE_MAP_FILE L"netboot.map" // block map for delta transfers, see delta.h
+#define APP_CACHE_CHUNK_SIZE (4 * 1024 * 1024) // a multiple of DELTA_BLOCK_SIZE
+
+static struct {
+    bool enabled;
+    bool valid; // the cache file holds the image with |hash|
+    uint8_t hash[NB_HASH_LEN];
+
+    // The image being received is hashed and written to the cache file as it comes, gathered into
+    // chunks of APP_CACHE_CHUNK_SIZE. The cached image is gone once the first chunk is written.
+    struct sha256_ctx sha;
+    efi_file_protocol *file;
+    uint8_t *chunk;
+    size_t chunk_len;
+    size_t size;    // announced image size
+    size_t written; // image bytes in the file
+    void *new_map;  // block map of the image, built as the chunks are written
+    bool failed;    // the image cannot be cached
+
+    bool have_expected; // the host told us the hash of the image
+    uint8_t expected[NB_HASH_LEN];
+    bool hit; // the host offered the cached image
+
+    uint8_t *map; // block map of the cached image, loaded when the host asks for it
+    size_t map_size;
+} app_cache;
+
+static void app_cache_init(void) {
+    size_t size;
+    uint8_t *hash = xefi_load_file(APP_CACHE_HASH_FILE, &size, 0);
+    if (!hash) {
+        return;
+    }
+    efi_file_protocol *file = xefi_open_file(APP_CACHE_FILE);
+    if (file && size == NB_HASH_LEN) {
+        memcpy(app_cache.hash, hash, NB_HASH_LEN);
+        app_cache.valid = true;
+        netboot_set_cached_hash(app_cache.hash);
+    }
+    if (file) {
+        file->Close(file);
+    }
+    xefi_free(hash, size);
+}
+
+// Stops writing the image being received to the cache
+static void app_cache_abort(void) {
+    if (app_cache.file) {
+        // closes the handle as well
+        app_cache.file->Delete(app_cache.file);
+        app_cache.file = NULL;
+    }
+    if (app_cache.new_map) {
+        gBS->FreePool(app_cache.new_map);
+        app_cache.new_map = NULL;
+    }
+    app_cache.failed = true;
+}
+
+// The received image is only hashed while the cache is enabled. The hash is also what a resumed
+// transfer of the image is checked against, so with netboot_cache=0 transfers start over.
+static void app_cache_reset(size_t size) {
+    app_cache_abort();
+    sha256_init(&app_cache.sha);
+    app_cache.chunk_len = 0;
+    app_cache.written = 0;
+    app_cache.have_expected = false;
+    app_cache.hit = false;
+    app_cache.failed = !app_cache.enabled || !size;
+    if (app_cache.failed) {
+        return;
+    }
+    if (!app_cache.chunk && gBS->AllocatePool(EfiLoaderData, APP_CACHE_CHUNK_SIZE, (void **)&app_cache.chunk)) {
+        app_cache.chunk = NULL;
+    }
+    app_cache.size = size;
+    if (gBS->AllocatePool(EfiLoaderData, delta_blockmap_size(size), &app_cache.new_map)) {
+        app_cache.new_map = NULL;
+    }
+    app_cache.failed = !app_cache.chunk || !app_cache.new_map;
+}
+
+// The old image and its block map are not the cached ones anymore
+static void app_cache_invalidate(void) {
+    xefi_delete_file(APP_CACHE_HASH_FILE);
+    app_cache.valid = false;
+    if (app_cache.map) {
+        xefi_free(app_cache.map, app_cache.map_size);
+        app_cache.map = NULL;
+    }
+}
+
+// Writes the gathered chunk to the cache file
+static void app_cache_flush(void) {
+    if (app_cache.failed || !app_cache.chunk_len) {
+        return;
+    }
+    if (app_cache.written + app_cache.chunk_len > app_cache.size) {
+        // larger than announced, the block map has no room for it
+        app_cache_abort();
+        return;
+    }
+    if (!app_cache.file) {
+        app_cache_invalidate();
+        app_cache.file = xefi_create_file(APP_CACHE_FILE);
+    }
+    efi_status r = EFI_NOT_FOUND;
+    if (app_cache.file) {
+        size_t sz = app_cache.chunk_len;
+        r = app_cache.file->Write(app_cache.file, &sz, app_cache.chunk);
+        if (!r && sz != app_cache.chunk_len) {
+            r = EFI_VOLUME_FULL;
+        }
+    }
+    if (r) {
+        printf("netboot: Cannot cache the image (%s)\n", xefi_strerror(r));
+        app_cache_abort();
+        return;
+    }
+    delta_blockmap_blocks(app_cache.new_map, app_cache.written, app_cache.chunk, app_cache.chunk_len);
+    app_cache.written += app_cache.chunk_len;
+    app_cache.chunk_len = 0;
+}
+
+// Gets the verified image bytes in order, hashing them here overlaps with the NIC receiving the next ones
+static void app_received(void *cookie, const void *data, size_t len) {
+    (void)cookie;
+    if (!app_cache.enabled) {
+        return;
+    }
+    sha256_update(&app_cache.sha, data, len);
+    while (len && !app_cache.failed) {
+        size_t n = APP_CACHE_CHUNK_SIZE - app_cache.chunk_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(app_cache.chunk + app_cache.chunk_len, data, n);
+        app_cache.chunk_len += n;
+        data += n;
+        len -= n;
+        if (app_cache.chunk_len == APP_CACHE_CHUNK_SIZE) {
+            app_cache_flush();
+        }
+    }
+}
+
+static bool app_cached(void *cookie, const uint8_t hash[NB_HASH_LEN]) {
+    (void)cookie;
+    memcpy(app_cache.expected, hash, NB_HASH_LEN);
+    app_cache.have_expected = true;
+    app_cache.hit = app_cache.valid && !memcmp(hash, app_cache.hash, NB_HASH_LEN);
+    return app_cache.hit;
+}
+
+// Replaces the cached image, the hash file is dropped first and written last so that an image
+// written partially never looks valid
+static void app_cache_write(const void *image, size_t size, const uint8_t hash[NB_HASH_LEN]) {
+    xefi_delete_file(APP_CACHE_HASH_FILE);
+    efi_status r = xefi_write_file(APP_CACHE_FILE, image, size);
+    if (!r) {
+        // without a block map the host just cannot send deltas against this image
+        size_t map_size = delta_blockmap_size(size);
+        void *map;
+        if (!gBS->AllocatePool(EfiLoaderData, map_size, &map)) {
+            delta_blockmap(image, size, hash, map);
+            r = xefi_write_file(APP_CACHE_MAP_FILE, map, map_size);
+            gBS->FreePool(map);
+        }
+    }
+    if (!r) {
+        r = xefi_write_file(APP_CACHE_HASH_FILE, hash, NB_HASH_LEN);
+    }
+    if (r) {
+        printf("netboot: Cannot cache the image (%s)\n", xefi_strerror(r));
+    }
+}
+
+// Completes the cache file of the image that has just been received
+static void app_cache_store(void) {
+    if (!app_cache.enabled) {
+        return;
+    }
+    app_cache_flush();
+    if (app_cache.chunk) {
+        gBS->FreePool(app_cache.chunk);
+        app_cache.chunk = NULL;
+    }
+    uint8_t hash[NB_HASH_LEN];
+    sha256_final(&app_cache.sha, hash);
+    if (app_cache.failed || !app_cache.file) {
+        return;
+    }
+    if (app_cache.have_expected && memcmp(hash, app_cache.expected, NB_HASH_LEN)) {
+        printf("netboot: image hash does not match the one sent by the host, not caching it\n");
+        app_cache_abort();
+        return;
+    }
+    efi_status r = app_cache.file->Close(app_cache.file);
+    app_cache.file = NULL;
+    if (!r) {
+        delta_blockmap_finish(app_cache.new_map, app_cache.written, hash);
+        r = xefi_write_file(APP_CACHE_MAP_FILE, app_cache.new_map, delta_blockmap_size(app_cache.written));
+    }
+    if (!r) {
+        // written last so that an image written partially never looks valid
+        r = xefi_write_file(APP_CACHE_HASH_FILE, hash, NB_HASH_LEN);
+    }
+    if (r) {
+        printf("netboot: Cannot cache the image (%s)\n", xefi_strerror(r));
+    }
+    gBS->FreePool(app_cache.new_map);
+    app_cache.new_map = NULL;
+}
+
+// Block map of the cached image, NULL if it is missing or does not belong to the image
+static nbfile *app_cache_blockmap(void) {
+    static nbfile nbmap;
+    if (!app_cache.valid) {
+        return NULL;
+    }
+    if (!app_cache.map) {
+        app_cache.map = xefi_load_file(APP_CACHE_MAP_FILE, &app_cache.map_size, 0);
+        if (!app_cache.map) {
+            return NULL;
+        }
+        struct delta_blockmap_header *hdr = (void *)app_cache.map;
+        if (app_cache.map_size < sizeof(*hdr) || hdr->magic != DELTA_BLOCKMAP_MAGIC ||
+            memcmp(hdr->image_hash, app_cache.hash, NB_HASH_LEN) ||
+            app_cache.map_size != delta_blockmap_size(hdr->image_size)) {
+            xefi_free(app_cache.map, app_cache.map_size);
+            app_cache.map = NULL;
+            return NULL;
+        }
+    }
+    nbmap.data = app_cache.map;
+    nbmap.size = app_cache.map_size;
+    return &nbmap;
+}
+
+// A delta against the cached image is received into memory as a whole and applied once the
+// host asks us to boot
+static nbfile nbdelta;
+
+static void app_delta_reset(void) {
+    if (nbdelta.data) {
+        gBS->FreePool(nbdelta.data);
+    }
+    nbdelta.data = NULL;
+    nbdelta.size = 0;
+    nbdelta.offset = 0;
+}
+
+static nbfile *app_delta_buffer(size_t size) {
+    app_delta_reset();
+    if (!app_cache.valid || size < sizeof(struct delta_header) || size > APP_MAX_SIZE ||
+        gBS->AllocatePool(EfiLoaderData, size, (void **)&nbdelta.data)) {
+        nbdelta.data = NULL;
+        return NULL;
+    }
+    nbdelta.size = size;
+    return &nbdelta;
+}
+
+static bool app_delta_received(void) { return nbdelta.data && nbdelta.offset == nbdelta.size; }
+
+// Rebuilds the new image from the cached one and the delta, then loads it
+static void *app_delta_load(void) {
+    size_t base_size;
+    void *base = xefi_load_file(APP_CACHE_FILE, &base_size, 0);
+    if (!base) {
+        xefi_fatal("netboot: Cannot read the cached image", EFI_LOAD_ERROR);
+    }
+    size_t size = delta_image_size(nbdelta.data, nbdelta.size);
+    void *image;
+    if (!size || gBS->AllocatePool(EfiLoaderData, size, &image)) {
+        xefi_fatal("netboot: Cannot allocate buffer for the image", EFI_OUT_OF_RESOURCES);
+    }
+    int r = delta_apply(base, base_size, app_cache.hash, nbdelta.data, nbdelta.size, image);
+    xefi_free(base, base_size);
+    if (r == DELTA_ERR_BASE) {
+        xefi_fatal("netboot: the delta is made against another image", EFI_LOAD_ERROR);
+    } else if (r == DELTA_ERR_HASH) {
+        xefi_fatal("netboot: the delta does not produce the expected image", EFI_CRC_ERROR);
+    } else if (r) {
+        xefi_fatal("netboot: corrupted delta", EFI_LOAD_ERROR);
+    }
+
+    elf_stream_init(&app_stream);
+    elf_stream_write(&app_stream, image, size, 0);
+    void *entry = elf_stream_finish(&app_stream);
+
+    app_cache_write(image, size, ((struct delta_header *)nbdelta.data)->image_hash);
+    gBS->FreePool(image);
+    app_delta_reset();
+    return entry;
+}
+
+static void app_rewind(void *cookie, size_t offset) { elf_stream_rewind(cookie, offset); }
+
+// The received bytes are hashed for the cache anyway, so an interrupted transfer can be resumed
+static bool app_prefix_hash(void *cookie, uint8_t hash[NB_HASH_LEN]) {
+    (void)cookie;
+    if (!app_cache.enabled) {
+        return false;
+    }
+    struct sha256_ctx ctx = app_cache.sha;
+    sha256_final(&ctx, hash);
+    return true;
+}
+
+static void *app_locate(void *cookie, size_t offset, size_t len, size_t headroom) {
+    return elf_stream_locate(cookie, offset, len, headroom);
+}
+
+static nbfile nbapp = {
+    .size = APP_MAX_SIZE,
+};
+
+// The image is linked at address 0 and the firmware does not relocate it, so pointers are set
+// at runtime rather than in static initializers
+static void app_init(void) {
+    app_stream.copy = udp6_csum_copy;
+    nbapp.write = app_write;
+    nbapp.rewind = app_rewind;
+    nbapp.locate = app_locate;
+    nbapp.received = app_received;
+    nbapp.cached = app_cached;
+    nbapp.prefix_hash = app_prefix_hash;
+    nbapp.cookie = &app_stream;
+}
+
+// Modules are files the application gets next to it, e.g. ramdisks. They are loaded from disk or
+// received into buffers of their own, so the host may send them while the application is still on
+// the way, and are published as UNIBOOT_ENTRY_MODULE.
+#define MODULES_MAX 8
+#define MODULE_NAME_MAX UNIBOOT_MODULE_NAME_LEN
+#define MODULE_ALIGN_MAX (1024 * 1024 * 1024)
+
+static struct module {
+    char name[MODULE_NAME_MAX]; // empty if the slot is free
+    nbfile file;
+    size_t pages;
+} modules[MODULES_MAX];
+
+// alignment of module buffers, a power of two of at least PAGE_SIZE
+static size_t module_align = PAGE_SIZE;
+
+static void module_set_align(size_t align) {
+    if (align < PAGE_SIZE || align > MODULE_ALIGN_MAX || (align & (align - 1))) {
+        printf("Invalid module_align %lu, modules are page aligned\n", (unsigned long)align);
+        align = PAGE_SIZE;
+    }
+    module_align = align;
+}
+
+// Allocates |pages| pages at a multiple of module_align, the pages around it are given back
+static void *module_alloc(size_t pages) {
+    size_t slack = module_align / PAGE_SIZE - 1;
+    efi_physical_addr addr;
+    if (gBS->AllocatePages(AllocateAnyPages, (efi_memory_type)EFI_MODULE_MEMORY_TYPE, pages + slack, &addr)) {
+        return NULL;
+    }
+    efi_physical_addr base = ROUND_UP(addr, module_align);
+    size_t head = (base - addr) / PAGE_SIZE;
+    if (head) {
+        gBS->FreePages(addr, head);
+    }
+    if (slack > head) {
+        gBS->FreePages(base + pages * PAGE_SIZE, slack - head);
+    }
+    return (void *)base;
+}
+
+static nbfile *module_buffer(const char *name, size_t size) {
+    if (!name[0] || !size || strlen(name) >= MODULE_NAME_MAX) {
+        return NULL;
+    }
+    struct module *mod = NULL;
+    for (size_t i = 0; i < MODULES_MAX; i++) {
+        if (!strcmp(modules[i].name, name)) {
+            // sent again, the buffer is reused if it is large enough
+            mod = &modules[i];
+            break;
+        }
+        if (!mod && !modules[i].name[0]) {
+            mod = &modules[i];
+        }
+    }
+    if (!mod) {
+        return NULL;
+    }
+    size_t pages = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    if (mod->file.data && mod->pages < pages) {
+        gBS->FreePages((efi_physical_addr)mod->file.data, mod->pages);
+        mod->file.data = NULL;
+    }
+    if (!mod->file.data) {
+        mod->file.data = module_alloc(pages);
+        if (!mod->file.data) {
+            mod->name[0] = 0;
+            return NULL;
+        }
+        mod->pages = pages;
+    }
+    strcpy(mod->name, name);
+    mod->file.size = size;
+    mod->file.offset = 0;
+    return &mod->file;
+}
+
+static struct module *module_find(const char *name) {
+    for (size_t i = 0; i < MODULES_MAX; i++) {
+        if (modules[i].name[0] && !strcmp(modules[i].name, name)) {
+            return &modules[i];
+        }
+    }
+    return NULL;
+}
+
+static bool module_complete(const struct module *mod) { return mod->file.offset == mod->file.size; }
+
+static void module_load_file(const char *name) {
+    char16_t path[MODULE_NAME_MAX];
+    size_t len = strlen(name);
+    for (size_t i = 0; i <= len; i++) {
+        path[i] = name[i];
+    }
+    efi_file_protocol *file = xefi_open_file(path);
+    if (!file) {
+        printf("Cannot open module %s\n", name);
+        return;
+    }
+    char buf[512];
+    size_t sz = sizeof(buf);
+    efi_file_info *finfo = (void *)buf;
+    nbfile *mod = NULL;
+    if (!file->GetInfo(file, &FileInfoGuid, &sz, finfo)) {
+        mod = module_buffer(name, finfo->FileSize);
+    }
+    if (mod) {
+        sz = mod->size;
+        if (!file->Read(file, &sz, mod->data) && sz == mod->size) {
+            mod->offset = sz;
+        }
+    }
+    if (!mod || !mod->offset) {
+        printf("Cannot load module %s\n", name);
+    }
+    file->Close(file);
+}
+
+// Loads the comma separated |list| of files from the boot volume, unless a host sent them already
+static void modules_load(const char *list) {
+    char name[MODULE_NAME_MAX];
+    while (*list) {
+        size_t len = 0;
+        while (list[len] && list[len] != ',') {
+            len++;
+        }
+        if (len && len < sizeof(name)) {
+            memcpy(name, list, len);
+            name[len] = 0;
+            struct module *mod = module_find(name);
+            if (!mod || !module_complete(mod)) {
+                module_load_file(name);
+            }
+        } else if (len) {
+            printf("A name in the modules list is too long, the module is skipped\n");
+        }
+        list += len;
+        if (*list == ',') {
+            list++;
+        }
+    }
+}
+
+static void read_modules(void) {
+    for (size_t i = 0; i < MODULES_MAX; i++) {
+        struct module *mod = &modules[i];
+        if (!mod->name[0]) {
+            continue;
+        }
+        if (!module_complete(mod)) {
+            printf("Module %s is incomplete, it is not passed to the application\n", mod->name);
+            continue;
+        }
+
+        struct uniboot_entry *entry = bootinfo_alloc(struct uniboot_entry);
+        entry->type = UNIBOOT_ENTRY_MODULE;
+        entry->length = sizeof(struct uniboot_module);
+
+        struct uniboot_module *info = bootinfo_alloc(struct uniboot_module);
+        info->base = (uint64_t)mod->file.data;
+        info->size = mod->file.size;
+        info->align = module_align;
+        memcpy(info->name, mod->name, sizeof(info->name));
+    }
+}
 
-static nbfile nbapp;
 nbfile *netboot_get_buffer(const char *name, size_t size) {
+    size_t module_prefix_len = strlen(NB_MODULE_FILENAME_PREFIX);
+    if (!strncmp(name, NB_MODULE_FILENAME_PREFIX, module_prefix_len)) {
+        return module_buffer(name + module_prefix_len, size);
+    }
     if (!strcmp(name, NB_APP_FILENAME)) {
+        elf_stream_init(&app_stream);
+        app_cache_reset(size <= APP_MAX_SIZE ? size : 0);
+        app_delta_reset();
         return &nbapp;
     }
+    if (!strcmp(name, NB_APP_DELTA_FILENAME)) {
+        nbapp.offset = 0;
+        return app_delta_buffer(size);
+    }
     return NULL;
 }
 
-void do_netboot() {
-    efi_physical_addr mem = 0xFFFFFFFF;
-    if (gBS->AllocatePages(AllocateMaxAddress, EfiLoaderData, KBUFSIZE / 4096, &mem)) {
-        printf("Failed to allocate network io buffer\n");
-        return;
+nbfile *netboot_get_file(const char *name) {
+    if (!strcmp(name, NB_APP_BLOCKMAP_FILENAME)) {
+        return app_cache_blockmap();
     }
-    nbapp.data = (void *)mem;
-    nbapp.size = KBUFSIZE;
+    return NULL;
+}
 
+void do_netboot() {
     printf("\nNetBoot Server Started...\n\n");
     efi_tpl prev_tpl = gBS->RaiseTPL(TPL_NOTIFY);
     while (true) {
@@ -197,7 +728,7 @@ void do_netboot() {
         if (n < 1) {
             continue;
         }
-        if (nbapp.offset < 4096) {
+        if (nbapp.offset < 4096 && !app_delta_received()) {
             // too small to be a kernel
             continue;
         }
@@ -229,33 +760,58 @@ EFIAPI efi_status efi_main(efi_handle img, efi_system_table *sys) {
         xefi_free(cfg_file, cfg_size);
     }
 
-    size_t elf_size = 0;
-    void *elf_data = NULL;
+    module_set_align(config_get_uint32("module_align", PAGE_SIZE));
+
+    uniboot_entry_point_t entry = NULL;
     const char *boot = config_get("boot", "file");
     if (strcmp(boot, "network") == 0) {
         // See if there's a network interface
         const char *nodename = config_get("nodename", NULL);
+        netifc_set_tx_buffers(config_get_uint32("net_tx_buffers", NETIFC_DEFAULT_TX_BUFFERS));
+        netifc_set_rx_budget(config_get_uint32("net_rx_budget", NETIFC_DEFAULT_RX_BUDGET));
+        ip4_set_enabled(config_get_uint32("net_ipv4", 1));
+        const char *pull_file = config_get("netboot_pull", NULL);
+        if (pull_file && netboot_set_pull(pull_file, config_get("netboot_server", NULL))) {
+            printf("Invalid netboot_server address, waiting for the host to send the application\n");
+        }
+        netboot_set_tftp_window(config_get_uint32("tftp_window_size", NB_TFTP_DEFAULT_WINDOW_SIZE));
+        app_cache.enabled = config_get_uint32("netboot_cache", 1);
+        if (app_cache.enabled) {
+            app_cache_init();
+        }
+        app_init();
         bool have_network = netboot_init(nodename) == 0;
         if (have_network) {
             printf("Nodename: %s\n", netboot_nodename());
 
             do_netboot();
 
-            elf_data = nbapp.data;
-            elf_size = nbapp.size;
+            if (app_delta_received()) {
+                entry = app_delta_load();
+            } else if (app_cache.hit) {
+                efi_file_protocol *file = xefi_open_file(APP_CACHE_FILE);
+                entry = elf_load_file(file);
+                file->Close(file);
+            } else {
+                entry = elf_stream_finish(&app_stream);
+                app_cache_store();
+            }
         } else {
             printf("Network is not available, trying to load application from disk\n");
         }
     }
-    if (!elf_data) {
+    if (!entry) {
         // local disk boot
-        elf_data = xefi_load_file(L"app.elf", &elf_size, 0);
-        if (!elf_data)
-            xefi_fatal("Cannot load ap.elf", EFI_LOAD_ERROR);
+        efi_file_protocol *file = xefi_open_file(L"app.elf");
+        if (!file)
+            xefi_fatal("Cannot load app.elf", EFI_LOAD_ERROR);
+        entry = elf_load_file(file);
+        file->Close(file);
     }
-    uniboot_entry_point_t entry = elf_load(elf_data, elf_size);
+    modules_load(config_get("modules", ""));
 
     read_acpi_root(sys);
+    read_modules();
     read_framebuffer_info();
     read_memory_map();
 
@@ -0,0 +1,187 @@
+#include "checksum.h"
+
+#include <stdbool.h>
+
+typedef uint64_t u64_unaligned __attribute__((aligned(1), may_alias));
+typedef uint32_t u32_unaligned __attribute__((aligned(1), may_alias));
+typedef uint16_t u16_unaligned __attribute__((aligned(1), may_alias));
+
+static uint64_t checksum_scalar(const uint8_t* data, size_t len, uint64_t sum) {
+    while (len >= 32) {
+        const u64_unaligned* w = (const void*)data;
+        sum = csum_add(sum, w[0]);
+        sum = csum_add(sum, w[1]);
+        sum = csum_add(sum, w[2]);
+        sum = csum_add(sum, w[3]);
+        data += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        sum = csum_add(sum, *(const u64_unaligned*)data);
+        data += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        sum = csum_add(sum, *(const u32_unaligned*)data);
+        data += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        sum = csum_add(sum, *(const u16_unaligned*)data);
+        data += 2;
+        len -= 2;
+    }
+    if (len) {
+        sum = csum_add(sum, *data);
+    }
+    return sum;
+}
+
+#if defined(__x86_64__)
+
+// The vector kernels add the 32 bit halves of every 64 bit lane into separate 64 bit
+// accumulators, so no carries are lost for any realistic packet size.
+typedef uint64_t v2u64 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint64_t v4u64 __attribute__((vector_size(32), aligned(1), may_alias));
+
+__attribute__((target("sse2")))
+static uint64_t checksum_sse2(const uint8_t* data, size_t len, uint64_t sum) {
+    v2u64 lo = {0, 0}, hi = {0, 0};
+    while (len >= 32) {
+        v2u64 a = *(const v2u64*)data;
+        v2u64 b = *(const v2u64*)(data + 16);
+        lo += (a & 0xffffffff) + (b & 0xffffffff);
+        hi += (a >> 32) + (b >> 32);
+        data += 32;
+        len -= 32;
+    }
+    lo += hi;
+    sum = csum_add(sum, lo[0]);
+    sum = csum_add(sum, lo[1]);
+    return checksum_scalar(data, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t checksum_avx2(const uint8_t* data, size_t len, uint64_t sum) {
+    v4u64 lo = {0, 0, 0, 0}, hi = {0, 0, 0, 0};
+    while (len >= 64) {
+        v4u64 a = *(const v4u64*)data;
+        v4u64 b = *(const v4u64*)(data + 32);
+        lo += (a & 0xffffffff) + (b & 0xffffffff);
+        hi += (a >> 32) + (b >> 32);
+        data += 64;
+        len -= 64;
+    }
+    lo += hi;
+    for (int i = 0; i < 4; i++) {
+        sum = csum_add(sum, lo[i]);
+    }
+    // not checksum_sse2(), mixing legacy SSE code into the AVX2 path costs more than
+    // the tail it would sum (see make test)
+    return checksum_scalar(data, len, sum);
+}
+
+// AVX2 needs both the CPU and the firmware (which owns XCR0) to enable it
+static bool have_avx2(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    if (eax < 7) {
+        return false;
+    }
+    __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    bool osxsave = (ecx >> 27) & 1, avx = (ecx >> 28) & 1;
+    if (!osxsave || !avx) {
+        return false;
+    }
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+    __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    return (ebx >> 5) & 1;
+}
+
+// A flag rather than a function pointer, the image is not relocated so a statically
+// initialized pointer would hold the link-time address
+static bool checksum_use_avx2;
+
+void checksum_init(void) {
+    checksum_use_avx2 = have_avx2();
+}
+
+static uint64_t checksum_kernel(const uint8_t* data, size_t len, uint64_t sum) {
+    return checksum_use_avx2 ? checksum_avx2(data, len, sum) : checksum_sse2(data, len, sum);
+}
+
+#else
+void checksum_init(void) {}
+#define checksum_kernel checksum_scalar
+#endif
+
+uint16_t csum_fold(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+uint64_t csum_partial(const void* data, size_t len, uint64_t sum) {
+    // short headers are not worth the dispatch
+    if (len < 64) {
+        return checksum_scalar(data, len, sum);
+    }
+    return checksum_kernel(data, len, sum);
+}
+
+uint64_t csum_partial_copy(void* _dst, const void* _src, size_t len, uint64_t sum) {
+    uint8_t* dst = _dst;
+    const uint8_t* src = _src;
+#if defined(__x86_64__)
+    v2u64 lo = {0, 0}, hi = {0, 0};
+    while (len >= 32) {
+        v2u64 a = *(const v2u64*)src;
+        v2u64 b = *(const v2u64*)(src + 16);
+        *(v2u64*)dst = a;
+        *(v2u64*)(dst + 16) = b;
+        lo += (a & 0xffffffff) + (b & 0xffffffff);
+        hi += (a >> 32) + (b >> 32);
+        src += 32;
+        dst += 32;
+        len -= 32;
+    }
+    lo += hi;
+    sum = csum_add(sum, lo[0]);
+    sum = csum_add(sum, lo[1]);
+#endif
+    while (len >= 8) {
+        uint64_t v = *(const u64_unaligned*)src;
+        *(u64_unaligned*)dst = v;
+        sum = csum_add(sum, v);
+        src += 8;
+        dst += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        uint32_t v = *(const u32_unaligned*)src;
+        *(u32_unaligned*)dst = v;
+        sum = csum_add(sum, v);
+        src += 4;
+        dst += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t v = *(const u16_unaligned*)src;
+        *(u16_unaligned*)dst = v;
+        sum = csum_add(sum, v);
+        src += 2;
+        dst += 2;
+        len -= 2;
+    }
+    if (len) {
+        *dst = *src;
+        sum = csum_add(sum, *src);
+    }
+    return sum;
+}
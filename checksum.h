@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Internet (one's complement) checksum. Words are summed in host byte order into a 64 bit
+// accumulator with end-around carry, which folds down to the same 16 bit result as summing
+// 16 bit words since 2^16 = 1 (mod 0xffff).
+
+static inline uint64_t csum_add(uint64_t sum, uint64_t v) {
+    sum += v;
+    return sum + (sum < v);
+}
+
+// Picks the widest kernel the CPU and firmware support, call before anything is summed
+void checksum_init(void);
+
+// Adds |len| bytes at |data| to the accumulator |sum|
+uint64_t csum_partial(const void* data, size_t len, uint64_t sum);
+
+// Copies |len| bytes while summing them, so the payload is read only once
+uint64_t csum_partial_copy(void* dst, const void* src, size_t len, uint64_t sum);
+
+// Folds the accumulator into a 16 bit sum
+uint16_t csum_fold(uint64_t sum);
@@ -0,0 +1,113 @@
+#include "delta.h"
+
+#include "string.h"
+
+// rsync's rolling checksum, the host computes it at every offset of the new image
+static uint32_t delta_weak(const uint8_t *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (b & 0xffff) << 16 | (a & 0xffff);
+}
+
+size_t delta_blockmap_size(size_t size) {
+    size_t blocks = (size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+    return sizeof(struct delta_blockmap_header) + blocks * sizeof(struct delta_blockmap_entry);
+}
+
+void delta_blockmap_blocks(void *map, size_t offset, const void *data, size_t len) {
+    struct delta_blockmap_entry *entry = map + sizeof(struct delta_blockmap_header);
+    entry += offset / DELTA_BLOCK_SIZE;
+    for (size_t pos = 0; pos < len; pos += DELTA_BLOCK_SIZE, entry++) {
+        const uint8_t *block = data + pos;
+        size_t block_len = len - pos < DELTA_BLOCK_SIZE ? len - pos : DELTA_BLOCK_SIZE;
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        struct sha256_ctx ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, block, block_len);
+        sha256_final(&ctx, digest);
+        entry->weak = delta_weak(block, block_len);
+        memcpy(entry->strong, digest, DELTA_STRONG_LEN);
+    }
+}
+
+void delta_blockmap_finish(void *map, size_t size, const uint8_t hash[SHA256_DIGEST_SIZE]) {
+    struct delta_blockmap_header *hdr = map;
+    hdr->magic = DELTA_BLOCKMAP_MAGIC;
+    hdr->block_size = DELTA_BLOCK_SIZE;
+    hdr->image_size = size;
+    memcpy(hdr->image_hash, hash, SHA256_DIGEST_SIZE);
+}
+
+void delta_blockmap(const void *image, size_t size, const uint8_t hash[SHA256_DIGEST_SIZE], void *map) {
+    delta_blockmap_blocks(map, 0, image, size);
+    delta_blockmap_finish(map, size, hash);
+}
+
+size_t delta_image_size(const void *delta, size_t len) {
+    const struct delta_header *hdr = delta;
+    if (len < sizeof(*hdr) || hdr->magic != DELTA_MAGIC) {
+        return 0;
+    }
+    return hdr->image_size;
+}
+
+int delta_apply(const void *base, size_t base_size, const uint8_t base_hash[SHA256_DIGEST_SIZE], const void *delta,
+                size_t len, void *image) {
+    const struct delta_header *hdr = delta;
+    if (len < sizeof(*hdr) || hdr->magic != DELTA_MAGIC) {
+        return DELTA_ERR_CORRUPTED;
+    }
+    if (memcmp(hdr->base_hash, base_hash, SHA256_DIGEST_SIZE)) {
+        return DELTA_ERR_BASE;
+    }
+
+    const uint8_t *p = delta + sizeof(*hdr);
+    const uint8_t *end = delta + len;
+    size_t out = 0;
+    for (;;) {
+        struct delta_record rec;
+        if ((size_t)(end - p) < sizeof(rec)) {
+            return DELTA_ERR_CORRUPTED;
+        }
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+
+        if (rec.op == DELTA_END) {
+            break;
+        }
+        if (rec.len > hdr->image_size - out) {
+            return DELTA_ERR_CORRUPTED;
+        }
+        if (rec.op == DELTA_COPY) {
+            if (rec.offset > base_size || rec.len > base_size - rec.offset) {
+                return DELTA_ERR_CORRUPTED;
+            }
+            memcpy(image + out, base + rec.offset, rec.len);
+        } else if (rec.op == DELTA_DATA) {
+            if (rec.len > (size_t)(end - p)) {
+                return DELTA_ERR_CORRUPTED;
+            }
+            memcpy(image + out, p, rec.len);
+            p += rec.len;
+        } else {
+            return DELTA_ERR_CORRUPTED;
+        }
+        out += rec.len;
+    }
+    if (out != hdr->image_size) {
+        return DELTA_ERR_CORRUPTED;
+    }
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, image, out);
+    sha256_final(&ctx, digest);
+    if (memcmp(digest, hdr->image_hash, SHA256_DIGEST_SIZE)) {
+        return DELTA_ERR_HASH;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+// Block-level delta transfers against the cached netboot image.
+//
+// The device publishes a block map of its cached image: a weak rolling checksum (as in rsync) and
+// a truncated SHA-256 of every DELTA_BLOCK_SIZE bytes. The host looks for these blocks anywhere in
+// the new image and sends a delta, a list of records that either copy a range of the cached image
+// or carry literal bytes. All integers are little-endian.
+
+#define DELTA_BLOCK_SIZE 4096
+#define DELTA_STRONG_LEN 16
+
+#define DELTA_BLOCKMAP_MAGIC 0x4D42434E // "NCBM"
+#define DELTA_MAGIC 0x4C44434E          // "NCDL"
+
+struct delta_blockmap_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t image_size;
+    uint8_t image_hash[SHA256_DIGEST_SIZE];
+    // followed by one entry per block, the last block may be short
+} __attribute__((packed));
+
+struct delta_blockmap_entry {
+    uint32_t weak;
+    uint8_t strong[DELTA_STRONG_LEN];
+} __attribute__((packed));
+
+struct delta_header {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t image_size;                   // size of the image the delta produces
+    uint8_t base_hash[SHA256_DIGEST_SIZE]; // the cached image the delta applies to
+    uint8_t image_hash[SHA256_DIGEST_SIZE];
+    // followed by records up to DELTA_END
+} __attribute__((packed));
+
+#define DELTA_END 0
+#define DELTA_COPY 1 // copy |len| bytes at |offset| of the cached image
+#define DELTA_DATA 2 // |len| literal bytes follow the record
+
+struct delta_record {
+    uint32_t op;
+    uint32_t len;
+    uint64_t offset;
+} __attribute__((packed));
+
+#define DELTA_ERR_CORRUPTED -1 // malformed delta
+#define DELTA_ERR_BASE -2      // the delta is made against a different image
+#define DELTA_ERR_HASH -3      // the result is not the image the host meant to send
+
+// Size of the block map of an image of |size| bytes
+size_t delta_blockmap_size(size_t size);
+
+// Builds the block map of |image| into |map|, which holds delta_blockmap_size(size) bytes
+void delta_blockmap(const void *image, size_t size, const uint8_t hash[SHA256_DIGEST_SIZE], void *map);
+
+// Builds the block map piecewise while the image comes in: fills the entries of the |len| image
+// bytes at |offset|, which is a multiple of DELTA_BLOCK_SIZE. So is |len| unless the bytes end the
+// image. The header is filled in last, once the image is complete.
+void delta_blockmap_blocks(void *map, size_t offset, const void *data, size_t len);
+void delta_blockmap_finish(void *map, size_t size, const uint8_t hash[SHA256_DIGEST_SIZE]);
+
+// Returns the size of the image that |delta| produces, 0 if it does not start with a delta header
+size_t delta_image_size(const void *delta, size_t len);
+
+// Rebuilds the image described by |delta| from |base| into |image|, which holds delta_image_size() bytes.
+// Returns 0 on success or a DELTA_ERR_* code.
+int delta_apply(const void *base, size_t base_size, const uint8_t base_hash[SHA256_DIGEST_SIZE], const void *delta,
+                size_t len, void *image);
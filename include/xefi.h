@@ -34,6 +34,11 @@ efi_status xefi_open_protocol(efi_handle h, efi_guid* guid, void** ifc);
 efi_status xefi_close_protocol(efi_handle h, efi_guid* guid);
 
 efi_file_protocol* xefi_open_file(const char16_t* filename);
+// Creates |filename| on the boot volume for writing, an existing file is replaced
+efi_file_protocol* xefi_create_file(const char16_t* filename);
+// Replaces the contents of |filename| on the boot volume
+efi_status xefi_write_file(const char16_t* filename, const void* data, size_t size);
+void xefi_delete_file(const char16_t* filename);
 void* xefi_read_file(efi_file_protocol* file, size_t* _sz, size_t front_bytes);
 void* xefi_load_file(const char16_t* filename, size_t* size_out, size_t front_bytes);
 void xefi_free(void* data, size_t size);
@@ -0,0 +1,650 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "inet4.h"
+#include "inet6.h"
+#include "netifc.h"
+
+#define REPORT_BAD 0
+
+#if REPORT_BAD
+#define BAD(n, ...)                 \
+    do {                            \
+        printf("error: ");          \
+        printf(n, ##__VA_ARGS__);   \
+        printf("\n");               \
+        return;                     \
+    } while (0)
+#else
+#define BAD(n, ...)  \
+    do {             \
+        return;      \
+    } while (0)
+#endif
+
+static int ip4_enabled = 1;
+
+static mac_addr ll_mac_addr;
+
+// Addresses are kept in network byte order
+static uint32_t my_ip4_addr;
+static uint32_t netmask;
+static uint32_t router_ip4_addr;
+static ip6_addr broadcast_mapped;
+static ip6_addr next_server_mapped;
+static int have_next_server;
+static uint16_t ip4_id;
+
+static const uint8_t ip4_mapped_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+int ip6_addr_is_ip4(const ip6_addr* addr) {
+    return !memcmp(addr, ip4_mapped_prefix, sizeof(ip4_mapped_prefix));
+}
+
+static void ip4_to_mapped(ip6_addr* out, uint32_t addr) {
+    memcpy(out->x, ip4_mapped_prefix, sizeof(ip4_mapped_prefix));
+    memcpy(out->x + 12, &addr, IP4_ADDR_LEN);
+}
+
+static char* ip4toa(char* out, uint32_t addr) {
+    const uint8_t* x = (const void*)&addr;
+    sprintf(out, "%u.%u.%u.%u", x[0], x[1], x[2], x[3]);
+    return out;
+}
+
+void ip4_set_enabled(int enabled) {
+    ip4_enabled = enabled;
+}
+
+int ip4_configured(void) {
+    return my_ip4_addr != 0;
+}
+
+const ip6_addr* ip4_broadcast(void) {
+    return &broadcast_mapped;
+}
+
+const ip6_addr* ip4_next_server(void) {
+    return have_next_server ? &next_server_mapped : NULL;
+}
+
+static int ip4_broadcast_addr(uint32_t addr) {
+    return addr == 0xFFFFFFFF || (my_ip4_addr && netmask != 0xFFFFFFFF && addr == (my_ip4_addr | ~netmask));
+}
+
+static int ip4_onlink(uint32_t addr) {
+    return !my_ip4_addr || ((addr ^ my_ip4_addr) & netmask) == 0;
+}
+
+// Packets that are not for our subnet go to the router
+static uint32_t ip4_next_hop(uint32_t daddr) {
+    if (ip4_broadcast_addr(daddr) || ip4_onlink(daddr) || !router_ip4_addr)
+        return daddr;
+    return router_ip4_addr;
+}
+
+// ARP cache, the same scheme as the IPv6 neighbor cache: entries are learned from the
+// packets we receive, a destination that is missing is requested and the last packet
+// sent to it waits in the entry for the reply.
+#define ARP_CACHE_SIZE 8
+#define ARP_MAX_REQUESTS 3
+#define ARP_RETRANS_US 1000000
+
+#define ARP_FREE 0
+#define ARP_INCOMPLETE 1
+#define ARP_REACHABLE 2
+
+typedef struct {
+    uint32_t ip;
+    mac_addr mac;
+    uint8_t state;
+    uint8_t requests;
+    uint32_t used;       // value of arp_clock at the last use, for LRU eviction
+    uint64_t request_us; // when the last request was sent
+    uint8_t* pending;    // frame waiting for the MAC
+    size_t pending_len;
+} arp_entry;
+
+static arp_entry arp_cache[ARP_CACHE_SIZE];
+static uint32_t arp_clock;
+
+static const mac_addr eth_broadcast = {.x = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}};
+
+static arp_entry* arp_lookup(uint32_t ip) {
+    for (size_t i = 0; i < ARP_CACHE_SIZE; i++) {
+        if (arp_cache[i].state != ARP_FREE && arp_cache[i].ip == ip)
+            return &arp_cache[i];
+    }
+    return NULL;
+}
+
+static void arp_release(arp_entry* e) {
+    if (e->pending) {
+        eth_put_buffer(e->pending);
+        e->pending = NULL;
+    }
+    e->state = ARP_FREE;
+}
+
+static arp_entry* arp_alloc(uint32_t ip) {
+    arp_entry* victim = NULL;
+    for (size_t i = 0; i < ARP_CACHE_SIZE; i++) {
+        arp_entry* e = &arp_cache[i];
+        if (e->state == ARP_FREE) {
+            victim = e;
+            break;
+        }
+        if (!victim || (int32_t)(e->used - victim->used) < 0)
+            victim = e;
+    }
+    arp_release(victim);
+    victim->ip = ip;
+    victim->requests = 0;
+    victim->used = ++arp_clock;
+    return victim;
+}
+
+static int arp_send(uint16_t op, const mac_addr* dmac, const uint8_t* tha, uint32_t tpa) {
+    uint8_t* buf = eth_get_buffer(2 + ETH_HDR_LEN + sizeof(arp_pkt));
+    if (buf == NULL)
+        return -1;
+    uint8_t* frame = buf + 2;
+    arp_pkt* arp = (void*)(frame + ETH_HDR_LEN);
+
+    memcpy(frame, dmac, ETH_ADDR_LEN);
+    memcpy(frame + 6, &ll_mac_addr, ETH_ADDR_LEN);
+    frame[12] = (ETH_ARP >> 8) & 0xFF;
+    frame[13] = ETH_ARP & 0xFF;
+
+    arp->htype = htons(1);
+    arp->ptype = htons(ETH_IP4);
+    arp->hlen = ETH_ADDR_LEN;
+    arp->plen = IP4_ADDR_LEN;
+    arp->op = htons(op);
+    memcpy(arp->sha, &ll_mac_addr, ETH_ADDR_LEN);
+    memcpy(arp->spa, &my_ip4_addr, IP4_ADDR_LEN);
+    memcpy(arp->tha, tha, ETH_ADDR_LEN);
+    memcpy(arp->tpa, &tpa, IP4_ADDR_LEN);
+    return eth_send(frame, ETH_HDR_LEN + sizeof(arp_pkt));
+}
+
+static void arp_request(arp_entry* e) {
+    static const uint8_t unknown[ETH_ADDR_LEN];
+    e->requests++;
+    e->request_us = netifc_time_us();
+    arp_send(ARP_REQUEST, &eth_broadcast, unknown, e->ip);
+}
+
+static void arp_update(uint32_t ip, const mac_addr* mac, int create) {
+    arp_entry* e = arp_lookup(ip);
+    if (!e) {
+        if (!create || !ip || ip4_broadcast_addr(ip))
+            return;
+        e = arp_alloc(ip);
+    }
+    e->used = ++arp_clock;
+    memcpy(&e->mac, mac, ETH_ADDR_LEN);
+    e->state = ARP_REACHABLE;
+    if (e->pending) {
+        memcpy(e->pending, mac, ETH_ADDR_LEN);
+        eth_send(e->pending, e->pending_len);
+        e->pending = NULL;
+    }
+}
+
+// Fills in the MAC of |daddr|, all zeros if it has to be requested first
+static void arp_resolve(mac_addr* mac, uint32_t daddr) {
+    if (ip4_broadcast_addr(daddr)) {
+        *mac = eth_broadcast;
+        return;
+    }
+    uint32_t hop = ip4_next_hop(daddr);
+    arp_entry* e = arp_lookup(hop);
+    if (!e) {
+        e = arp_alloc(hop);
+        e->state = ARP_INCOMPLETE;
+        arp_request(e);
+    }
+    e->used = ++arp_clock;
+    if (e->state == ARP_REACHABLE) {
+        *mac = e->mac;
+    } else {
+        memset(mac, 0, ETH_ADDR_LEN);
+    }
+}
+
+// Sends a frame built by ip4_setup(), it waits for the ARP reply if the MAC is not known yet
+static int ip4_transmit(uint8_t* frame, size_t len) {
+    static const mac_addr unresolved;
+    if (memcmp(frame, &unresolved, ETH_ADDR_LEN))
+        return eth_send(frame, len);
+
+    ip4_hdr* ip = (void*)(frame + ETH_HDR_LEN);
+    uint32_t daddr;
+    memcpy(&daddr, ip->dst, IP4_ADDR_LEN);
+    arp_entry* e = arp_lookup(ip4_next_hop(daddr));
+    if (e && e->state == ARP_REACHABLE) {
+        memcpy(frame, &e->mac, ETH_ADDR_LEN);
+        return eth_send(frame, len);
+    }
+    if (!e) {
+        eth_put_buffer(frame);
+        return -1;
+    }
+    if (e->pending)
+        eth_put_buffer(e->pending);
+    e->pending = frame;
+    e->pending_len = len;
+    return 0;
+}
+
+// Fills in the ethernet and IPv4 headers of |frame|, |length| is the size of the payload
+static void ip4_setup(uint8_t* frame, uint32_t daddr, size_t length, uint8_t proto) {
+    ip4_hdr* ip = (void*)(frame + ETH_HDR_LEN);
+
+    arp_resolve((void*)frame, daddr);
+    memcpy(frame + 6, &ll_mac_addr, ETH_ADDR_LEN);
+    frame[12] = (ETH_IP4 >> 8) & 0xFF;
+    frame[13] = ETH_IP4 & 0xFF;
+
+    ip->ver_ihl = 0x45;
+    ip->tos = 0;
+    ip->length = htons(IP4_HDR_LEN + length);
+    ip->id = htons(ip4_id++);
+    ip->frag = htons(0x4000); // don't fragment
+    ip->ttl = 64;
+    ip->proto = proto;
+    ip->checksum = 0;
+    memcpy(ip->src, &my_ip4_addr, IP4_ADDR_LEN);
+    memcpy(ip->dst, &daddr, IP4_ADDR_LEN);
+    ip->checksum = ~inet_checksum(ip, IP4_HDR_LEN, 0);
+}
+
+typedef struct {
+    udp_tx_hdr tx;
+    uint8_t pad[UDP_TX_HEADROOM - sizeof(udp_tx_hdr) - ETH_HDR_LEN - IP4_HDR_LEN - UDP_HDR_LEN];
+    uint8_t eth[ETH_HDR_LEN];
+    ip4_hdr ip4;
+    udp_hdr udp;
+    uint8_t data[0];
+} __attribute__((packed)) udp4_pkt;
+
+void* udp4_tx_reserve(const ip6_addr* daddr, uint16_t dport, uint16_t sport, size_t* max_len) {
+    size_t mtu = eth_mtu();
+    udp4_pkt* p = eth_get_buffer(sizeof(udp4_pkt) + mtu - IP4_HDR_LEN - UDP_HDR_LEN);
+    if (p == NULL)
+        return NULL;
+    p->tx.family = UDP_TX_IP4;
+    memcpy(p->ip4.dst, daddr->x + 12, IP4_ADDR_LEN);
+    p->udp.src_port = htons(sport);
+    p->udp.dst_port = htons(dport);
+    *max_len = mtu - IP4_HDR_LEN - UDP_HDR_LEN;
+    return p->data;
+}
+
+int udp4_tx_commit(void* payload, size_t dlen) {
+    udp4_pkt* p = (void*)((uint8_t*)payload - sizeof(udp4_pkt));
+    size_t length = dlen + UDP_HDR_LEN;
+    uint32_t daddr;
+
+    if (IP4_HDR_LEN + length > eth_mtu()) {
+        printf("Internal error: UDP write request is too long\n");
+        eth_put_buffer(p);
+        return -1;
+    }
+    memcpy(&daddr, p->ip4.dst, IP4_ADDR_LEN);
+    ip4_setup(p->eth, daddr, length, IP4_PROTO_UDP);
+
+    p->udp.length = htons(length);
+    p->udp.checksum = 0;
+    struct {
+        uint8_t src[IP4_ADDR_LEN];
+        uint8_t dst[IP4_ADDR_LEN];
+        uint8_t zero;
+        uint8_t proto;
+        uint16_t length;
+    } __attribute__((packed)) pseudo;
+    memcpy(pseudo.src, p->ip4.src, IP4_ADDR_LEN);
+    memcpy(pseudo.dst, p->ip4.dst, IP4_ADDR_LEN);
+    pseudo.zero = 0;
+    pseudo.proto = IP4_PROTO_UDP;
+    pseudo.length = p->udp.length;
+    uint16_t sum = inet_checksum(&pseudo, sizeof(pseudo), 0);
+    sum = inet_checksum(&p->udp, length, sum);
+    // 0 means no checksum, so 0xffff remains 0xffff
+    p->udp.checksum = sum != 0xffff ? ~sum : sum;
+    return ip4_transmit(p->eth, ETH_HDR_LEN + IP4_HDR_LEN + length);
+}
+
+static void icmp4_echo_reply(uint32_t daddr, const void* data, size_t len) {
+    uint8_t* buf = eth_get_buffer(2 + ETH_HDR_LEN + IP4_HDR_LEN + len);
+    if (buf == NULL)
+        return;
+    if (IP4_HDR_LEN + len > eth_mtu()) {
+        eth_put_buffer(buf);
+        return;
+    }
+    uint8_t* frame = buf + 2;
+    icmp4_hdr* icmp = (void*)(frame + ETH_HDR_LEN + IP4_HDR_LEN);
+    ip4_setup(frame, daddr, len, IP4_PROTO_ICMP);
+    memcpy(icmp, data, len);
+    icmp->type = ICMP4_ECHO_REPLY;
+    icmp->checksum = 0;
+    icmp->checksum = ~inet_checksum(icmp, len, 0);
+    ip4_transmit(frame, ETH_HDR_LEN + IP4_HDR_LEN + len);
+}
+
+// DHCP client, see RFC 2131. It runs until the first lease is bound, the lease is not
+// renewed as the bootloader is done long before it runs out.
+#define DHCP_DISCOVER 1
+#define DHCP_OFFER 2
+#define DHCP_REQUEST 3
+#define DHCP_ACK 5
+#define DHCP_NAK 6
+
+#define DHCP_OPT_PAD 0
+#define DHCP_OPT_SUBNET_MASK 1
+#define DHCP_OPT_ROUTER 3
+#define DHCP_OPT_REQUESTED_IP 50
+#define DHCP_OPT_MSG_TYPE 53
+#define DHCP_OPT_SERVER_ID 54
+#define DHCP_OPT_PARAM_LIST 55
+#define DHCP_OPT_MAX_MSG_SIZE 57
+#define DHCP_OPT_END 255
+
+// BOOTP messages are at least 300 bytes, some servers drop shorter ones
+#define DHCP_MIN_LEN 300
+#define DHCP_INITIAL_RETRANS_US 2000000
+#define DHCP_MAX_RETRANS_US 16000000
+#define DHCP_MAX_REQUESTS 4
+
+#define DHCP_IDLE 0
+#define DHCP_SELECTING 1
+#define DHCP_REQUESTING 2
+#define DHCP_BOUND 3
+
+static struct {
+    int state;
+    uint32_t xid;
+    uint32_t offered;
+    uint32_t server_id;
+    int tries;
+    uint64_t retrans_us;
+    uint64_t next_us;
+} dhcp;
+
+static void dhcp_send(void) {
+    static const ip6_addr broadcast = {.x = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}};
+    size_t max_len;
+    dhcp_msg* msg = udp4_tx_reserve(&broadcast, DHCP_SERVER_PORT, DHCP_CLIENT_PORT, &max_len);
+    if (msg == NULL)
+        return;
+    memset(msg, 0, DHCP_MIN_LEN);
+    msg->op = 1; // BOOTREQUEST
+    msg->htype = 1;
+    msg->hlen = ETH_ADDR_LEN;
+    msg->xid = dhcp.xid;
+    msg->flags = htons(0x8000); // we can't take unicast before we have an address
+    memcpy(msg->chaddr, &ll_mac_addr, ETH_ADDR_LEN);
+    msg->magic = htonl(DHCP_MAGIC);
+
+    uint8_t* opt = msg->options;
+    *opt++ = DHCP_OPT_MSG_TYPE;
+    *opt++ = 1;
+    *opt++ = dhcp.state == DHCP_SELECTING ? DHCP_DISCOVER : DHCP_REQUEST;
+    if (dhcp.state == DHCP_REQUESTING) {
+        *opt++ = DHCP_OPT_REQUESTED_IP;
+        *opt++ = IP4_ADDR_LEN;
+        memcpy(opt, &dhcp.offered, IP4_ADDR_LEN);
+        opt += IP4_ADDR_LEN;
+        *opt++ = DHCP_OPT_SERVER_ID;
+        *opt++ = IP4_ADDR_LEN;
+        memcpy(opt, &dhcp.server_id, IP4_ADDR_LEN);
+        opt += IP4_ADDR_LEN;
+    }
+    *opt++ = DHCP_OPT_PARAM_LIST;
+    *opt++ = 2;
+    *opt++ = DHCP_OPT_SUBNET_MASK;
+    *opt++ = DHCP_OPT_ROUTER;
+    *opt++ = DHCP_OPT_MAX_MSG_SIZE;
+    *opt++ = 2;
+    *opt++ = max_len >> 8;
+    *opt++ = max_len & 0xFF;
+    *opt++ = DHCP_OPT_END;
+
+    size_t len = opt - (uint8_t*)msg;
+    udp4_tx_commit(msg, len < DHCP_MIN_LEN ? DHCP_MIN_LEN : len);
+}
+
+static void dhcp_start(void) {
+    dhcp.state = DHCP_SELECTING;
+    dhcp.tries = 0;
+    dhcp.retrans_us = DHCP_INITIAL_RETRANS_US;
+    dhcp.next_us = 0;
+}
+
+// Returns the option |type| of a DHCP message and its length in |*len|
+static const uint8_t* dhcp_option(const dhcp_msg* msg, size_t msg_len, uint8_t type, size_t* len) {
+    const uint8_t* opt = msg->options;
+    const uint8_t* end = (const uint8_t*)msg + msg_len;
+    while (opt < end && *opt != DHCP_OPT_END) {
+        if (*opt == DHCP_OPT_PAD) {
+            opt++;
+            continue;
+        }
+        if (end - opt < 2 || opt[1] > end - opt - 2)
+            return NULL;
+        if (*opt == type) {
+            *len = opt[1];
+            return opt + 2;
+        }
+        opt += 2 + opt[1];
+    }
+    return NULL;
+}
+
+static uint32_t dhcp_addr_option(const dhcp_msg* msg, size_t msg_len, uint8_t type) {
+    size_t len;
+    uint32_t addr = 0;
+    const uint8_t* opt = dhcp_option(msg, msg_len, type, &len);
+    if (opt && len >= IP4_ADDR_LEN)
+        memcpy(&addr, opt, IP4_ADDR_LEN);
+    return addr;
+}
+
+void dhcp_recv(void* data, size_t len) {
+    dhcp_msg* msg = data;
+    char tmp[16];
+    size_t opt_len;
+
+    if (!ip4_enabled || dhcp.state == DHCP_IDLE || dhcp.state == DHCP_BOUND)
+        return;
+    if (len < sizeof(dhcp_msg) || msg->op != 2 || msg->xid != dhcp.xid ||
+        memcmp(msg->chaddr, &ll_mac_addr, ETH_ADDR_LEN) || msg->magic != htonl(DHCP_MAGIC))
+        BAD("Bogus DHCP Reply");
+    const uint8_t* type = dhcp_option(msg, len, DHCP_OPT_MSG_TYPE, &opt_len);
+    if (!type || opt_len != 1)
+        BAD("DHCP Reply Without Type");
+
+    if (dhcp.state == DHCP_SELECTING && *type == DHCP_OFFER) {
+        memcpy(&dhcp.offered, msg->yiaddr, IP4_ADDR_LEN);
+        dhcp.server_id = dhcp_addr_option(msg, len, DHCP_OPT_SERVER_ID);
+        dhcp.state = DHCP_REQUESTING;
+        dhcp.tries = 0;
+        dhcp.retrans_us = DHCP_INITIAL_RETRANS_US;
+        dhcp.next_us = 0;
+        return;
+    }
+    if (dhcp.state != DHCP_REQUESTING)
+        return;
+    if (*type == DHCP_NAK) {
+        dhcp_start();
+        return;
+    }
+    if (*type != DHCP_ACK)
+        return;
+
+    memcpy(&my_ip4_addr, msg->yiaddr, IP4_ADDR_LEN);
+    netmask = dhcp_addr_option(msg, len, DHCP_OPT_SUBNET_MASK);
+    if (!netmask) {
+        // classful default
+        uint8_t first = msg->yiaddr[0];
+        netmask = htonl(first < 128 ? 0xFF000000 : first < 192 ? 0xFFFF0000 : 0xFFFFFF00);
+    }
+    router_ip4_addr = dhcp_addr_option(msg, len, DHCP_OPT_ROUTER);
+    ip4_to_mapped(&broadcast_mapped, my_ip4_addr | ~netmask);
+    uint32_t next_server;
+    memcpy(&next_server, msg->siaddr, IP4_ADDR_LEN);
+    if (next_server) {
+        ip4_to_mapped(&next_server_mapped, next_server);
+        have_next_server = 1;
+    }
+    dhcp.state = DHCP_BOUND;
+
+    printf("ip4addr: %s", ip4toa(tmp, my_ip4_addr));
+    printf("/%s", ip4toa(tmp, netmask));
+    if (router_ip4_addr)
+        printf(" router %s", ip4toa(tmp, router_ip4_addr));
+    if (next_server)
+        printf(" next-server %s", ip4toa(tmp, next_server));
+    printf("\n");
+
+    // gratuitous ARP, so switches and neighbors learn where the address is right away
+    arp_send(ARP_REQUEST, &eth_broadcast, eth_broadcast.x, my_ip4_addr);
+}
+
+static void arp_recv(arp_pkt* arp, size_t len) {
+    if (len < sizeof(arp_pkt))
+        BAD("Bogus ARP Len");
+    if (arp->htype != htons(1) || arp->ptype != htons(ETH_IP4) || arp->hlen != ETH_ADDR_LEN ||
+        arp->plen != IP4_ADDR_LEN)
+        BAD("Unhandled ARP");
+
+    uint32_t spa, tpa;
+    memcpy(&spa, arp->spa, IP4_ADDR_LEN);
+    memcpy(&tpa, arp->tpa, IP4_ADDR_LEN);
+    int for_me = my_ip4_addr && tpa == my_ip4_addr;
+    // create entries only for hosts that talk to us, refresh the ones we know from anyone
+    arp_update(spa, (void*)arp->sha, for_me);
+    if (for_me && arp->op == htons(ARP_REQUEST))
+        arp_send(ARP_REPLY, (void*)arp->sha, arp->sha, spa);
+}
+
+static void ip4_recv(void* _data, size_t len, const mac_addr* smac) {
+    uint8_t* data = _data;
+    ip4_hdr* ip = _data;
+
+    if (len < IP4_HDR_LEN)
+        BAD("Bogus IP4 Header Len");
+    size_t hdr_len = (ip->ver_ihl & 0x0F) * 4;
+    if ((ip->ver_ihl >> 4) != 4 || hdr_len < IP4_HDR_LEN || hdr_len > len)
+        BAD("Bogus IP4 Header");
+    if (inet_checksum(ip, hdr_len, 0) != 0xFFFF)
+        BAD("IP4 Header Checksum Incorrect");
+    size_t n = ntohs(ip->length);
+    if (n < hdr_len || n > len)
+        BAD("IP4 Length Mismatch %zu %zu", n, len);
+    if (ntohs(ip->frag) & 0x3FFF)
+        BAD("IP4 Fragment");
+    len = n - hdr_len;
+    data += hdr_len;
+
+    uint32_t saddr, daddr;
+    memcpy(&saddr, ip->src, IP4_ADDR_LEN);
+    memcpy(&daddr, ip->dst, IP4_ADDR_LEN);
+    // DHCP replies may come to the offered address before we have it
+    if (daddr != my_ip4_addr && !ip4_broadcast_addr(daddr) &&
+        (my_ip4_addr || ip->proto != IP4_PROTO_UDP))
+        return;
+
+    if (my_ip4_addr && daddr == my_ip4_addr && ip4_onlink(saddr))
+        arp_update(saddr, smac, 1);
+
+    if (ip->proto == IP4_PROTO_ICMP) {
+        icmp4_hdr* icmp = (void*)data;
+        if (len < sizeof(icmp4_hdr) || inet_checksum(data, len, 0) != 0xFFFF)
+            BAD("Bogus ICMP4");
+        if (icmp->type == ICMP4_ECHO_REQUEST && daddr == my_ip4_addr)
+            icmp4_echo_reply(saddr, data, len);
+        return;
+    }
+
+    if (ip->proto == IP4_PROTO_UDP) {
+        udp_hdr* udp = (void*)data;
+        if (len < UDP_HDR_LEN)
+            BAD("Bogus UDP Header Len");
+        struct {
+            uint8_t src[IP4_ADDR_LEN];
+            uint8_t dst[IP4_ADDR_LEN];
+            uint8_t zero;
+            uint8_t proto;
+            uint16_t length;
+        } __attribute__((packed)) pseudo;
+        memcpy(pseudo.src, ip->src, IP4_ADDR_LEN);
+        memcpy(pseudo.dst, ip->dst, IP4_ADDR_LEN);
+        pseudo.zero = 0;
+        pseudo.proto = IP4_PROTO_UDP;
+        pseudo.length = htons(len);
+        ip6_addr src, dst;
+        ip4_to_mapped(&src, saddr);
+        ip4_to_mapped(&dst, daddr);
+        udp_recv(data, len, inet_checksum(&pseudo, sizeof(pseudo), 0), udp->checksum != 0, &dst, &src);
+        return;
+    }
+
+    BAD("Unhandled IP4 %d", ip->proto);
+}
+
+void eth4_recv(void* _data, size_t len) {
+    uint8_t* data = _data;
+
+    if (!ip4_enabled)
+        return;
+    if (len < ETH_HDR_LEN)
+        BAD("Bogus Header Len");
+    if (data[12] == (ETH_ARP >> 8) && data[13] == (ETH_ARP & 0xFF)) {
+        arp_recv((void*)(data + ETH_HDR_LEN), len - ETH_HDR_LEN);
+    } else {
+        ip4_recv(data + ETH_HDR_LEN, len - ETH_HDR_LEN, (void*)(data + 6));
+    }
+}
+
+void ip4_poll(void) {
+    if (!ip4_enabled)
+        return;
+    uint64_t now = netifc_time_us();
+
+    for (size_t i = 0; i < ARP_CACHE_SIZE; i++) {
+        arp_entry* e = &arp_cache[i];
+        if (e->state != ARP_INCOMPLETE || now - e->request_us < ARP_RETRANS_US)
+            continue;
+        if (e->requests < ARP_MAX_REQUESTS) {
+            arp_request(e);
+        } else {
+            arp_release(e);
+        }
+    }
+
+    if ((dhcp.state == DHCP_SELECTING || dhcp.state == DHCP_REQUESTING) && now >= dhcp.next_us) {
+        if (dhcp.state == DHCP_REQUESTING && dhcp.tries >= DHCP_MAX_REQUESTS) {
+            // the server went away, look for another one
+            dhcp_start();
+        }
+        dhcp_send();
+        dhcp.tries++;
+        dhcp.next_us = now + dhcp.retrans_us;
+        if (dhcp.retrans_us < DHCP_MAX_RETRANS_US)
+            dhcp.retrans_us *= 2;
+    }
+}
+
+void ip4_init(void* macaddr) {
+    if (!ip4_enabled)
+        return;
+    memcpy(&ll_mac_addr, macaddr, ETH_ADDR_LEN);
+    ip4_to_mapped(&broadcast_mapped, 0xFFFFFFFF);
+    // the transaction id only has to differ between devices and boots
+    dhcp.xid = (uint32_t)netifc_time_us() ^ (ll_mac_addr.x[2] << 24 | ll_mac_addr.x[3] << 16 |
+                                              ll_mac_addr.x[4] << 8 | ll_mac_addr.x[5]);
+    dhcp_start();
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "inet6.h"
+
+typedef struct ip4_hdr_t ip4_hdr;
+typedef struct icmp4_hdr_t icmp4_hdr;
+typedef struct arp_pkt_t arp_pkt;
+typedef struct dhcp_msg_t dhcp_msg;
+
+#define IP4_ADDR_LEN 4
+#define IP4_HDR_LEN 20
+
+#define IP4_PROTO_ICMP 1
+#define IP4_PROTO_UDP 17
+
+#define ICMP4_ECHO_REPLY 0
+#define ICMP4_ECHO_REQUEST 8
+
+#define DHCP_SERVER_PORT 67
+#define DHCP_CLIENT_PORT 68
+
+struct ip4_hdr_t {
+    uint8_t ver_ihl;
+    uint8_t tos;
+    uint16_t length;
+    uint16_t id;
+    uint16_t frag;
+    uint8_t ttl;
+    uint8_t proto;
+    uint16_t checksum;
+    uint8_t src[IP4_ADDR_LEN];
+    uint8_t dst[IP4_ADDR_LEN];
+} __attribute__((packed));
+
+struct icmp4_hdr_t {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+    uint8_t rest[4]; // depends on the type, identifier and sequence number for echo
+} __attribute__((packed));
+
+#define ARP_REQUEST 1
+#define ARP_REPLY 2
+
+struct arp_pkt_t {
+    uint16_t htype;
+    uint16_t ptype;
+    uint8_t hlen;
+    uint8_t plen;
+    uint16_t op;
+    uint8_t sha[ETH_ADDR_LEN];
+    uint8_t spa[IP4_ADDR_LEN];
+    uint8_t tha[ETH_ADDR_LEN];
+    uint8_t tpa[IP4_ADDR_LEN];
+} __attribute__((packed));
+
+#define DHCP_MAGIC 0x63825363
+
+struct dhcp_msg_t {
+    uint8_t op;
+    uint8_t htype;
+    uint8_t hlen;
+    uint8_t hops;
+    uint32_t xid;
+    uint16_t secs;
+    uint16_t flags;
+    uint8_t ciaddr[IP4_ADDR_LEN];
+    uint8_t yiaddr[IP4_ADDR_LEN];
+    uint8_t siaddr[IP4_ADDR_LEN]; // next server, the bootserver
+    uint8_t giaddr[IP4_ADDR_LEN];
+    uint8_t chaddr[16];
+    uint8_t sname[64];
+    uint8_t file[128];
+    uint32_t magic;
+    uint8_t options[0];
+} __attribute__((packed));
+
+// IPv4 peers are handed to the UDP users as IPv4-mapped IPv6 addresses (::ffff:a.b.c.d),
+// udp6_tx_reserve() and friends pass those on to this stack. So netboot and TFTP work the
+// same over both.
+int ip6_addr_is_ip4(const ip6_addr* addr);
+
+// Enables the IPv4 stack, it is on by default. Has to be called before netifc_open().
+void ip4_set_enabled(int enabled);
+
+// provided by inet4.c
+void ip4_init(void* macaddr);
+// handles IPv4 and ARP frames
+void eth4_recv(void* data, size_t len);
+// DHCP and ARP retransmissions, called from the interface poll loop
+void ip4_poll(void);
+
+// nonzero once DHCP gave us an address
+int ip4_configured(void);
+// broadcast address of our subnet
+const ip6_addr* ip4_broadcast(void);
+// the next server DHCP pointed us to, NULL if there is none
+const ip6_addr* ip4_next_server(void);
+
+// IPv4 sides of udp6_tx_reserve() and udp6_tx_commit(). The payload of an IPv4
+// datagram sits at the same offset of the transmit buffer as the one of an
+// IPv6 datagram, the udp_tx_hdr in front of it says UDP_TX_IP4.
+void* udp4_tx_reserve(const ip6_addr* daddr, uint16_t dport, uint16_t sport, size_t* max_len);
+int udp4_tx_commit(void* payload, size_t len);
+
+// handle a DHCP reply
+void dhcp_recv(void* data, size_t len);
@@ -2,12 +2,16 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "checksum.h"
+#include "inet4.h"
 #include "inet6.h"
 #include "netboot.h"
+#include "netifc.h"
 
 // Enable at your own risk. Some of these packet errors can be fairly
 // common when the buffers start to overflow.
@@ -33,6 +37,9 @@ const ip6_addr ip6_ll_all_nodes = {
 const ip6_addr ip6_ll_all_routers = {
     .x = {0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2},
 };
+const ip6_addr ip6_ll_all_mld2_routers = {
+    .x = {0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x16},
+};
 
 // Convert MAC Address to IPv6 Link Local Address
 // aa:bb:cc:dd:ee:ff => FF80::aabb:ccFF:FEdd:eeff
@@ -87,14 +94,72 @@ ip6_addr ll_ip6_addr;
 mac_addr snm_mac_addr;
 ip6_addr snm_ip6_addr;
 
-// cache for the last source addresses we've seen
-static mac_addr rx_mac_addr;
-static ip6_addr rx_ip6_addr;
+// Global address formed from a router's prefix and our interface identifier. It has the
+// same solicited-node group as the link local address.
+static ip6_addr global_ip6_addr;
+static int have_global;
+static uint64_t global_expires_us;
+
+// Prefix advertised as on-link, everything else that is not link local goes to the router
+static ip6_addr onlink_prefix;
+static uint8_t onlink_prefix_len;
+static int have_onlink;
+static uint64_t onlink_expires_us;
+
+static ip6_addr router_ip6_addr;
+static int have_router;
+static uint64_t router_expires_us;
+
+// Router solicitations sent at startup until a router answers, see RFC 4861 6.3.7
+#define MAX_RTR_SOLICITATIONS 3
+#define RTR_SOLICITATION_INTERVAL_US 4000000
+static int rs_count;
+static uint64_t rs_next_us;
+
+// multicast groups joined on top of the all-nodes and solicited-node ones
+#define IP6_MAX_GROUPS 4
+static ip6_addr groups[IP6_MAX_GROUPS];
+static size_t group_count;
+
+// MLDv2 listener. Reports are sent twice when a group is joined, as unsolicited reports
+// may get lost, and once in response to a query. Query responses are delayed by a random
+// part of the querier's maximum response delay so a rack of devices doesn't answer at once.
+#define MLD_ROBUSTNESS 2
+#define MLD_UNSOLICITED_INTERVAL_US 1000000
+static uint64_t mld_report_us; // when the next report is due
+static int mld_reports;       // number of reports still to send
+static uint8_t mld_report_type;
+// A group that was left is reported the same way, on its own
+static ip6_addr mld_left;
+static uint64_t mld_leave_us;
+static int mld_leaves;
+
+static void mld_schedule(uint8_t type, uint64_t max_delay_us, int count) {
+    uint64_t now = netifc_time_us();
+    uint64_t at = now;
+    if (max_delay_us) {
+        // xorshift seeded with the time and our MAC, good enough to spread the replies
+        uint32_t x = (uint32_t)now ^ (ll_mac_addr.x[3] << 16 | ll_mac_addr.x[4] << 8 | ll_mac_addr.x[5]);
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        at += x % max_delay_us;
+    }
+    if (mld_reports >= count && mld_report_us <= at) {
+        // the report that is already scheduled answers this one as well
+        return;
+    }
+    mld_report_type = type;
+    mld_report_us = at;
+    mld_reports = count;
+}
 
 void ip6_init(void* macaddr) {
     char tmp[IP6TOAMAX];
     mac_addr all;
 
+    checksum_init();
+
     // save our ethernet MAC and synthesize link layer addresses
     memcpy(&ll_mac_addr, macaddr, 6);
     ll6addr_from_mac(&ll_ip6_addr, &ll_mac_addr);
@@ -106,6 +171,12 @@ void ip6_init(void* macaddr) {
     multicast_from_ip6(&all, &ip6_ll_all_nodes);
     eth_add_mcast_filter(&all);
 
+    // all-nodes is never reported, the solicited-node group is
+    mld_schedule(MLD2_CHANGE_TO_EXCLUDE, 0, MLD_ROBUSTNESS);
+    // look for routers on the first poll
+    rs_count = 0;
+    rs_next_us = 0;
+
     printf("macaddr: %02x:%02x:%02x:%02x:%02x:%02x\n",
            ll_mac_addr.x[0], ll_mac_addr.x[1], ll_mac_addr.x[2],
            ll_mac_addr.x[3], ll_mac_addr.x[4], ll_mac_addr.x[5]);
@@ -113,44 +184,160 @@ void ip6_init(void* macaddr) {
     printf("snmaddr: %s\n", ip6toa(tmp, &snm_ip6_addr));
 }
 
+int ip6_join_group(const ip6_addr* group) {
+    mac_addr mac;
+    for (size_t i = 0; i < group_count; i++) {
+        if (!memcmp(&groups[i], group, IP6_ADDR_LEN))
+            return 0;
+    }
+    if (group->x[0] != 0xFF || group_count == IP6_MAX_GROUPS)
+        return -1;
+    multicast_from_ip6(&mac, group);
+    if (eth_add_mcast_filter(&mac))
+        return -1;
+    memcpy(&groups[group_count++], group, IP6_ADDR_LEN);
+    mld_schedule(MLD2_CHANGE_TO_EXCLUDE, 0, MLD_ROBUSTNESS);
+    return 0;
+}
+
+static int mld_send_report(uint8_t type, const ip6_addr* group);
+
+void ip6_leave_group(const ip6_addr* group) {
+    size_t i = 0;
+    while (i < group_count && memcmp(&groups[i], group, IP6_ADDR_LEN)) {
+        i++;
+    }
+    if (i == group_count)
+        return;
+    groups[i] = groups[--group_count];
+
+    // the filter stays while any other group we listen to maps to the same MAC address
+    mac_addr mac, other;
+    multicast_from_ip6(&mac, group);
+    int shared = !memcmp(&mac, &snm_mac_addr, ETH_ADDR_LEN);
+    multicast_from_ip6(&other, &ip6_ll_all_nodes);
+    shared |= !memcmp(&mac, &other, ETH_ADDR_LEN);
+    for (size_t j = 0; j < group_count; j++) {
+        multicast_from_ip6(&other, &groups[j]);
+        shared |= !memcmp(&mac, &other, ETH_ADDR_LEN);
+    }
+    if (!shared)
+        eth_remove_mcast_filter(&mac);
+
+    memcpy(&mld_left, group, IP6_ADDR_LEN);
+    mld_send_report(MLD2_CHANGE_TO_INCLUDE, &mld_left);
+    mld_leaves = MLD_ROBUSTNESS - 1;
+    mld_leave_us = netifc_time_us() + MLD_UNSOLICITED_INTERVAL_US;
+}
+
+static int ip6_is_member(const uint8_t* addr) {
+    for (size_t i = 0; i < group_count; i++) {
+        if (!memcmp(&groups[i], addr, IP6_ADDR_LEN))
+            return 1;
+    }
+    return 0;
+}
+
 mac_addr eth_addr(void) {
     return ll_mac_addr;
 }
 
-static int resolve_ip6(mac_addr* _mac, const ip6_addr* _ip) {
-    const uint8_t* ip = _ip->x;
+// Path MTUs reported by ICMPv6 Packet Too Big messages, one entry per destination. Sized for
+// the TFTP sessions netboot runs at once, the oldest entry makes room for a new destination.
+#define PMTU_CACHE_SIZE 4
+
+static struct {
+    ip6_addr ip;
+    size_t mtu;
+} pmtu_cache[PMTU_CACHE_SIZE];
+static size_t pmtu_count;
+static size_t pmtu_next; // entry replaced next once the cache is full
+
+static size_t* pmtu_lookup(const ip6_addr* daddr) {
+    for (size_t i = 0; i < pmtu_count; i++) {
+        if (!memcmp(daddr, &pmtu_cache[i].ip, sizeof(ip6_addr)))
+            return &pmtu_cache[i].mtu;
+    }
+    return NULL;
+}
 
-    // Multicast addresses are a simple transform
-    if (ip[0] == 0xFF) {
-        multicast_from_ip6(_mac, _ip);
-        return 0;
+static void pmtu_update(const ip6_addr* daddr, size_t mtu) {
+    size_t* entry = pmtu_lookup(daddr);
+    if (!entry) {
+        size_t i = pmtu_count < PMTU_CACHE_SIZE ? pmtu_count++ : pmtu_next++ % PMTU_CACHE_SIZE;
+        memcpy(&pmtu_cache[i].ip, daddr, sizeof(ip6_addr));
+        entry = &pmtu_cache[i].mtu;
     }
+    *entry = mtu;
+}
 
-    // Trying to send to the IP that we last received a packet from?
-    // Assume their mac address has not changed
-    if (memcmp(_ip, &rx_ip6_addr, sizeof(rx_ip6_addr)) == 0) {
-        memcpy(_mac, &rx_mac_addr, sizeof(rx_mac_addr));
-        return 0;
+size_t ip6_path_mtu(const ip6_addr* daddr) {
+    size_t mtu = eth_mtu();
+    size_t* pmtu = pmtu_lookup(daddr);
+    if (pmtu && *pmtu < mtu) {
+        mtu = *pmtu;
     }
+    return mtu;
+}
 
-    // We don't know how to find peers or routers yet, so give up...
-    return -1;
+static uint16_t checksum(const void* data, size_t len, uint16_t sum) {
+    return csum_fold(csum_partial(data, len, sum));
+}
+
+uint16_t inet_checksum(const void* data, size_t len, uint16_t sum) {
+    return checksum(data, len, sum);
 }
 
-static uint16_t checksum(const void* _data, size_t len, uint16_t _sum) {
-    uint32_t sum = _sum;
-    const uint16_t* data = _data;
-    while (len > 1) {
-        sum += *data++;
-        len -= 2;
+// Checksum state of the UDP payload that is being handled with a deferred check
+static struct {
+    const uint8_t* start;  // payload start
+    const uint8_t* cursor; // payload bytes before it are summed already
+    const uint8_t* end;
+    uint64_t sum;
+    int pending;
+    int ok;
+} rx_csum = {.ok = 1};
+
+// Adds a piece of the pending payload to the checksum. Pieces that start at an odd
+// offset have their bytes swapped relative to the 16 bit words of the packet.
+static void rx_csum_add(uint16_t sum, const uint8_t* at) {
+    if ((at - rx_csum.start) & 1) {
+        sum = (sum >> 8) | (sum << 8);
     }
-    if (len) {
-        sum += (*data & 0xFF);
+    rx_csum.sum = csum_add(rx_csum.sum, sum);
+}
+
+void* udp6_csum_copy(void* dst, const void* src, size_t len) {
+    const uint8_t* p = src;
+    if (!rx_csum.pending || p < rx_csum.cursor || p + len > rx_csum.end) {
+        // not payload bytes we still have to check
+        if (dst != src) {
+            memcpy(dst, src, len);
+        }
+        return dst;
     }
-    while (sum > 0xFFFF) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    if (p > rx_csum.cursor) {
+        // bytes the handler skipped over
+        rx_csum_add(checksum(rx_csum.cursor, p - rx_csum.cursor, 0), rx_csum.cursor);
     }
-    return sum;
+    if (dst == src) {
+        rx_csum_add(checksum(p, len, 0), p);
+    } else {
+        rx_csum_add(csum_fold(csum_partial_copy(dst, p, len, 0)), p);
+    }
+    rx_csum.cursor = p + len;
+    return dst;
+}
+
+int udp6_csum_ok(void) {
+    if (rx_csum.pending) {
+        if (rx_csum.cursor < rx_csum.end) {
+            rx_csum_add(checksum(rx_csum.cursor, rx_csum.end - rx_csum.cursor, 0), rx_csum.cursor);
+        }
+        rx_csum.pending = 0;
+        rx_csum.ok = csum_fold(rx_csum.sum) == 0xFFFF;
+    }
+    return rx_csum.ok;
 }
 
 typedef struct {
@@ -159,8 +346,10 @@ typedef struct {
     uint8_t data[0];
 } ip6_pkt;
 
+// laid out as ip6_pkt, with the two bytes in front of the ethernet header named
 typedef struct {
-    uint8_t eth[16];
+    udp_tx_hdr tx;
+    uint8_t eth[ETH_HDR_LEN];
     ip6_hdr ip6;
     udp_hdr udp;
     uint8_t data[0];
@@ -182,6 +371,243 @@ static unsigned ip6_checksum(ip6_hdr* ip, unsigned type, size_t length) {
     }
 }
 
+// Checksum of an upper layer message that does not follow the IPv6 header
+// right away, |length| is the size of the message alone
+static uint16_t ip6_pseudo_checksum(const ip6_hdr* ip, unsigned type, const void* data, size_t length) {
+    uint16_t len = htons(length);
+    uint16_t sum = checksum(&len, 2, htons(type));
+    sum = checksum(ip->src, 32, sum);
+    return checksum(data, length, sum);
+}
+
+// Neighbor cache, see RFC 4861. Entries are learned from the packets we receive and from
+// Neighbor Advertisements. A destination that is not in the cache is solicited, the last
+// packet sent to it waits in its entry until the advertisement arrives. Every on-link peer
+// gets its own entry, so a packet from a stray host no longer redirects our replies.
+#define NEIGHBOR_CACHE_SIZE 16 // power of two
+#define NEIGHBOR_PROBES 4      // slots an address may live in
+#define NEIGHBOR_MAX_SOLICITS 3
+#define NEIGHBOR_RETRANS_US 1000000
+
+#define NEIGHBOR_FREE 0
+#define NEIGHBOR_INCOMPLETE 1
+#define NEIGHBOR_REACHABLE 2
+
+typedef struct {
+    ip6_addr ip;
+    mac_addr mac;
+    uint8_t state;
+    uint8_t solicits;
+    uint32_t used;       // value of neighbor_clock at the last use, for LRU eviction
+    uint64_t solicit_us; // when the last solicitation was sent
+    ip6_pkt* pending;    // packet waiting for the MAC
+    size_t pending_len;
+} neighbor;
+
+static neighbor neighbors[NEIGHBOR_CACHE_SIZE];
+static uint32_t neighbor_clock;
+
+static void udp6_tx_forget(const ip6_addr* daddr);
+static int icmp6_send(const void* data, size_t length, const ip6_addr* daddr);
+
+static int ip6_link_local(const ip6_addr* ip) {
+    return ip->x[0] == 0xFE && (ip->x[1] & 0xC0) == 0x80;
+}
+
+static int ip6_prefix_match(const ip6_addr* ip, const ip6_addr* prefix, unsigned len) {
+    unsigned bytes = len / 8, bits = len % 8;
+    if (memcmp(ip, prefix, bytes))
+        return 0;
+    return !bits || !((ip->x[bytes] ^ prefix->x[bytes]) & (0xFF << (8 - bits)));
+}
+
+// Neighbor that takes packets for |daddr|, the default router unless it is on-link
+static const ip6_addr* ip6_next_hop(const ip6_addr* daddr) {
+    if (daddr->x[0] == 0xFF || ip6_link_local(daddr) || !have_router)
+        return daddr;
+    if (have_onlink && ip6_prefix_match(daddr, &onlink_prefix, onlink_prefix_len))
+        return daddr;
+    return &router_ip6_addr;
+}
+
+// Source address for packets to |daddr|
+static const ip6_addr* ip6_source(const ip6_addr* daddr) {
+    if (have_global && daddr->x[0] != 0xFF && !ip6_link_local(daddr))
+        return &global_ip6_addr;
+    return &ll_ip6_addr;
+}
+
+static int ip6_is_local(const void* addr) {
+    return !memcmp(&ll_ip6_addr, addr, IP6_ADDR_LEN) ||
+           (have_global && !memcmp(&global_ip6_addr, addr, IP6_ADDR_LEN));
+}
+
+static unsigned neighbor_hash(const ip6_addr* ip) {
+    // the interface identifier differs between peers, the prefix usually does not
+    const uint8_t* x = ip->x;
+    uint32_t h = (x[12] << 24 | x[13] << 16 | x[14] << 8 | x[15]) ^ (x[10] << 8 | x[11]);
+    return (h * 0x9E3779B1u) >> 28;
+}
+
+static neighbor* neighbor_lookup(const ip6_addr* ip) {
+    unsigned h = neighbor_hash(ip);
+    for (unsigned i = 0; i < NEIGHBOR_PROBES; i++) {
+        neighbor* n = &neighbors[(h + i) & (NEIGHBOR_CACHE_SIZE - 1)];
+        if (n->state != NEIGHBOR_FREE && !memcmp(&n->ip, ip, IP6_ADDR_LEN))
+            return n;
+    }
+    return NULL;
+}
+
+static void neighbor_release(neighbor* n) {
+    if (n->pending) {
+        eth_put_buffer(n->pending);
+        n->pending = NULL;
+    }
+    n->state = NEIGHBOR_FREE;
+}
+
+static neighbor* neighbor_alloc(const ip6_addr* ip) {
+    unsigned h = neighbor_hash(ip);
+    neighbor* victim = NULL;
+    for (unsigned i = 0; i < NEIGHBOR_PROBES; i++) {
+        neighbor* n = &neighbors[(h + i) & (NEIGHBOR_CACHE_SIZE - 1)];
+        if (n->state == NEIGHBOR_FREE) {
+            victim = n;
+            break;
+        }
+        if (!victim || (int32_t)(n->used - victim->used) < 0)
+            victim = n;
+    }
+    if (victim->state != NEIGHBOR_FREE)
+        udp6_tx_forget(&victim->ip);
+    neighbor_release(victim);
+    memcpy(&victim->ip, ip, IP6_ADDR_LEN);
+    victim->solicits = 0;
+    victim->used = ++neighbor_clock;
+    return victim;
+}
+
+// Asks the solicited-node group of the neighbor for its MAC
+static void neighbor_solicit(neighbor* n) {
+    struct {
+        ndp_n_hdr hdr;
+        uint8_t opt[8];
+    } msg;
+    ip6_addr snm = {.x = {0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xFF}};
+
+    memcpy(snm.x + 13, n->ip.x + 13, 3);
+    msg.hdr.type = ICMP6_NDP_N_SOLICIT;
+    msg.hdr.code = 0;
+    msg.hdr.checksum = 0;
+    msg.hdr.flags = 0;
+    memcpy(msg.hdr.target, &n->ip, IP6_ADDR_LEN);
+    msg.opt[0] = NDP_N_SRC_LL_ADDR;
+    msg.opt[1] = 1;
+    memcpy(msg.opt + 2, &ll_mac_addr, ETH_ADDR_LEN);
+
+    n->solicits++;
+    n->solicit_us = netifc_time_us();
+    icmp6_send(&msg, sizeof(msg), &snm);
+}
+
+static int ip6_unicast(const ip6_addr* ip) {
+    static const ip6_addr unspecified;
+    return ip->x[0] != 0xFF && memcmp(ip, &unspecified, IP6_ADDR_LEN);
+}
+
+// Records that |ip| is at |mac|. Entries are created for peers that talk to us directly,
+// other packets (and unsolicited advertisements) only refresh what we know.
+static void neighbor_update(const ip6_addr* ip, const mac_addr* mac, int create) {
+    neighbor* n = neighbor_lookup(ip);
+    if (!n) {
+        if (!create || !ip6_unicast(ip))
+            return;
+        n = neighbor_alloc(ip);
+    }
+    n->used = ++neighbor_clock;
+    if (n->state == NEIGHBOR_REACHABLE && !memcmp(&n->mac, mac, ETH_ADDR_LEN))
+        return;
+
+    // new or moved neighbor, headers built for it before are stale
+    memcpy(&n->mac, mac, ETH_ADDR_LEN);
+    n->state = NEIGHBOR_REACHABLE;
+    udp6_tx_forget(ip);
+    if (n->pending) {
+        memcpy(n->pending->eth + 2, mac, ETH_ADDR_LEN);
+        eth_send(n->pending->eth + 2, n->pending_len);
+        n->pending = NULL;
+    }
+}
+
+static void neighbor_poll(uint64_t now) {
+    for (size_t i = 0; i < NEIGHBOR_CACHE_SIZE; i++) {
+        neighbor* n = &neighbors[i];
+        if (n->state != NEIGHBOR_INCOMPLETE || now - n->solicit_us < NEIGHBOR_RETRANS_US)
+            continue;
+        if (n->solicits < NEIGHBOR_MAX_SOLICITS) {
+            neighbor_solicit(n);
+        } else {
+            char tmp[IP6TOAMAX];
+            printf("neighbor %s does not respond\n", ip6toa(tmp, &n->ip));
+            udp6_tx_forget(&n->ip);
+            neighbor_release(n);
+        }
+    }
+}
+
+// Fills in the MAC of |_ip|. Unicast addresses we don't know yet get an all-zero MAC and
+// are solicited, ip6_transmit() holds the packet back until the neighbor answers.
+static int resolve_ip6(mac_addr* _mac, const ip6_addr* _ip) {
+    // Multicast addresses are a simple transform
+    if (_ip->x[0] == 0xFF) {
+        multicast_from_ip6(_mac, _ip);
+        return 0;
+    }
+    if (!ip6_unicast(_ip))
+        return -1;
+    _ip = ip6_next_hop(_ip);
+
+    neighbor* n = neighbor_lookup(_ip);
+    if (!n) {
+        n = neighbor_alloc(_ip);
+        n->state = NEIGHBOR_INCOMPLETE;
+        neighbor_solicit(n);
+    }
+    n->used = ++neighbor_clock;
+    if (n->state == NEIGHBOR_REACHABLE) {
+        memcpy(_mac, &n->mac, ETH_ADDR_LEN);
+    } else {
+        memset(_mac, 0, ETH_ADDR_LEN);
+    }
+    return 0;
+}
+
+// Sends a packet built by ip6_setup(), |len| counts from the ethernet header on
+static int ip6_transmit(ip6_pkt* p, size_t len) {
+    static const mac_addr unresolved;
+    if (memcmp(p->eth + 2, &unresolved, ETH_ADDR_LEN))
+        return eth_send(p->eth + 2, len);
+
+    neighbor* n = neighbor_lookup(ip6_next_hop((void*)p->ip6.dst));
+    if (n && n->state == NEIGHBOR_REACHABLE) {
+        // resolved since the headers were built
+        memcpy(p->eth + 2, &n->mac, ETH_ADDR_LEN);
+        return eth_send(p->eth + 2, len);
+    }
+    if (!n) {
+        // gave up on it
+        eth_put_buffer(p);
+        return -1;
+    }
+    // an older packet to the same neighbor would be stale by the time it gets out
+    if (n->pending)
+        eth_put_buffer(n->pending);
+    n->pending = p;
+    n->pending_len = len;
+    return 0;
+}
+
 static int ip6_setup(ip6_pkt* p, const ip6_addr* daddr, size_t length, uint8_t type) {
     mac_addr dmac;
 
@@ -199,54 +625,139 @@ static int ip6_setup(ip6_pkt* p, const ip6_addr* daddr, size_t length, uint8_t t
     p->ip6.length = htons(length);
     p->ip6.next_header = type;
     p->ip6.hop_limit = 255;
-    memcpy(p->ip6.src, &ll_ip6_addr, sizeof(ip6_addr));
+    memcpy(p->ip6.src, ip6_source(daddr), sizeof(ip6_addr));
     memcpy(p->ip6.dst, daddr, sizeof(ip6_addr));
 
     return 0;
 }
 
-#define UDP6_MAX_PAYLOAD (ETH_MTU - ETH_HDR_LEN - IP6_HDR_LEN - UDP_HDR_LEN)
+// Prebuilt ethernet, IPv6 and UDP headers for the peers we talk to. The UDP checksum
+// field holds the checksum of the pseudo header and UDP header without the lengths.
+#define TX_TEMPLATES 4
+static struct {
+    ip6_addr daddr;
+    uint16_t dport;
+    uint16_t sport;
+    int valid;
+    udp_pkt hdr;
+} tx_templates[TX_TEMPLATES];
+static unsigned tx_template_next = 0;
+
+static const udp_pkt* udp6_tx_template(const ip6_addr* daddr, uint16_t dport, uint16_t sport) {
+    for (int i = 0; i < TX_TEMPLATES; i++) {
+        if (tx_templates[i].valid && tx_templates[i].dport == dport &&
+            tx_templates[i].sport == sport &&
+            !memcmp(&tx_templates[i].daddr, daddr, sizeof(ip6_addr))) {
+            return &tx_templates[i].hdr;
+        }
+    }
+
+    unsigned i = tx_template_next++ % TX_TEMPLATES;
+    udp_pkt* p = &tx_templates[i].hdr;
+    tx_templates[i].valid = 0;
+    if (ip6_setup((void*)p, daddr, 0, HDR_UDP)) {
+        return NULL;
+    }
+    p->tx.family = UDP_TX_IP6;
+    p->tx.reserved = 0;
+    p->udp.src_port = htons(sport);
+    p->udp.dst_port = htons(dport);
+    p->udp.length = 0;
+    p->udp.checksum = 0;
+    // next header for the pseudo header, the addresses and the UDP header with zero length
+    p->udp.checksum = checksum(p->ip6.src, 32 + UDP_HDR_LEN, htons(HDR_UDP));
+
+    memcpy(&tx_templates[i].daddr, daddr, sizeof(ip6_addr));
+    tx_templates[i].dport = dport;
+    tx_templates[i].sport = sport;
+    tx_templates[i].valid = 1;
+    return p;
+}
 
-int udp6_send(const void* data, size_t dlen, const ip6_addr* daddr, uint16_t dport, uint16_t sport) {
-    size_t length = dlen + UDP_HDR_LEN;
-    udp_pkt* p = eth_get_buffer(ETH_MTU + 2);
+// Drops the headers built for destinations reached through |next_hop|, or all of them
+// if it is NULL
+static void udp6_tx_forget(const ip6_addr* next_hop) {
+    for (int i = 0; i < TX_TEMPLATES; i++) {
+        if (!next_hop ||
+            !memcmp(ip6_next_hop(&tx_templates[i].daddr), next_hop, sizeof(ip6_addr)))
+            tx_templates[i].valid = 0;
+    }
+}
 
+void* udp6_tx_reserve(const ip6_addr* daddr, uint16_t dport, uint16_t sport, size_t* max_len) {
+    if (ip6_addr_is_ip4(daddr))
+        return udp4_tx_reserve(daddr, dport, sport, max_len);
+    size_t mtu = ip6_path_mtu(daddr);
+    udp_pkt* p = eth_get_buffer(sizeof(udp_tx_hdr) + ETH_HDR_LEN + mtu);
     if (p == NULL)
-        return -1;
-    if (dlen > UDP6_MAX_PAYLOAD) {
-        printf("Internal error: UDP write request is too long\n");
-        goto fail;
-    }
-    if (ip6_setup((void*)p, daddr, length, HDR_UDP)) {
+        return NULL;
+
+    const udp_pkt* hdr = udp6_tx_template(daddr, dport, sport);
+    if (hdr == NULL) {
         printf("Error: ip6_setup failed!\n");
-        goto fail;
+        eth_put_buffer(p);
+        return NULL;
     }
+    memcpy(p, hdr, sizeof(udp_pkt));
+    *max_len = mtu - IP6_HDR_LEN - UDP_HDR_LEN;
+    return p->data;
+}
 
-    // udp header
-    p->udp.src_port = htons(sport);
-    p->udp.dst_port = htons(dport);
-    p->udp.length = htons(length);
-    p->udp.checksum = 0;
+static udp_pkt* udp6_tx_pkt(void* payload) {
+    return (void*)((uint8_t*)payload - sizeof(udp_pkt));
+}
 
-    memcpy(p->data, data, dlen);
-    p->udp.checksum = ip6_checksum(&p->ip6, HDR_UDP, length);
-    return eth_send(p->eth + 2, ETH_HDR_LEN + IP6_HDR_LEN + length);
+int udp6_tx_commit(void* payload, size_t dlen) {
+    udp_pkt* p = udp6_tx_pkt(payload);
+    size_t length = dlen + UDP_HDR_LEN;
 
-fail:
-    eth_put_buffer(p);
-    return -1;
+    if (p->tx.family == UDP_TX_IP4)
+        return udp4_tx_commit(payload, dlen);
+
+    if (IP6_HDR_LEN + length > ip6_path_mtu((void*)p->ip6.dst)) {
+        printf("Internal error: UDP write request is too long\n");
+        eth_put_buffer(p);
+        return -1;
+    }
+
+    p->ip6.length = htons(length);
+    p->udp.length = htons(length);
+    // the length appears in the pseudo header and in the UDP header
+    uint16_t sum = checksum(&p->udp.length, 2, p->udp.checksum);
+    sum = checksum(&p->udp.length, 2, sum);
+    sum = checksum(p->data, dlen, sum);
+    // 0 is illegal, so 0xffff remains 0xffff
+    p->udp.checksum = sum != 0xffff ? ~sum : sum;
+    return ip6_transmit((void*)p, ETH_HDR_LEN + IP6_HDR_LEN + length);
 }
 
-#define ICMP6_MAX_PAYLOAD (ETH_MTU - ETH_HDR_LEN - IP6_HDR_LEN)
+void udp6_tx_cancel(void* payload) {
+    eth_put_buffer(udp6_tx_pkt(payload));
+}
+
+int udp6_send(const void* data, size_t dlen, const ip6_addr* daddr, uint16_t dport, uint16_t sport) {
+    size_t max_len;
+    void* payload = udp6_tx_reserve(daddr, dport, sport, &max_len);
+
+    if (payload == NULL)
+        return -1;
+    if (dlen > max_len) {
+        printf("Internal error: UDP write request is too long\n");
+        udp6_tx_cancel(payload);
+        return -1;
+    }
+    memcpy(payload, data, dlen);
+    return udp6_tx_commit(payload, dlen);
+}
 
 static int icmp6_send(const void* data, size_t length, const ip6_addr* daddr) {
     ip6_pkt* p;
     icmp6_hdr* icmp;
 
-    p = eth_get_buffer(ETH_MTU + 2);
+    p = eth_get_buffer(ETH_HDR_LEN + IP6_HDR_LEN + length + 2);
     if (p == NULL)
         return -1;
-    if (length > ICMP6_MAX_PAYLOAD) {
+    if (IP6_HDR_LEN + length > ip6_path_mtu(daddr)) {
         printf("Internal error: ICMP write request is too long\n");
         goto fail;
     }
@@ -258,66 +769,302 @@ static int icmp6_send(const void* data, size_t length, const ip6_addr* daddr) {
     icmp = (void*)p->data;
     memcpy(icmp, data, length);
     icmp->checksum = ip6_checksum(&p->ip6, HDR_ICMP6, length);
-    return eth_send(p->eth + 2, ETH_HDR_LEN + IP6_HDR_LEN + length);
+    return ip6_transmit(p, ETH_HDR_LEN + IP6_HDR_LEN + length);
 
 fail:
     eth_put_buffer(p);
     return -1;
 }
 
-void udp6_recv(ip6_hdr* ip, void* _data, size_t len) {
-    udp_hdr* udp = _data;
-    uint16_t sum, n;
+#define IP6_OPT_PADN 1
+#define IP6_OPT_ROUTER_ALERT 5
+#define IP6_HBH_LEN 8
 
-    if (len < UDP_HDR_LEN)
-        BAD("Bogus Header Len");
+// Reports all groups we listen to but all-nodes, or just |group| if it is set
+static int mld_send_report(uint8_t type, const ip6_addr* group) {
+    ip6_pkt* p;
+    size_t count = group ? 1 : 1 + group_count;
+    size_t icmp_len = sizeof(mld2_report) + count * sizeof(mld2_record);
+    size_t length = IP6_HBH_LEN + icmp_len;
 
-    if (udp->checksum == 0)
-        BAD("Missing checksum");
+    p = eth_get_buffer(ETH_HDR_LEN + IP6_HDR_LEN + length + 2);
+    if (p == NULL)
+        return -1;
+    if (ip6_setup(p, &ip6_ll_all_mld2_routers, length, HDR_HNH_OPT))
+        goto fail;
+    p->ip6.hop_limit = 1;
+
+    // Hop-by-Hop header with the Router Alert option, routers have to look at MLD messages
+    uint8_t* hbh = p->data;
+    hbh[0] = HDR_ICMP6;
+    hbh[1] = 0; // 8 bytes
+    hbh[2] = IP6_OPT_ROUTER_ALERT;
+    hbh[3] = 2;
+    hbh[4] = 0; // MLD
+    hbh[5] = 0;
+    hbh[6] = IP6_OPT_PADN;
+    hbh[7] = 0;
+
+    mld2_report* report = (void*)(hbh + IP6_HBH_LEN);
+    report->type = ICMP6_MLD2_REPORT;
+    report->code = 0;
+    report->checksum = 0;
+    report->reserved = 0;
+    report->num_records = htons(count);
+    mld2_record* record = (void*)(report + 1);
+    for (size_t i = 0; i < count; i++) {
+        record[i].type = type;
+        record[i].aux_len = 0;
+        record[i].num_sources = 0;
+        memcpy(record[i].group, group ? group : i ? &groups[i - 1] : &snm_ip6_addr, IP6_ADDR_LEN);
+    }
+    uint16_t sum = ip6_pseudo_checksum(&p->ip6, HDR_ICMP6, report, icmp_len);
+    report->checksum = sum != 0xffff ? ~sum : sum;
+    return eth_send(p->eth + 2, ETH_HDR_LEN + IP6_HDR_LEN + length);
+
+fail:
+    eth_put_buffer(p);
+    return -1;
+}
+
+// Maximum response delay of an MLD query
+static uint64_t mld_max_delay_us(const mld_query* query, size_t len) {
+    uint32_t code = ntohs(query->max_resp_code);
+    if (len >= sizeof(mld_query) + 4 && code >= 0x8000) {
+        // MLDv2 queries are longer and encode large delays as 1eeemmmmmmmmmmmm
+        code = ((code & 0xFFF) | 0x1000) << (((code >> 12) & 7) + 3);
+    }
+    return (uint64_t)code * 1000;
+}
+
+void udp_recv(void* _data, size_t len, uint16_t sum, int verify,
+              const ip6_addr* daddr, const ip6_addr* saddr) {
+    udp_hdr* udp = _data;
+    uint16_t n;
 
     if (udp->checksum == 0xFFFF)
         udp->checksum = 0;
 
-    sum = checksum(&ip->length, 2, htons(HDR_UDP));
-    sum = checksum(ip->src, 32 + len, sum);
-    if (sum != 0xFFFF)
-        BAD("Checksum Incorrect");
+    uint16_t dport = ntohs(udp->dst_port);
+    uint16_t sport = ntohs(udp->src_port);
+    // Netboot and TFTP handlers copy the payload to its destination and check the
+    // checksum on the way, see udp6_csum_copy(). Everything else is checked here.
+    int deferred = dport == NB_SERVER_PORT || dport == NB_TFTP_INCOMING_PORT ||
+                   dport == NB_TFTP_OUTGOING_PORT || dport == NB_MCAST_PORT;
+
+    if (!verify) {
+        // nothing to check, udp6_csum_ok() reports success
+    } else if (deferred) {
+        sum = checksum(_data, UDP_HDR_LEN, sum);
+        rx_csum.start = (uint8_t*)_data + UDP_HDR_LEN;
+        rx_csum.cursor = rx_csum.start;
+        rx_csum.end = (uint8_t*)_data + len;
+        rx_csum.sum = sum;
+        rx_csum.pending = 1;
+    } else {
+        sum = checksum(_data, len, sum);
+        if (sum != 0xFFFF)
+            BAD("Checksum Incorrect");
+    }
 
     n = ntohs(udp->length);
     if (n < UDP_HDR_LEN)
-        BAD("Bogus Header Len");
+        goto done;
     if (n > len)
-        BAD("Packet Too Short");
+        goto done;
     len = n - UDP_HDR_LEN;
 
-    uint16_t dport = ntohs(udp->dst_port);
-    uint16_t sport = ntohs(udp->src_port);
-
     switch (dport) {
     case NB_SERVER_PORT:
-        netboot_recv((uint8_t*)_data + UDP_HDR_LEN, len, (void*)ip->src, sport);
+        netboot_recv((uint8_t*)_data + UDP_HDR_LEN, len, saddr, sport);
         break;
     case NB_TFTP_INCOMING_PORT:
     case NB_TFTP_OUTGOING_PORT:
-        tftp_recv((uint8_t*)_data + UDP_HDR_LEN, len, (void*)ip->dst, dport, (void*)ip->src, sport);
+        tftp_recv((uint8_t*)_data + UDP_HDR_LEN, len, daddr, dport, saddr, sport);
+        break;
+    case NB_MCAST_PORT:
+        netboot_mcast_recv((uint8_t*)_data + UDP_HDR_LEN, len, daddr, saddr);
+        break;
+    case DHCP_CLIENT_PORT:
+        if (ip6_addr_is_ip4(saddr))
+            dhcp_recv((uint8_t*)_data + UDP_HDR_LEN, len);
         break;
     default:
         // Ignore
+        break;
+    }
+
+done:
+    rx_csum.pending = 0;
+    rx_csum.ok = 1;
+}
+
+void udp6_recv(ip6_hdr* ip, void* _data, size_t len) {
+    udp_hdr* udp = _data;
+
+    if (len < UDP_HDR_LEN)
+        BAD("Bogus Header Len");
+
+    if (udp->checksum == 0)
+        BAD("Missing checksum");
+
+    // length and next header, then the addresses of the pseudo header
+    uint16_t sum = checksum(&ip->length, 2, htons(HDR_UDP));
+    sum = checksum(ip->src, 32, sum);
+    udp_recv(_data, len, sum, 1, (void*)ip->dst, (void*)ip->src);
+}
+
+// Returns the first NDP option |type| between |opt| and |end|
+static const uint8_t* ndp_option(const uint8_t* opt, const uint8_t* end, uint8_t type) {
+    while (end - opt >= 8) {
+        size_t opt_len = opt[1] * 8;
+        if (opt_len == 0 || opt_len > (size_t)(end - opt))
+            return NULL;
+        if (opt[0] == type)
+            return opt;
+        opt += opt_len;
+    }
+    return NULL;
+}
+
+// Returns the link-layer address option |type| of a neighbor message
+static const mac_addr* ndp_ll_option(ndp_n_hdr* ndp, size_t len, uint8_t type) {
+    const uint8_t* opt = ndp_option(ndp->options, (const uint8_t*)ndp + len, type);
+    return opt ? (const void*)(opt + 2) : NULL;
+}
+
+static void router_solicit(void) {
+    struct {
+        ndp_rs_hdr hdr;
+        uint8_t opt[8];
+    } msg;
+
+    msg.hdr.type = ICMP6_NDP_R_SOLICIT;
+    msg.hdr.code = 0;
+    msg.hdr.checksum = 0;
+    msg.hdr.reserved = 0;
+    msg.opt[0] = NDP_N_SRC_LL_ADDR;
+    msg.opt[1] = 1;
+    memcpy(msg.opt + 2, &ll_mac_addr, ETH_ADDR_LEN);
+    icmp6_send(&msg, sizeof(msg), &ip6_ll_all_routers);
+}
+
+static uint64_t ip6_expires(uint32_t lifetime) {
+    return lifetime == 0xFFFFFFFF ? UINT64_MAX : netifc_time_us() + (uint64_t)lifetime * 1000000;
+}
+
+static void ip6_router_update(const ip6_addr* src, uint16_t lifetime) {
+    char tmp[IP6TOAMAX];
+    int same = have_router && !memcmp(&router_ip6_addr, src, IP6_ADDR_LEN);
+    if (!lifetime) {
+        if (same) {
+            udp6_tx_forget(NULL);
+            have_router = 0;
+        }
+        return;
+    }
+    if (!same) {
+        // off-link destinations move to the new router
+        udp6_tx_forget(NULL);
+        memcpy(&router_ip6_addr, src, IP6_ADDR_LEN);
+        have_router = 1;
+        printf("router: %s\n", ip6toa(tmp, &router_ip6_addr));
+    }
+    router_expires_us = ip6_expires(lifetime);
+}
+
+static void ip6_prefix_update(const ndp_prefix_info* info) {
+    char tmp[IP6TOAMAX];
+    const ip6_addr* prefix = (const void*)info->prefix;
+    uint32_t valid = ntohl(info->valid_lifetime);
+
+    if (ip6_link_local(prefix) || info->prefix_len > 128)
         return;
+    if (info->flags & NDP_PREFIX_ONLINK) {
+        int same = have_onlink && onlink_prefix_len == info->prefix_len &&
+                   ip6_prefix_match(prefix, &onlink_prefix, info->prefix_len);
+        if (valid && !same) {
+            udp6_tx_forget(NULL);
+            memcpy(&onlink_prefix, prefix, IP6_ADDR_LEN);
+            onlink_prefix_len = info->prefix_len;
+            have_onlink = 1;
+        } else if (!valid && same) {
+            udp6_tx_forget(NULL);
+            have_onlink = 0;
+        }
+        if (valid)
+            onlink_expires_us = ip6_expires(valid);
+    }
+    // our interface identifier is 64 bits long, so only /64 prefixes form an address
+    if ((info->flags & NDP_PREFIX_AUTONOMOUS) && info->prefix_len == 64) {
+        ip6_addr addr;
+        memcpy(addr.x, prefix, 8);
+        memcpy(addr.x + 8, ll_ip6_addr.x + 8, 8);
+        int same = have_global && !memcmp(&global_ip6_addr, &addr, IP6_ADDR_LEN);
+        if (valid && !have_global) {
+            // headers built so far carry the link local source address
+            udp6_tx_forget(NULL);
+            memcpy(&global_ip6_addr, &addr, IP6_ADDR_LEN);
+            have_global = 1;
+            printf("ip6addr: %s (autoconfigured)\n", ip6toa(tmp, &global_ip6_addr));
+        } else if (!valid && same) {
+            udp6_tx_forget(NULL);
+            have_global = 0;
+        }
+        if (valid && !memcmp(&global_ip6_addr, &addr, IP6_ADDR_LEN))
+            global_expires_us = ip6_expires(valid);
+    }
+}
+
+// Solicits routers at startup and forgets what they told us once it expires
+static void router_poll(uint64_t now) {
+    if (!have_router && rs_count < MAX_RTR_SOLICITATIONS && now >= rs_next_us) {
+        router_solicit();
+        rs_count++;
+        rs_next_us = now + RTR_SOLICITATION_INTERVAL_US;
+    }
+    if (have_router && now >= router_expires_us) {
+        udp6_tx_forget(NULL);
+        have_router = 0;
+    }
+    if (have_onlink && now >= onlink_expires_us) {
+        udp6_tx_forget(NULL);
+        have_onlink = 0;
+    }
+    if (have_global && now >= global_expires_us) {
+        udp6_tx_forget(NULL);
+        have_global = 0;
+    }
+}
+
+void ip6_poll(void) {
+    uint64_t now = netifc_time_us();
+    neighbor_poll(now);
+    router_poll(now);
+    if (mld_leaves && now >= mld_leave_us) {
+        mld_send_report(MLD2_CHANGE_TO_INCLUDE, &mld_left);
+        mld_leaves--;
+        mld_leave_us = now + MLD_UNSOLICITED_INTERVAL_US;
     }
+    if (!mld_reports || now < mld_report_us)
+        return;
+    mld_send_report(mld_report_type, NULL);
+    mld_reports--;
+    mld_report_us = now + MLD_UNSOLICITED_INTERVAL_US;
 }
 
 void icmp6_recv(ip6_hdr* ip, void* _data, size_t len) {
     icmp6_hdr* icmp = _data;
     uint16_t sum;
+    char tmp[IP6TOAMAX];
 
     if (icmp->checksum == 0)
         BAD("Checksum Invalid");
     if (icmp->checksum == 0xFFFF)
         icmp->checksum = 0;
 
-    sum = checksum(&ip->length, 2, htons(HDR_ICMP6));
-    sum = checksum(ip->src, 32 + len, sum);
+    // a Hop-by-Hop header may sit between the IPv6 header and the message
+    sum = ip6_pseudo_checksum(ip, HDR_ICMP6, _data, len);
     if (sum != 0xFFFF)
         BAD("Checksum Incorrect");
 
@@ -332,19 +1079,38 @@ void icmp6_recv(ip6_hdr* ip, void* _data, size_t len) {
             BAD("Bogus NDP Message");
         if (ndp->code != 0)
             BAD("Bogus NDP Code");
-        if (memcmp(ndp->target, &ll_ip6_addr, IP6_ADDR_LEN))
+        if (!ip6_is_local(ndp->target))
             BAD("NDP Not For Me");
 
+        // the sender is about to talk to us
+        const mac_addr* slla = ndp_ll_option(ndp, len, NDP_N_SRC_LL_ADDR);
+        if (slla)
+            neighbor_update((void*)ip->src, slla, 1);
+
         msg.hdr.type = ICMP6_NDP_N_ADVERTISE;
         msg.hdr.code = 0;
         msg.hdr.checksum = 0;
         msg.hdr.flags = 0x60; // (S)olicited and (O)verride flags
-        memcpy(msg.hdr.target, &ll_ip6_addr, IP6_ADDR_LEN);
+        memcpy(msg.hdr.target, ndp->target, IP6_ADDR_LEN);
         msg.opt[0] = NDP_N_TGT_LL_ADDR;
         msg.opt[1] = 1;
         memcpy(msg.opt + 2, &ll_mac_addr, ETH_ADDR_LEN);
 
-        icmp6_send(&msg, sizeof(msg), (void*)ip->src);
+        // duplicate address detection comes from ::, the answer goes to everyone
+        icmp6_send(&msg, sizeof(msg), ip6_unicast((void*)ip->src) ? (void*)ip->src : &ip6_ll_all_nodes);
+        return;
+    }
+
+    if (icmp->type == ICMP6_NDP_N_ADVERTISE) {
+        ndp_n_hdr* ndp = _data;
+
+        if (len < sizeof(ndp_n_hdr))
+            BAD("Bogus NDP Message");
+        if (ndp->code != 0)
+            BAD("Bogus NDP Code");
+        const mac_addr* tlla = ndp_ll_option(ndp, len, NDP_N_TGT_LL_ADDR);
+        if (tlla)
+            neighbor_update((void*)ndp->target, tlla, 0);
         return;
     }
 
@@ -355,18 +1121,105 @@ void icmp6_recv(ip6_hdr* ip, void* _data, size_t len) {
         return;
     }
 
+    if (icmp->type == ICMP6_NDP_R_ADVERTISE) {
+        ndp_ra_hdr* ra = _data;
+        const uint8_t* end = (const uint8_t*)_data + len;
+
+        if (len < sizeof(ndp_ra_hdr))
+            BAD("Bogus Router Advertisement");
+        if (ip->hop_limit != 255 || !ip6_link_local((void*)ip->src))
+            BAD("Router Advertisement Not Link Local");
+        const uint8_t* opt = ndp_option(ra->options, end, NDP_N_SRC_LL_ADDR);
+        if (opt)
+            neighbor_update((void*)ip->src, (const void*)(opt + 2), 1);
+        ip6_router_update((void*)ip->src, ntohs(ra->router_lifetime));
+        for (opt = ra->options; (opt = ndp_option(opt, end, NDP_N_PREFIX_INFO)); opt += opt[1] * 8) {
+            if (opt[1] == sizeof(ndp_prefix_info) / 8)
+                ip6_prefix_update((const void*)opt);
+        }
+        return;
+    }
+
+    if (icmp->type == ICMP6_MLD_QUERY) {
+        static const uint8_t any[IP6_ADDR_LEN];
+        mld_query* query = _data;
+
+        if (len < sizeof(mld_query))
+            BAD("Bogus MLD Query");
+        if (ip->hop_limit != 1 || ip->src[0] != 0xFE || (ip->src[1] & 0xC0) != 0x80)
+            BAD("MLD Query Not Link Local");
+        // general query, or one for a group we are in
+        if (memcmp(query->group, any, IP6_ADDR_LEN) &&
+            memcmp(query->group, &snm_ip6_addr, IP6_ADDR_LEN) &&
+            !ip6_is_member(query->group))
+            return;
+        mld_schedule(MLD2_MODE_IS_EXCLUDE, mld_max_delay_us(query, len), 1);
+        return;
+    }
+
+    if (icmp->type == ICMP6_PACKET_TOO_BIG) {
+        // type, code, checksum, MTU and then the start of the packet we sent
+        struct {
+            icmp6_hdr hdr;
+            uint32_t mtu;
+            ip6_hdr ip6;
+        } __attribute__((packed))* ptb = _data;
+
+        if (len < sizeof(*ptb))
+            BAD("Bogus Packet Too Big Message");
+        if (!ip6_is_local(ptb->ip6.src))
+            BAD("Packet Too Big Not For Me");
+
+        // links have to carry at least IP6_MIN_MTU, don't go below that
+        size_t mtu = ntohl(ptb->mtu);
+        if (mtu < IP6_MIN_MTU)
+            mtu = IP6_MIN_MTU;
+        if (mtu >= ip6_path_mtu((void*)ptb->ip6.dst))
+            return;
+        pmtu_update((void*)ptb->ip6.dst, mtu);
+        printf("path mtu to %s is %zu\n", ip6toa(tmp, (void*)ptb->ip6.dst), mtu);
+        return;
+    }
+
     BAD("ICMP6 Unhandled %d", icmp->type);
 }
 
+void* eth_rx_target(size_t* len, size_t* headroom) {
+    size_t hdr_len = ETH_HDR_LEN + IP6_HDR_LEN + UDP_HDR_LEN;
+    size_t payload_len;
+    uint8_t* payload = tftp_rx_target(&hdr_len, &payload_len);
+    if (!payload) {
+        return NULL;
+    }
+    *headroom = ETH_HDR_LEN + IP6_HDR_LEN + UDP_HDR_LEN + hdr_len;
+    *len = *headroom + payload_len;
+    return payload - *headroom;
+}
+
+int eth_rx_target_hit(const void* frame, size_t len) {
+    const uint8_t* data = frame;
+    const ip6_hdr* ip = (const void*)(data + ETH_HDR_LEN);
+    const udp_hdr* udp = (const void*)(data + ETH_HDR_LEN + IP6_HDR_LEN);
+    size_t hdr_len = ETH_HDR_LEN + IP6_HDR_LEN + UDP_HDR_LEN;
+    if (len < hdr_len || data[12] != (ETH_IP6 >> 8) || data[13] != (ETH_IP6 & 0xFF) ||
+        ip->next_header != HDR_UDP || ntohs(udp->dst_port) != NB_TFTP_OUTGOING_PORT) {
+        return 0;
+    }
+    return tftp_rx_target_hit(data + hdr_len, len - hdr_len, (const void*)ip->src,
+                              ntohs(udp->src_port));
+}
+
 void eth_recv(void* _data, size_t len) {
     uint8_t* data = _data;
     ip6_hdr* ip;
     uint32_t n;
 
+    if (len >= ETH_HDR_LEN && (data[12] != (ETH_IP6 >> 8) || data[13] != (ETH_IP6 & 0xFF))) {
+        eth4_recv(data, len);
+        return;
+    }
     if (len < (ETH_HDR_LEN + IP6_HDR_LEN))
         BAD("Bogus Header Len");
-    if (data[12] != (ETH_IP6 >> 8) || data[13] != (ETH_IP6 & 0xFF))
-        BAD("Not IP6");
 
     ip = (void*)(data + ETH_HDR_LEN);
     data += (ETH_HDR_LEN + IP6_HDR_LEN);
@@ -385,15 +1238,27 @@ void eth_recv(void* _data, size_t len) {
     len = n;
 
     // require that we are the destination
-    if (memcmp(&ll_ip6_addr, ip->dst, IP6_ADDR_LEN) &&
+    if (!ip6_is_local(ip->dst) &&
         memcmp(&snm_ip6_addr, ip->dst, IP6_ADDR_LEN) &&
-        memcmp(&ip6_ll_all_nodes, ip->dst, IP6_ADDR_LEN)) {
+        memcmp(&ip6_ll_all_nodes, ip->dst, IP6_ADDR_LEN) &&
+        !ip6_is_member(ip->dst)) {
         return;
     }
 
-    // stash the sender's info to simplify replies
-    memcpy(&rx_mac_addr, (uint8_t*)_data + 6, ETH_ADDR_LEN);
-    memcpy(&rx_ip6_addr, ip->src, IP6_ADDR_LEN);
+    // remember where the sender is, replies go back to it (or to the router it came through)
+    if (ip6_next_hop((void*)ip->src) == (void*)ip->src)
+        neighbor_update((void*)ip->src, (void*)((uint8_t*)_data + 6), ip->dst[0] != 0xFF);
+
+    if (ip->next_header == HDR_HNH_OPT) {
+        // MLD queries come with a Router Alert option, none of the options concern us
+        if (len < IP6_HBH_LEN || len < (size_t)IP6_HBH_LEN * (data[1] + 1))
+            BAD("Bogus Hop-by-Hop Header");
+        if (data[0] != HDR_ICMP6)
+            BAD("Unhandled IP6 %d after Hop-by-Hop options", data[0]);
+        n = IP6_HBH_LEN * (data[1] + 1);
+        icmp6_recv(ip, data + n, len - n);
+        return;
+    }
 
     if (ip->next_header == HDR_ICMP6) {
         icmp6_recv(ip, data, len);
@@ -463,3 +1328,91 @@ middle_zeros:
     }
     return _out;
 }
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int ip4_parse_mapped(uint8_t* x, const char* str) {
+    x[10] = 0xFF;
+    x[11] = 0xFF;
+    for (int i = 0; i < 4; i++) {
+        unsigned n = 0;
+        int digits = 0;
+        while (*str >= '0' && *str <= '9') {
+            n = n * 10 + (*str++ - '0');
+            if (++digits > 3 || n > 255)
+                return -1;
+        }
+        if (!digits || *str != (i < 3 ? '.' : '\0'))
+            return -1;
+        x[12 + i] = n;
+        str++;
+    }
+    return 0;
+}
+
+int ip6_parse(ip6_addr* out, const char* str) {
+    uint8_t* x = out->x;
+    int groups = 0;
+    int gap = -1; // group the "::" stands in front of
+
+    memset(out, 0, sizeof(*out));
+    if (!strchr(str, ':'))
+        return ip4_parse_mapped(x, str);
+
+    if (str[0] == ':' && str[1] == ':') {
+        gap = 0;
+        str += 2;
+    }
+    while (*str) {
+        unsigned n = 0;
+        int digits = 0;
+        int v;
+        if (groups == 8)
+            return -1;
+        while ((v = hex_value(*str)) >= 0) {
+            n = (n << 4) | v;
+            str++;
+            if (++digits > 4)
+                return -1;
+        }
+        if (!digits)
+            return -1;
+        x[2 * groups] = n >> 8;
+        x[2 * groups + 1] = n & 0xFF;
+        groups++;
+        if (*str == '\0')
+            break;
+        if (*str++ != ':')
+            return -1;
+        if (*str == ':') {
+            if (gap >= 0)
+                return -1;
+            gap = groups;
+            str++;
+        } else if (*str == '\0') {
+            return -1;
+        }
+    }
+
+    if (gap < 0)
+        return groups == 8 ? 0 : -1;
+    if (groups == 8)
+        return -1;
+    // move the groups after the "::" to the end
+    for (int i = groups - 1; i >= gap; i--) {
+        int to = 8 - groups + i;
+        x[2 * to] = x[2 * i];
+        x[2 * to + 1] = x[2 * i + 1];
+        x[2 * i] = 0;
+        x[2 * i + 1] = 0;
+    }
+    return 0;
+}
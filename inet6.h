@@ -13,10 +13,18 @@ typedef struct ip6_hdr_t ip6_hdr;
 typedef struct udp_hdr_t udp_hdr;
 typedef struct icmp6_hdr_t icmp6_hdr;
 typedef struct ndp_n_hdr_t ndp_n_hdr;
+typedef struct ndp_rs_hdr_t ndp_rs_hdr;
+typedef struct ndp_ra_hdr_t ndp_ra_hdr;
+typedef struct ndp_prefix_info_t ndp_prefix_info;
+typedef struct mld_query_t mld_query;
+typedef struct mld2_report_t mld2_report;
+typedef struct mld2_record_t mld2_record;
 
 #define ETH_ADDR_LEN 6
 #define ETH_HDR_LEN 14
 #define ETH_MTU 1514
+// largest frame we handle, 9000 byte jumbo payload plus the ethernet header
+#define ETH_MAX_FRAME (9000 + ETH_HDR_LEN)
 
 #define IP6_ADDR_LEN 16
 #define IP6_HDR_LEN 40
@@ -35,6 +43,7 @@ struct ip6_addr_t {
 
 extern const ip6_addr ip6_ll_all_nodes;
 extern const ip6_addr ip6_ll_all_routers;
+extern const ip6_addr ip6_ll_all_mld2_routers;
 
 #define ETH_IP4 0x0800
 #define ETH_ARP 0x0806
@@ -73,6 +82,11 @@ struct udp_hdr_t {
 #define ICMP6_ECHO_REQUEST 128
 #define ICMP6_ECHO_REPLY 129
 
+#define ICMP6_MLD_QUERY 130
+#define ICMP6_MLD2_REPORT 143
+
+#define ICMP6_NDP_R_SOLICIT 133
+#define ICMP6_NDP_R_ADVERTISE 134
 #define ICMP6_NDP_N_SOLICIT 135
 #define ICMP6_NDP_N_ADVERTISE 136
 
@@ -97,6 +111,70 @@ struct ndp_n_hdr_t {
 #define NDP_N_REDIRECTED_HDR 4
 #define NDP_N_MTU 5
 
+struct ndp_rs_hdr_t {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+    uint32_t reserved;
+    uint8_t options[0];
+} __attribute__((packed));
+
+struct ndp_ra_hdr_t {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+    uint8_t hop_limit;
+    uint8_t flags;
+    uint16_t router_lifetime; // seconds, 0 if the sender is not a default router
+    uint32_t reachable_time;
+    uint32_t retrans_timer;
+    uint8_t options[0];
+} __attribute__((packed));
+
+#define NDP_PREFIX_ONLINK 0x80
+#define NDP_PREFIX_AUTONOMOUS 0x40
+
+struct ndp_prefix_info_t {
+    uint8_t type;
+    uint8_t len;
+    uint8_t prefix_len;
+    uint8_t flags;
+    uint32_t valid_lifetime; // seconds, 0xFFFFFFFF is forever
+    uint32_t preferred_lifetime;
+    uint32_t reserved;
+    uint8_t prefix[IP6_ADDR_LEN];
+} __attribute__((packed));
+
+struct mld_query_t {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+    uint16_t max_resp_code; // milliseconds, MLDv2 uses a floating point format above 32767
+    uint16_t reserved;
+    uint8_t group[IP6_ADDR_LEN]; // :: for a general query
+} __attribute__((packed));
+
+struct mld2_report_t {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+    uint16_t reserved;
+    uint16_t num_records;
+} __attribute__((packed));
+
+#define MLD2_MODE_IS_EXCLUDE 2
+#define MLD2_CHANGE_TO_INCLUDE 3
+#define MLD2_CHANGE_TO_EXCLUDE 4
+
+// EXCLUDE with no sources, that is every source, which is the only mode we listen in.
+// Leaving a group is INCLUDE with no sources.
+struct mld2_record_t {
+    uint8_t type;
+    uint8_t aux_len;
+    uint16_t num_sources;
+    uint8_t group[IP6_ADDR_LEN];
+} __attribute__((packed));
+
 #ifndef ntohs
 #define ntohs(n) _swap16(n)
 #define htons(n) _swap16(n)
@@ -119,25 +197,96 @@ static inline uint32_t _swap32(uint32_t n) {
 char* ip6toa(char* _out, void* ip6addr);
 #define IP6TOAMAX 40
 
+// Parses the text form of an IP6 address, or an IP4 address in dotted decimal notation
+// into an IPv4-mapped address. Returns 0 on success.
+int ip6_parse(ip6_addr* out, const char* str);
+
 // provided by inet6.c
 void ip6_init(void* macaddr);
 void eth_recv(void* data, size_t len);
 mac_addr eth_addr(void);
+// start receiving packets sent to the multicast |group|
+int ip6_join_group(const ip6_addr* group);
+// stop receiving packets sent to a |group| joined before
+void ip6_leave_group(const ip6_addr* group);
+// sends the MLD reports that are due, called from the interface poll loop
+void ip6_poll(void);
 
 // provided by interface driver
 void* eth_get_buffer(size_t len);
 void eth_put_buffer(void* ptr);
 int eth_send(void* data, size_t len);
 int eth_add_mcast_filter(const mac_addr* addr);
+int eth_remove_mcast_filter(const mac_addr* addr);
+// largest IP packet the link can carry
+size_t eth_mtu(void);
+
+// largest IP packet we can send to |daddr|, the link MTU unless the path
+// reported a smaller one with an ICMPv6 Packet Too Big message
+size_t ip6_path_mtu(const ip6_addr* daddr);
 
 // call to transmit a UDP packet
 int udp6_send(const void* data, size_t len,
               const ip6_addr* daddr, uint16_t dport,
               uint16_t sport);
 
+// Builds a UDP packet in place. udp6_tx_reserve() takes a transmit buffer with
+// the headers for |daddr| filled in from a per-peer template and returns the
+// payload area, |*max_len| is set to the room it has. The payload is written
+// there and sent with udp6_tx_commit(), which fills in the lengths and the
+// checksum. udp6_tx_cancel() returns an unused buffer.
+void* udp6_tx_reserve(const ip6_addr* daddr, uint16_t dport, uint16_t sport, size_t* max_len);
+int udp6_tx_commit(void* payload, size_t len);
+void udp6_tx_cancel(void* payload);
+
+// The netboot and TFTP handlers get their datagrams before the payload checksum
+// has been verified. udp6_csum_copy() copies payload bytes like memcpy() and adds
+// them to the checksum on the way, so each byte is read once. udp6_csum_ok() adds
+// whatever has not been copied and returns nonzero if the datagram is intact.
+// Handlers have to call it before they act on the contents of a datagram.
+void* udp6_csum_copy(void* dst, const void* src, size_t len);
+int udp6_csum_ok(void);
+
+// Zero copy receive. eth_rx_target() returns a buffer for the next frame that puts
+// the payload of the datagram we expect next (a TFTP DATA block) right where it
+// belongs, or NULL if there is no such datagram. The |*headroom| bytes in front of
+// the payload belong to earlier data: the interface driver saves them before the
+// receive and restores them once the frame has been handled.
+void* eth_rx_target(size_t* len, size_t* headroom);
+
+// Returns nonzero if a frame received into the eth_rx_target() buffer is the
+// expected datagram. Other frames have to be moved out of the way before they
+// are handled.
+int eth_rx_target_hit(const void* frame, size_t len);
+
+// Asks the TFTP receiver where the payload of the next expected DATA block belongs.
+// |*hdr_len| is the size of the lower layer headers on input and is set to the size
+// of the TFTP header, |*len| is set to the size of the payload.
+void* tftp_rx_target(size_t* hdr_len, size_t* len);
+// Tells whether the datagram from |saddr| port |sport| is the block tftp_rx_target() expects
+int tftp_rx_target_hit(const void* data, size_t len, const ip6_addr* saddr, uint16_t sport);
+
+// Shared with inet4.c. Every UDP transmit buffer starts with it, the ethernet header
+// follows. UDP payloads start UDP_TX_HEADROOM bytes into a transmit buffer.
+typedef struct {
+    uint8_t family;   // UDP_TX_IP4 or UDP_TX_IP6
+    uint8_t reserved; // keeps the IPv6 header behind the ethernet header aligned
+} udp_tx_hdr;
+#define UDP_TX_IP4 4
+#define UDP_TX_IP6 6
+#define UDP_TX_HEADROOM (sizeof(udp_tx_hdr) + ETH_HDR_LEN + IP6_HDR_LEN + UDP_HDR_LEN)
+uint16_t inet_checksum(const void* data, size_t len, uint16_t sum);
+// Hands a datagram to its handler. |sum| is the checksum of the pseudo header, the
+// datagram is not checked if |verify| is zero (IPv4 datagrams without a checksum).
+void udp_recv(void* data, size_t len, uint16_t sum, int verify,
+              const ip6_addr* daddr, const ip6_addr* saddr);
+
 // handle a netboot UDP packet
 void netboot_recv(void* data, size_t len, const ip6_addr* saddr, uint16_t sport);
 
+// handle a multicast file transfer packet
+void netboot_mcast_recv(void* data, size_t len, const ip6_addr* daddr, const ip6_addr* saddr);
+
 // handle a TFTP (over UDP) packet
 void tftp_recv (void* data, size_t len, const ip6_addr* daddr, uint16_t dport,
                 const ip6_addr* saddr, uint16_t sport);
@@ -145,7 +294,10 @@ void tftp_recv (void* data, size_t len, const ip6_addr* daddr, uint16_t dport,
 // NOTES
 //
 // This is an extremely minimal IPv6 stack, supporting just enough
-// functionality to talk to link local hosts over UDP.
+// functionality to talk to hosts over UDP. Besides the link local
+// address it forms a global one from the first prefix a router
+// advertises for autoconfiguration (SLAAC), and sends everything that
+// is not on-link to the default router.
 //
 // It responds to ICMPv6 Neighbor Solicitations for its link local
 // address, which is computed from the mac address provided by the
@@ -153,15 +305,17 @@ void tftp_recv (void* data, size_t len, const ip6_addr* daddr, uint16_t dport,
 //
 // It responds to PINGs.
 //
-// It can only transmit to multicast addresses or to the address it
-// last received a packet from (general usecase is to reply to a UDP
-// packet from the UDP callback, which this supports)
+// It keeps a small neighbor cache, filled from the packets it receives
+// and from Neighbor Advertisements. Unicast peers it does not know yet
+// are solicited, the packet waits until the neighbor answers.
 //
 // It does not currently do duplicate address detection, which is
 // probably the most severe bug.
 //
-// It does not support any IPv6 options and will drop packets with
-// options.
+// It reports the multicast groups it listens to with MLDv2, so switches
+// that snoop MLD forward multicast traffic to it. Hop-by-Hop options
+// (MLD queries carry a Router Alert) are skipped, packets with other
+// options are dropped.
 //
 // It expects the network stack to provide transmit buffer allocation
 // and free functionality.  It will allocate a single transmit buffer
@@ -7,7 +7,16 @@
 #include "uniboot.h"
 #include "xefi.h"
 
-static void elf_check_header(Elf64_Ehdr *hdr) {
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// Compressed images are read from disk in chunks of this size
+#define ELF_READ_CHUNK_SIZE (1024 * 1024)
+
+static void elf_check_header(Elf64_Ehdr *hdr, size_t size) {
+    if (size < sizeof(Elf64_Ehdr)) {
+        xefi_fatal("app.elf size is too small", EFI_LOAD_ERROR);
+    }
     if (strncmp((char *)hdr->e_ident, ELFMAG, SELFMAG)) {
         xefi_fatal("app.elf: invalid ELF header magic value", EFI_LOAD_ERROR);
     }
@@ -17,17 +26,31 @@ static void elf_check_header(Elf64_Ehdr *hdr) {
     if (hdr->e_type != ET_EXEC) {
         xefi_fatal("app.elf: only ELF executable file booting is supported", EFI_LOAD_ERROR);
     }
+    if (hdr->e_phentsize < sizeof(Elf64_Phdr) || (hdr->e_shnum && hdr->e_shentsize < sizeof(Elf64_Shdr))) {
+        xefi_fatal("app.elf: invalid ELF header entry size", EFI_LOAD_ERROR);
+    }
+    if (hdr->e_phnum > ELF_STREAM_MAX_SEGMENTS) {
+        xefi_fatal("app.elf: too many program headers", EFI_LOAD_ERROR);
+    }
+    if (hdr->e_phoff + (size_t)hdr->e_phnum * hdr->e_phentsize > size) {
+        xefi_fatal("app.elf: program headers do not fit into the image prefix", EFI_LOAD_ERROR);
+    }
 }
 
-static void elf_load_segments(void *data) {
-    Elf64_Ehdr *hdr = data;
-    void *phdr_p = data + hdr->e_phoff;
+static Elf64_Phdr *elf_phdr(Elf64_Ehdr *hdr, int i) { return (void *)hdr + hdr->e_phoff + i * hdr->e_phentsize; }
+
+// Allocates memory for PT_LOAD segments and zero-outs the areas that are not backed by the file (e.g. BSS)
+static void elf_alloc_segments(struct elf_stream *s) {
+    Elf64_Ehdr *hdr = (Elf64_Ehdr *)s->header;
     efi_physical_addr previous_end = 0; // we use it to track adjusted PT_LOAD segments that share the same page
     for (int i = 0; i < hdr->e_phnum; i++) {
-        Elf64_Phdr *phdr = phdr_p;
+        Elf64_Phdr *phdr = elf_phdr(hdr, i);
 
         if (phdr->p_type != PT_LOAD)
             continue;
+        if (phdr->p_filesz > phdr->p_memsz) {
+            xefi_fatal("load_elf: segment file size is larger than its memory size", EFI_LOAD_ERROR);
+        }
 
         efi_physical_addr addr = phdr->p_paddr;
         efi_physical_addr start = ROUND_DOWN(addr, PAGE_SIZE);
@@ -35,29 +58,236 @@ static void elf_load_segments(void *data) {
 
         if (previous_end > start)
             start = previous_end;
-        previous_end = end;
+        previous_end = MAX(previous_end, end);
 
-        size_t pages = (end - start) / PAGE_SIZE;
-        if (pages) {
+        if (end > start) {
+            size_t pages = (end - start) / PAGE_SIZE;
             efi_status r = gBS->AllocatePages(AllocateAddress, EfiLoaderData, pages, &start);
             if (r) {
                 xefi_fatal("load_elf: Cannot allocate buffer", r);
             }
+            s->alloc_start[s->allocs_num] = start;
+            s->alloc_pages[s->allocs_num] = pages;
+            s->allocs_num++;
         }
 
-        // copy ELF segment data
-        memcpy((void *)addr, data + phdr->p_offset, phdr->p_filesz);
-
         // the end of segment is zero-outed area (e.g. BSS)
         memset((void *)addr + phdr->p_filesz, 0, phdr->p_memsz - phdr->p_filesz);
+    }
+
+    if (hdr->e_shnum) {
+        s->shdrs_size = (size_t)hdr->e_shnum * hdr->e_shentsize;
+        efi_status r = gBS->AllocatePool(EfiLoaderData, s->shdrs_size, &s->shdrs);
+        if (r) {
+            xefi_fatal("load_elf: Cannot allocate section headers buffer", r);
+        }
+    }
+}
+
+static void elf_copy(struct elf_stream *s, void *dest, const void *src, size_t len) {
+    // decompressed data went through the copy hook on its way into the decoder already
+    if (s->copy && !s->compressed) {
+        s->copy(dest, src, len);
+    } else {
+        memcpy(dest, src, len);
+    }
+}
+
+// Copies the part of [data, data + len) that overlaps file area [area_offset, area_offset + area_size) to |dest|
+static void elf_copy_overlap(struct elf_stream *s, void *dest, uint64_t area_offset, uint64_t area_size, const void *data,
+                             size_t len, size_t offset) {
+    uint64_t from = MAX(offset, area_offset);
+    uint64_t to = MIN(offset + len, area_offset + area_size);
+    if (from < to) {
+        elf_copy(s, dest + (from - area_offset), data + (from - offset), to - from);
+    }
+}
+
+static void elf_place_data(struct elf_stream *s, const void *data, size_t len, size_t offset) {
+    Elf64_Ehdr *hdr = (Elf64_Ehdr *)s->header;
+    for (int i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr *phdr = elf_phdr(hdr, i);
+        if (phdr->p_type == PT_LOAD) {
+            elf_copy_overlap(s, (void *)phdr->p_paddr, phdr->p_offset, phdr->p_filesz, data, len, offset);
+        }
+    }
+    if (s->shdrs) {
+        elf_copy_overlap(s, s->shdrs, hdr->e_shoff, s->shdrs_size, data, len, offset);
+    }
+}
+
+static void elf_parse_header(struct elf_stream *s) {
+    elf_check_header((Elf64_Ehdr *)s->header, s->offset);
+    elf_alloc_segments(s);
+    s->ready = true;
+    // segments can start inside of the prefix, e.g. the first one often maps the ELF header
+    elf_place_data(s, s->header, s->offset, 0);
+}
+
+static void elf_release(struct elf_stream *s) {
+    for (size_t i = 0; i < s->allocs_num; i++) {
+        gBS->FreePages(s->alloc_start[i], s->alloc_pages[i]);
+    }
+    s->allocs_num = 0;
+    if (s->shdrs) {
+        gBS->FreePool(s->shdrs);
+    }
+    s->shdrs = NULL;
+    s->shdrs_size = 0;
+    s->ready = false;
+    if (s->compressed) {
+        lz4_stream_release(&s->lz4);
+    }
+    s->compressed = false;
+}
+
+void elf_stream_init(struct elf_stream *s) {
+    elf_release(s);
+    s->offset = 0;
+}
+
+static void elf_lz4_check(int r) {
+    if (r == LZ4_ERR_UNSUPPORTED) {
+        xefi_fatal("app.elf: unsupported LZ4 frame", EFI_UNSUPPORTED);
+    } else if (r == LZ4_ERR_NO_MEMORY) {
+        xefi_fatal("app.elf: Cannot allocate decompression buffer", EFI_OUT_OF_RESOURCES);
+    } else if (r == LZ4_ERR_TRUNCATED) {
+        xefi_fatal("app.elf is truncated", EFI_LOAD_ERROR);
+    } else if (r) {
+        xefi_fatal("app.elf: corrupted LZ4 data", EFI_LOAD_ERROR);
+    }
+}
+
+// Appends image bytes. The ELF headers are parsed when the bytes after the chunk that completed
+// the prefix come: the caller verifies a chunk after writing it, so one that turns out to be
+// corrupted is rewound before anything is allocated from its contents.
+static void elf_stream_put(struct elf_stream *s, const void *data, size_t len) {
+    if (!s->ready && s->offset >= ELF_STREAM_HEADER_SIZE) {
+        elf_parse_header(s);
+    }
+    if (!s->ready) {
+        size_t n = MIN(len, sizeof(s->header) - s->offset);
+        elf_copy(s, s->header + s->offset, data, n);
+        s->offset += n;
+        if (n == len) {
+            return;
+        }
+
+        // chunks that large are read from disk or built from a verified delta
+        elf_parse_header(s);
+
+        data += n;
+        len -= n;
+    }
+
+    elf_place_data(s, data, len, s->offset);
+    s->offset += len;
+}
+
+// Receives the output of the LZ4 decoder
+static void elf_stream_unpacked(void *cookie, const void *data, size_t len) { elf_stream_put(cookie, data, len); }
+
+// Compressed data is decoded a chunk late: a chunk that turns out to be corrupted has to be dropped
+// before the decoder has seen it
+static int elf_stream_write_compressed(struct elf_stream *s, const void *data, size_t len, size_t offset) {
+    struct lz4_stream *z = &s->lz4;
+    size_t end = lz4_stream_end(z);
+    if (offset > end) {
+        return -1;
+    }
+    size_t seen = end - offset;
+    if (seen >= len) {
+        return 0;
+    }
+    data += seen;
+    len -= seen;
+
+    elf_lz4_check(lz4_stream_decode(z));
+    void *dest = lz4_stream_buffer(z, len, 0);
+    if (!dest) {
+        elf_lz4_check(LZ4_ERR_NO_MEMORY);
+    }
+    if (s->copy) {
+        s->copy(dest, data, len);
+    } else if (dest != data) {
+        memcpy(dest, data, len);
+    }
+    lz4_stream_commit(z, len);
+    return 0;
+}
 
-        phdr_p += hdr->e_phentsize;
+void elf_stream_rewind(struct elf_stream *s, size_t offset) {
+    if (s->compressed) {
+        if (!offset) {
+            // even the magic might be bad
+            elf_stream_init(s);
+        } else if (lz4_stream_rewind(&s->lz4, offset)) {
+            xefi_fatal("app.elf: cannot rewind decompressed data", EFI_LOAD_ERROR);
+        }
+        return;
+    }
+    if (offset >= s->offset) {
+        return;
     }
+    if (s->ready && offset < ELF_STREAM_HEADER_SIZE) {
+        // the headers were parsed from bad data, parse them again once the prefix is complete
+        elf_release(s);
+    }
+    s->offset = offset;
 }
 
-static void uniboot_populate_segments(void *data) {
-    Elf64_Ehdr *hdr = data;
+int elf_stream_write(struct elf_stream *s, const void *data, size_t len, size_t offset) {
+    if (!s->compressed && !s->offset && !offset && lz4_is_frame(data, len)) {
+        lz4_stream_init(&s->lz4, elf_stream_unpacked, s);
+        s->compressed = true;
+    }
+    if (s->compressed) {
+        return elf_stream_write_compressed(s, data, len, offset);
+    }
+
+    if (offset > s->offset) {
+        return -1;
+    }
+    // skip the bytes we have seen already
+    size_t seen = s->offset - offset;
+    if (seen >= len) {
+        return 0;
+    }
+    elf_stream_put(s, data + seen, len - seen);
+    return 0;
+}
 
+void *elf_stream_locate(struct elf_stream *s, size_t offset, size_t len, size_t headroom) {
+    if (s->compressed) {
+        // compressed data lands in the decoder's input buffer
+        if (offset != lz4_stream_end(&s->lz4)) {
+            return NULL;
+        }
+        elf_lz4_check(lz4_stream_decode(&s->lz4));
+        return lz4_stream_buffer(&s->lz4, len, headroom);
+    }
+    if (offset != s->offset) {
+        return NULL;
+    }
+    if (!s->ready) {
+        if (s->offset < ELF_STREAM_HEADER_SIZE) {
+            return NULL;
+        }
+        // asking for the next bytes means the chunk that completed the prefix has been accepted
+        elf_parse_header(s);
+    }
+    Elf64_Ehdr *hdr = (Elf64_Ehdr *)s->header;
+    for (int i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr *phdr = elf_phdr(hdr, i);
+        if (phdr->p_type == PT_LOAD && offset >= phdr->p_offset + headroom &&
+            offset + len <= phdr->p_offset + phdr->p_filesz) {
+            return (void *)phdr->p_paddr + (offset - phdr->p_offset);
+        }
+    }
+    return NULL;
+}
+
+static void uniboot_populate_segments(Elf64_Ehdr *hdr) {
     size_t segment_list_size = sizeof(struct uniboot_segment_list) + hdr->e_phnum * sizeof(struct uniboot_segment);
 
     struct uniboot_entry *entry = bootinfo_alloc(struct uniboot_entry);
@@ -67,9 +297,8 @@ static void uniboot_populate_segments(void *data) {
     struct uniboot_segment_list *segs = bootinfo_alloc_size(segment_list_size);
     segs->num = hdr->e_phnum;
 
-    void *phdr_p = data + hdr->e_phoff;
     for (int i = 0; i < hdr->e_phnum; i++) {
-        Elf64_Phdr *phdr = phdr_p;
+        Elf64_Phdr *phdr = elf_phdr(hdr, i);
 
         segs->segments[i].type = phdr->p_type;
         segs->segments[i].flags = phdr->p_flags;
@@ -79,14 +308,10 @@ static void uniboot_populate_segments(void *data) {
         segs->segments[i].filesz = phdr->p_filesz;
         segs->segments[i].memsz = phdr->p_memsz;
         segs->segments[i].align = phdr->p_align;
-
-        phdr_p += hdr->e_phentsize;
     }
 }
 
-static void uniboot_populate_sections(void *data) {
-    Elf64_Ehdr *hdr = data;
-
+static void uniboot_populate_sections(Elf64_Ehdr *hdr, void *shdrs) {
     size_t section_list_size = sizeof(struct uniboot_section_list) + hdr->e_shnum * sizeof(struct uniboot_section);
 
     struct uniboot_entry *entry = bootinfo_alloc(struct uniboot_entry);
@@ -97,7 +322,7 @@ static void uniboot_populate_sections(void *data) {
     list->num = hdr->e_shnum;
     struct uniboot_section *sec = list->sections;
 
-    void *shdr_p = data + hdr->e_shoff;
+    void *shdr_p = shdrs;
     for (int i = 0; i < hdr->e_shnum; i++) {
         Elf64_Shdr *shdr = shdr_p;
 
@@ -114,23 +339,110 @@ static void uniboot_populate_sections(void *data) {
     }
 }
 
-void *elf_load(void *data, size_t size) {
-    if (!data) {
-        xefi_fatal("xefi_load_file", EFI_LOAD_ERROR);
+void *elf_stream_finish(struct elf_stream *s) {
+    if (s->compressed) {
+        elf_lz4_check(lz4_stream_finish(&s->lz4));
     }
-    if (size < sizeof(Elf64_Ehdr)) {
-        xefi_fatal("app.elf size is too small", EFI_LOAD_ERROR);
+    if (!s->ready) {
+        // the whole image fits into the prefix buffer
+        elf_parse_header(s);
+    }
+
+    Elf64_Ehdr *hdr = (Elf64_Ehdr *)s->header;
+    uint64_t image_end = hdr->e_shoff + s->shdrs_size;
+    for (int i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr *phdr = elf_phdr(hdr, i);
+        if (phdr->p_type == PT_LOAD) {
+            image_end = MAX(image_end, phdr->p_offset + phdr->p_filesz);
+        }
+    }
+    if (image_end > s->offset) {
+        xefi_fatal("app.elf is truncated", EFI_LOAD_ERROR);
     }
 
-    Elf64_Ehdr *hdr = (Elf64_Ehdr *)data;
-    elf_check_header(hdr);
+    uniboot_populate_segments(hdr);
+    uniboot_populate_sections(hdr, s->shdrs);
 
-    void *entry = (void *)hdr->e_entry;
-    elf_load_segments(data);
-    uniboot_populate_segments(data);
-    uniboot_populate_sections(data);
+    return (void *)hdr->e_entry;
+}
+
+// Reads |len| bytes at file |offset| to |dest|
+static void elf_read_file(efi_file_protocol *file, void *dest, size_t len, uint64_t offset) {
+    efi_status r = file->SetPosition(file, offset);
+    if (r) {
+        xefi_fatal("load_elf: Cannot seek app.elf", r);
+    }
+    size_t sz = len;
+    r = file->Read(file, &sz, dest);
+    if (r) {
+        xefi_fatal("load_elf: Cannot read app.elf", r);
+    }
+    if (sz != len) {
+        xefi_fatal("app.elf is truncated", EFI_END_OF_FILE);
+    }
+}
 
-    xefi_free(data, size);
+// A compressed image can only be decoded front to back, so all of it is read. The file is read
+// straight into the decoder's input buffer.
+static void *elf_load_compressed(efi_file_protocol *file, struct elf_stream *s, size_t prefix) {
+    elf_stream_write(s, s->header, prefix, 0);
+    size_t offset = prefix;
+    for (;;) {
+        size_t len = ELF_READ_CHUNK_SIZE;
+        void *dest = elf_stream_locate(s, offset, len, 0);
+        if (!dest) {
+            xefi_fatal("app.elf: Cannot allocate decompression buffer", EFI_OUT_OF_RESOURCES);
+        }
+        efi_status r = file->Read(file, &len, dest);
+        if (r) {
+            xefi_fatal("load_elf: Cannot read app.elf", r);
+        }
+        if (!len) {
+            break;
+        }
+        elf_stream_write(s, dest, len, offset);
+        offset += len;
+    }
+    return elf_stream_finish(s);
+}
+
+void *elf_load_file(efi_file_protocol *file) {
+    static struct elf_stream stream;
+    struct elf_stream *s = &stream;
+
+    if (!file) {
+        xefi_fatal("xefi_open_file", EFI_LOAD_ERROR);
+    }
+
+    elf_stream_init(s);
+
+    size_t prefix = sizeof(s->header);
+    efi_status r = file->Read(file, &prefix, s->header);
+    if (r) {
+        xefi_fatal("load_elf: Cannot read app.elf", r);
+    }
+    if (lz4_is_frame(s->header, prefix)) {
+        return elf_load_compressed(file, s, prefix);
+    }
+    s->offset = prefix;
+    elf_parse_header(s);
+
+    // Fetch only the file areas that end up in memory, anything else (e.g. debug info) is never read
+    Elf64_Ehdr *hdr = (Elf64_Ehdr *)s->header;
+    for (int i = 0; i < hdr->e_phnum; i++) {
+        Elf64_Phdr *phdr = elf_phdr(hdr, i);
+        uint64_t end = phdr->p_offset + phdr->p_filesz;
+        if (phdr->p_type != PT_LOAD || end <= prefix) {
+            continue;
+        }
+        uint64_t start = MAX(phdr->p_offset, prefix);
+        elf_read_file(file, (void *)phdr->p_paddr + (start - phdr->p_offset), end - start, start);
+        s->offset = MAX(s->offset, end);
+    }
+    if (s->shdrs && hdr->e_shoff + s->shdrs_size > prefix) {
+        elf_read_file(file, s->shdrs, s->shdrs_size, hdr->e_shoff);
+        s->offset = MAX(s->offset, hdr->e_shoff + s->shdrs_size);
+    }
 
-    return entry;
+    return elf_stream_finish(s);
 }
@@ -1,6 +1,63 @@
 #pragma once
 
+#include <efi/protocol/file.h>
 #include <efi/types.h>
+#include <stdbool.h>
 
-// Loads ELF segments into memory and returns pointer to entry point
-void *elf_load(void *data, size_t size);
\ No newline at end of file
+#include "lz4.h"
+
+// Size of the image prefix that is buffered until ELF and program headers are parsed
+#define ELF_STREAM_HEADER_SIZE 4096
+// The rest of the chunk that completes the prefix is buffered as well. The headers are parsed
+// only once the next chunk comes, until then the caller can still reject the chunk and rewind.
+#define ELF_STREAM_SPILL_SIZE 16384
+#define ELF_STREAM_MAX_SEGMENTS 64
+
+// State of an ELF image that is loaded while it is being received. Bytes are fed in file order,
+// PT_LOAD contents go straight to their physical addresses and everything else is dropped.
+// An image wrapped into an LZ4 frame is detected by its magic and decompressed on the fly, the offsets
+// passed to the stream functions are offsets in the compressed file then.
+struct elf_stream {
+    // image prefix that holds ELF and program headers, followed by the rest of the chunk that completed it
+    uint8_t header[ELF_STREAM_HEADER_SIZE + ELF_STREAM_SPILL_SIZE];
+    size_t offset; // number of image bytes consumed so far
+    bool ready;    // headers are parsed and segments are allocated
+
+    void *shdrs; // section header table, collected while the image streams by
+    size_t shdrs_size;
+
+    // pages allocated for the segments, released if the load is restarted
+    size_t allocs_num;
+    efi_physical_addr alloc_start[ELF_STREAM_MAX_SEGMENTS];
+    size_t alloc_pages[ELF_STREAM_MAX_SEGMENTS];
+
+    // moves received data into place, memcpy if not set
+    void *(*copy)(void *dest, const void *src, size_t len);
+
+    bool compressed;
+    struct lz4_stream lz4;
+};
+
+// Loads ELF segments from |file| into memory and returns pointer to entry point.
+// Only PT_LOAD contents and the section header table are read from the file.
+void *elf_load_file(efi_file_protocol *file);
+
+// Prepares the stream for a new image. Memory held by a previous load is released.
+void elf_stream_init(struct elf_stream *s);
+
+// Feeds image bytes located at file |offset|. Data has to come in order, bytes that were
+// consumed already are skipped. Returns 0 on success and -1 if there is a gap in the data.
+int elf_stream_write(struct elf_stream *s, const void *data, size_t len, size_t offset);
+
+// Returns where the |len| image bytes at file |offset| belong if they can be placed there directly,
+// i.e. they are the next bytes expected and lie in a single segment that also holds the |headroom|
+// bytes in front of them. Returns NULL otherwise.
+void *elf_stream_locate(struct elf_stream *s, size_t offset, size_t len, size_t headroom);
+
+// Forgets the bytes written from file |offset| on, e.g. because they turned out to be corrupted.
+// They have to be written again.
+void elf_stream_rewind(struct elf_stream *s, size_t offset);
+
+// Checks that the whole image has been received, publishes its segments and sections to
+// the boot info and returns pointer to entry point
+void *elf_stream_finish(struct elf_stream *s);
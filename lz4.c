@@ -0,0 +1,370 @@
+#include "lz4.h"
+
+#include "string.h"
+#include "xefi.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define LZ4_SKIPPABLE_MAGIC 0x184D2A50 // low 4 bits are user defined
+#define LZ4_SKIPPABLE_MASK 0xFFFFFFF0
+
+#define LZ4_FLG_VERSION_MASK 0xC0
+#define LZ4_FLG_VERSION 0x40
+#define LZ4_FLG_BLOCK_INDEP 0x20
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_RESERVED 0x02
+#define LZ4_FLG_DICT_ID 0x01
+#define LZ4_BD_RESERVED 0x8F
+
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_HISTORY_SIZE (64 * 1024) // the largest match offset
+#define LZ4_MIN_INPUT_SIZE (256 * 1024)
+// Dependent blocks are decoded one after another into the output buffer, the history is moved back to its start
+// when the next block does not fit anymore. The buffer is large enough that this happens rarely.
+#define LZ4_MIN_OUTPUT_SIZE (1024 * 1024)
+// Literals and matches are copied in whole words, which can run up to 16 bytes past the end of the data
+#define LZ4_SLACK 16
+
+enum {
+    LZ4_STATE_MAGIC,
+    LZ4_STATE_FRAME_HEADER,
+    LZ4_STATE_BLOCK,
+    LZ4_STATE_CONTENT_CHECKSUM,
+    LZ4_STATE_SKIP,
+};
+
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) unaligned_u64;
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) unaligned_u32;
+
+static uint32_t load_le32(const uint8_t *p) { return *(const unaligned_u32 *)p; }
+
+static void copy_word(uint8_t *dst, const uint8_t *src) { *(unaligned_u64 *)dst = *(const unaligned_u64 *)src; }
+
+bool lz4_is_frame(const void *data, size_t len) { return len >= 4 && load_le32(data) == LZ4_FRAME_MAGIC; }
+
+void lz4_stream_init(struct lz4_stream *z, void (*sink)(void *cookie, const void *data, size_t len), void *cookie) {
+    memset(z, 0, sizeof(*z));
+    z->sink = sink;
+    z->cookie = cookie;
+    z->state = LZ4_STATE_MAGIC;
+}
+
+void lz4_stream_release(struct lz4_stream *z) {
+    if (z->in) {
+        gBS->FreePool(z->in);
+    }
+    if (z->out) {
+        gBS->FreePool(z->out);
+    }
+    lz4_stream_init(z, z->sink, z->cookie);
+}
+
+// Reads the extra bytes of a literal or match length
+static bool lz4_read_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompresses an LZ4 block from [src, src + src_len) to |dst|. Matches can refer back to |window|.
+// Returns the decompressed size (blocks are at most 4 MB) or LZ4_ERR_CORRUPTED.
+static int lz4_decompress(uint8_t *dst, size_t dst_size, const uint8_t *window, const uint8_t *src, size_t src_len) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_size;
+
+    for (;;) {
+        if (ip >= iend) {
+            return LZ4_ERR_CORRUPTED;
+        }
+        unsigned token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && !lz4_read_length(&ip, iend, &lit)) {
+            return LZ4_ERR_CORRUPTED;
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+            return LZ4_ERR_CORRUPTED;
+        }
+        copy_word(op, ip);
+        copy_word(op + 8, ip + 8);
+        for (size_t i = 16; i < lit; i += 8) {
+            copy_word(op + i, ip + i);
+        }
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            // the last sequence has literals only
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return LZ4_ERR_CORRUPTED;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!offset || offset > (size_t)(op - window)) {
+            return LZ4_ERR_CORRUPTED;
+        }
+        size_t match_len = token & 15;
+        if (match_len == 15 && !lz4_read_length(&ip, iend, &match_len)) {
+            return LZ4_ERR_CORRUPTED;
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) {
+            return LZ4_ERR_CORRUPTED;
+        }
+        const uint8_t *match = op - offset;
+        size_t step = offset;
+        if (offset < 8) {
+            // The match overlaps the bytes it produces. Once the first 8 bytes are there the pattern
+            // repeats every multiple of |offset| and it can be copied in words from far enough back.
+            for (size_t i = 0; i < 8; i++) {
+                op[i] = match[i];
+            }
+            step = offset * ((8 + offset - 1) / offset);
+        } else {
+            copy_word(op, match);
+        }
+        for (size_t i = 8; i < match_len; i += 8) {
+            copy_word(op + i, op + i - step);
+        }
+        op += match_len;
+    }
+
+    return op - dst;
+}
+
+static int lz4_alloc_output(struct lz4_stream *z) {
+    size_t size = LZ4_HISTORY_SIZE + MAX(2 * z->block_max, LZ4_MIN_OUTPUT_SIZE) + LZ4_SLACK;
+    if (z->out_size >= size) {
+        return 0;
+    }
+    if (z->out) {
+        gBS->FreePool(z->out);
+        z->out = NULL;
+        z->out_size = 0;
+    }
+    if (gBS->AllocatePool(EfiLoaderData, size, (void **)&z->out)) {
+        z->out = NULL;
+        return LZ4_ERR_NO_MEMORY;
+    }
+    z->out_size = size;
+    return 0;
+}
+
+// Parses FLG, BD and the optional fields of a frame header. Returns the header size, 0 if it is not complete yet
+// or an error.
+static int lz4_frame_header(struct lz4_stream *z, const uint8_t *p, size_t avail) {
+    if (avail < 2) {
+        return 0;
+    }
+    uint8_t flg = p[0];
+    uint8_t bd = p[1];
+    if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION || (flg & LZ4_FLG_RESERVED) || (bd & LZ4_BD_RESERVED)) {
+        return LZ4_ERR_CORRUPTED;
+    }
+    if (flg & LZ4_FLG_DICT_ID) {
+        return LZ4_ERR_UNSUPPORTED;
+    }
+    unsigned block_id = bd >> 4;
+    if (block_id < 4) {
+        return LZ4_ERR_CORRUPTED;
+    }
+    // FLG, BD, optional content size and the header checksum byte
+    size_t len = 3 + ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0);
+    if (avail < len) {
+        return 0;
+    }
+
+    z->flags = flg;
+    z->block_max = (size_t)1 << (8 + 2 * block_id);
+    z->hist_len = 0;
+    int r = lz4_alloc_output(z);
+    return r ? r : (int)len;
+}
+
+// Decompresses a data block and passes it on. Returns 0 or an error.
+static int lz4_block(struct lz4_stream *z, const uint8_t *src, size_t len, bool uncompressed) {
+    if (z->flags & LZ4_FLG_BLOCK_INDEP) {
+        if (uncompressed) {
+            z->sink(z->cookie, src, len);
+            return 0;
+        }
+        z->hist_len = 0;
+    } else if (z->hist_len + z->block_max + LZ4_SLACK > z->out_size) {
+        // The history is far behind the start of the buffer (hist_len > 2 * LZ4_HISTORY_SIZE),
+        // so the areas do not overlap
+        memcpy(z->out, z->out + z->hist_len - LZ4_HISTORY_SIZE, LZ4_HISTORY_SIZE);
+        z->hist_len = LZ4_HISTORY_SIZE;
+    }
+
+    uint8_t *dst = z->out + z->hist_len;
+    int n = len;
+    if (uncompressed) {
+        memcpy(dst, src, len);
+    } else {
+        n = lz4_decompress(dst, z->block_max, z->out, src, len);
+        if (n < 0) {
+            return n;
+        }
+    }
+    z->sink(z->cookie, dst, n);
+    z->hist_len += n;
+    return 0;
+}
+
+int lz4_stream_decode(struct lz4_stream *z) {
+    for (;;) {
+        const uint8_t *p = z->in + z->in_pos;
+        size_t avail = z->in_len;
+        size_t used = 0;
+
+        switch (z->state) {
+        case LZ4_STATE_MAGIC: {
+            if (avail < 4) {
+                return 0;
+            }
+            uint32_t magic = load_le32(p);
+            if (magic == LZ4_FRAME_MAGIC) {
+                used = 4;
+                z->state = LZ4_STATE_FRAME_HEADER;
+            } else if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+                if (avail < 8) {
+                    return 0;
+                }
+                used = 8;
+                z->skip_len = load_le32(p + 4);
+                z->state = LZ4_STATE_SKIP;
+            } else {
+                return LZ4_ERR_CORRUPTED;
+            }
+            break;
+        }
+        case LZ4_STATE_FRAME_HEADER: {
+            int r = lz4_frame_header(z, p, avail);
+            if (r <= 0) {
+                return r;
+            }
+            used = r;
+            z->state = LZ4_STATE_BLOCK;
+            break;
+        }
+        case LZ4_STATE_BLOCK: {
+            if (avail < 4) {
+                return 0;
+            }
+            uint32_t size = load_le32(p);
+            if (!size) {
+                // EndMark
+                used = 4;
+                z->state = (z->flags & LZ4_FLG_CONTENT_CHECKSUM) ? LZ4_STATE_CONTENT_CHECKSUM : LZ4_STATE_MAGIC;
+                break;
+            }
+            size_t len = size & ~LZ4_BLOCK_UNCOMPRESSED;
+            if (len > z->block_max) {
+                return LZ4_ERR_CORRUPTED;
+            }
+            used = 4 + len + ((z->flags & LZ4_FLG_BLOCK_CHECKSUM) ? 4 : 0);
+            if (avail < used) {
+                return 0;
+            }
+            int r = lz4_block(z, p + 4, len, size & LZ4_BLOCK_UNCOMPRESSED);
+            if (r) {
+                return r;
+            }
+            break;
+        }
+        case LZ4_STATE_CONTENT_CHECKSUM:
+            if (avail < 4) {
+                return 0;
+            }
+            used = 4;
+            z->state = LZ4_STATE_MAGIC;
+            break;
+        case LZ4_STATE_SKIP:
+            used = MIN(avail, z->skip_len);
+            if (z->skip_len == used) {
+                z->state = LZ4_STATE_MAGIC;
+            } else if (!used) {
+                return 0;
+            }
+            z->skip_len -= used;
+            break;
+        }
+
+        z->in_pos += used;
+        z->in_len -= used;
+        z->in_offset += used;
+    }
+}
+
+// Moves |len| bytes to a lower address
+static void lz4_move_down(uint8_t *dst, const uint8_t *src, size_t len) {
+    if (dst + len <= src) {
+        memcpy(dst, src, len);
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = src[i];
+    }
+}
+
+void *lz4_stream_buffer(struct lz4_stream *z, size_t len, size_t headroom) {
+    if (z->in_pos + z->in_len + len + LZ4_SLACK > z->in_size) {
+        // move the pending bytes to the front of the buffer, keeping up to |headroom| bytes in front of them
+        size_t pos = MIN(z->in_pos, headroom);
+        size_t size = pos + z->in_len + len + LZ4_SLACK;
+        if (size > z->in_size) {
+            size = MAX(MAX(size, 2 * z->in_size), LZ4_MIN_INPUT_SIZE);
+            uint8_t *in;
+            if (gBS->AllocatePool(EfiLoaderData, size, (void **)&in)) {
+                return NULL;
+            }
+            if (z->in) {
+                memcpy(in + pos, z->in + z->in_pos, z->in_len);
+                gBS->FreePool(z->in);
+            }
+            z->in = in;
+            z->in_size = size;
+        } else {
+            lz4_move_down(z->in + pos, z->in + z->in_pos, z->in_len);
+        }
+        z->in_pos = pos;
+    }
+    if (z->in_pos + z->in_len < headroom) {
+        return NULL;
+    }
+    return z->in + z->in_pos + z->in_len;
+}
+
+int lz4_stream_rewind(struct lz4_stream *z, size_t offset) {
+    if (offset < z->in_offset) {
+        return -1;
+    }
+    z->in_len = MIN(z->in_len, offset - z->in_offset);
+    return 0;
+}
+
+int lz4_stream_finish(struct lz4_stream *z) {
+    int r = lz4_stream_decode(z);
+    if (r) {
+        return r;
+    }
+    if (z->state != LZ4_STATE_MAGIC || z->in_len) {
+        return LZ4_ERR_TRUNCATED;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming decoder for the LZ4 frame format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md).
+// Compressed bytes are appended to an input buffer owned by the decoder, whole blocks are decompressed
+// once they are complete and the output is handed to |sink| in order.
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+
+#define LZ4_ERR_CORRUPTED -1   // malformed frame or block
+#define LZ4_ERR_UNSUPPORTED -2 // frame uses a feature we do not implement (e.g. dictionaries)
+#define LZ4_ERR_NO_MEMORY -3
+#define LZ4_ERR_TRUNCATED -4 // the stream ended in the middle of a frame
+
+struct lz4_stream {
+    void (*sink)(void *cookie, const void *data, size_t len);
+    void *cookie;
+
+    // Compressed input. Bytes [in_pos, in_pos + in_len) are received but not decoded yet,
+    // the first of them is at stream offset |in_offset|.
+    uint8_t *in;
+    size_t in_size;
+    size_t in_pos;
+    size_t in_len;
+    size_t in_offset;
+
+    // Decompressed output, the |hist_len| bytes in front of a new block are the history its matches refer to
+    uint8_t *out;
+    size_t out_size;
+    size_t hist_len;
+
+    int state;
+    uint8_t flags;    // FLG byte of the current frame
+    size_t block_max; // largest block of the current frame
+    size_t skip_len;  // remaining size of a skippable frame
+};
+
+// Returns true if |data| starts with an LZ4 frame
+bool lz4_is_frame(const void *data, size_t len);
+
+void lz4_stream_init(struct lz4_stream *z, void (*sink)(void *cookie, const void *data, size_t len), void *cookie);
+void lz4_stream_release(struct lz4_stream *z);
+
+// Stream offset right after the last byte received
+static inline size_t lz4_stream_end(const struct lz4_stream *z) { return z->in_offset + z->in_len; }
+
+// Decodes every frame element (header, block, checksum) that has been received completely
+int lz4_stream_decode(struct lz4_stream *z);
+
+// Returns where the next |len| stream bytes are to be stored, with at least |headroom| bytes of the buffer in
+// front of them. Returns NULL if the buffer cannot be grown or the headroom is not there.
+// Call lz4_stream_commit() once the bytes are stored.
+void *lz4_stream_buffer(struct lz4_stream *z, size_t len, size_t headroom);
+static inline void lz4_stream_commit(struct lz4_stream *z, size_t len) { z->in_len += len; }
+
+// Forgets the stream bytes from |offset| on. Returns -1 if they are decoded already.
+int lz4_stream_rewind(struct lz4_stream *z, size_t offset);
+
+// Decodes the rest of the stream, returns LZ4_ERR_TRUNCATED if it stops in the middle of a frame
+int lz4_stream_finish(struct lz4_stream *z);
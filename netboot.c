@@ -6,16 +6,26 @@
 #include <string.h>
 
 #include "device_id.h"
+#include "inet4.h"
 #include "inet6.h"
 #include "netifc.h"
+#include "sha256.h"
 #include <xefi.h>
 
 #include "netboot.h"
 #include "tftp/tftp.h"
 
 #define TFTP_BUF_SZ 2048
-char tftp_session_scratch[TFTP_BUF_SZ];
-char tftp_out_scratch[TFTP_BUF_SZ];
+// Blocks received ahead of a reordered or lost one wait here, sized for 64 blocks
+// of the largest block size the link allows
+#define TFTP_REORDER_BLOCKS 64
+static void* tftp_reorder_pool;
+static size_t tftp_reorder_sz;
+
+// DATA header
+#define TFTP_DATA_HDR_LEN 4
+#define TFTP_OPCODE_RRQ 1
+#define TFTP_OPCODE_DATA 3
 
 // item being downloaded
 static nbfile* item;
@@ -25,14 +35,51 @@ typedef struct {
     nbfile* netboot_file_data;
     size_t file_size;
     unsigned int progress_reported;
+    // A received file stays here when its transfer stops half way, a new session may resume it
+    bool receiving;
+    char filename[256];
 } file_info_t;
 
 // TFTP transport state
 typedef struct {
     struct ip6_addr_t dest_addr;
     uint16_t dest_port;
+
+    // Retransmission timer. The RTO follows the RFC 6298 estimator, it is sampled from the
+    // time between our ACK and the next packet from the peer and is bounded by the
+    // negotiated TFTP timeout.
+    uint64_t deadline_us;  // 0 if the timer is not armed
+    uint64_t ack_sent_us;  // 0 if there is no RTT measurement in flight
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t rto_us;
+    uint32_t max_rto_us;
 } transport_info_t;
 
+#define TFTP_MIN_RTO_US 10000
+#define TFTP_INITIAL_RTO_US 100000
+// Timeouts are in the milliseconds range now, allow more of them before giving up on a peer
+#define TFTP_MAX_TIMEOUTS 16
+
+// A host may send several files at once, e.g. the application and its ramdisks, over
+// sessions from different ports. Each one is identified by the host's address and port.
+#define TFTP_SESSIONS 4
+typedef struct {
+    tftp_session* session; // NULL if the slot is free
+    char session_scratch[TFTP_BUF_SZ];
+    char out_scratch[TFTP_BUF_SZ];
+    // length of the last message sent, it is resent if the peer does not respond to it
+    size_t last_msg_len;
+    void* reorder_scratch;
+    file_info_t file_info;
+    transport_info_t transport_info;
+    uint64_t last_rx_us;
+} tftp_conn;
+
+static tftp_conn tftp_conns[TFTP_SESSIONS];
+// transmit buffer the response to the message being handled is built in
+static void* tftp_tx_reserved = NULL;
+
 static uint32_t last_cookie = 0;
 static uint32_t last_cmd = 0;
 static uint32_t last_arg = 0;
@@ -42,79 +89,463 @@ static uint32_t last_ack_arg = 0;
 static int nb_boot_now = 0;
 static int nb_active = 0;
 
+// Pull mode, see netboot_set_pull()
+#define NB_PULL_RETRY_US 5000000
+static struct {
+    char filename[128]; // empty if pull mode is off
+    ip6_addr server;
+    bool have_server;  // otherwise the DHCP next-server is asked
+    tftp_conn* conn;   // the TFTP session that pulls the file
+    bool waiting;      // for the first reply, it tells the port the server sends from
+    uint64_t next_us;
+} pull;
+
 static char advertise_nodename[64] = "";
 static char advertise_data[256] = "nodename=unicycle";
+static char advertise_hash[2 * NB_HASH_LEN + 1] = "";
+
+static void hash_to_hex(const uint8_t hash[NB_HASH_LEN], char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < NB_HASH_LEN; i++) {
+        hex[2 * i] = digits[hash[i] >> 4];
+        hex[2 * i + 1] = digits[hash[i] & 0xf];
+    }
+    hex[2 * NB_HASH_LEN] = 0;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Parses the "sha256=<hex>" NB_SEND_FILE option
+static bool parse_hash(const char* opt, size_t len, uint8_t hash[NB_HASH_LEN]) {
+    static const char key[] = "sha256=";
+    size_t key_len = sizeof(key) - 1;
+    if (len < key_len + 2 * NB_HASH_LEN || strncmp(opt, key, key_len)) {
+        return false;
+    }
+    opt += key_len;
+    for (size_t i = 0; i < NB_HASH_LEN; i++) {
+        int hi = hex_digit(opt[2 * i]), lo = hex_digit(opt[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        hash[i] = hi << 4 | lo;
+    }
+    return true;
+}
+
+void netboot_set_cached_hash(const uint8_t hash[NB_HASH_LEN]) {
+    hash_to_hex(hash, advertise_hash);
+}
+
+// Stores a chunk of the file being received. The chunk's checksum is verified while it is
+// copied, a corrupted chunk leaves the file offset where it was so the retransmission
+// overwrites it. Returns 0 on success, NBFILE_CORRUPTED if the chunk was dropped and -1 if
+// the data could not be stored.
+#define NBFILE_CORRUPTED 1
+static int nbfile_write(nbfile* file, const void* data, size_t len, size_t offset) {
+    if (file->write) {
+        if (file->write(file->cookie, data, len, offset)) {
+            return -1;
+        }
+    } else {
+        udp6_csum_copy(file->data + offset, data, len);
+    }
+    if (!udp6_csum_ok()) {
+        if (file->rewind) {
+            file->rewind(file->cookie, offset);
+        }
+        return NBFILE_CORRUPTED;
+    }
+    if (file->received && offset + len > file->offset) {
+        // only the bytes that are new, the host might resend a chunk we have
+        size_t seen = file->offset > offset ? file->offset - offset : 0;
+        file->received(file->cookie, data + seen, len - seen);
+    }
+    file->offset = offset + len;
+    return 0;
+}
 
 static void send_query_ack(const ip6_addr* addr, uint16_t port,
                            uint32_t cookie) {
-    uint8_t buffer[256];
-    nbmsg* msg = (void*)buffer;
+    size_t max_len;
+    nbmsg* msg = udp6_tx_reserve(addr, port, NB_SERVER_PORT, &max_len);
+    if (!msg) {
+        return;
+    }
+    size_t data_len = strlen(advertise_nodename) + 1;
     msg->magic = NB_MAGIC;
     msg->cookie = cookie;
     msg->cmd = NB_ACK;
     msg->arg = NB_VERSION_CURRENT;
-    memcpy(msg->data, advertise_nodename, sizeof(advertise_nodename));
-    udp6_send(buffer, sizeof(nbmsg) + strlen(advertise_nodename) + 1,
-              addr, port, NB_SERVER_PORT);
+    memcpy(msg->data, advertise_nodename, data_len);
+    udp6_tx_commit(msg, sizeof(nbmsg) + data_len);
 }
 
-static void advertise(void) {
-    uint8_t buffer[sizeof(nbmsg) + sizeof(advertise_data)];
-    nbmsg* msg = (void*)buffer;
+static void advertise_to(const ip6_addr* addr) {
+    size_t max_len;
+    nbmsg* msg = udp6_tx_reserve(addr, NB_ADVERT_PORT, NB_SERVER_PORT, &max_len);
+    if (!msg) {
+        return;
+    }
+    size_t data_len = strlen(advertise_data) + 1;
     msg->magic = NB_MAGIC;
     msg->cookie = 0;
     msg->cmd = NB_ADVERTISE;
     msg->arg = NB_VERSION_CURRENT;
-    size_t data_len = strlen(advertise_data) + 1;
     memcpy(msg->data, advertise_data, data_len);
-    udp6_send(buffer, sizeof(nbmsg) + data_len, &ip6_ll_all_nodes,
-              NB_ADVERT_PORT, NB_SERVER_PORT);
+    udp6_tx_commit(msg, sizeof(nbmsg) + data_len);
+}
+
+static void advertise(void) {
+    advertise_to(&ip6_ll_all_nodes);
+    if (ip4_configured()) {
+        // hosts on IPv4-only networks listen on the subnet broadcast, DHCP may also have
+        // named a bootserver that is behind a router
+        advertise_to(ip4_broadcast());
+        if (ip4_next_server()) {
+            advertise_to(ip4_next_server());
+        }
+    }
+}
+
+// Multicast transfer state, see NB_MCAST_FILE. Blocks may arrive in any order but files
+// are written in order. The next block goes to the file right away, the ones that come
+// ahead of it wait in |staging| (or right in the file's buffer when it has one) and are
+// handed over as soon as the ones in front of them are there. Only the NB_MCAST_WINDOW
+// blocks after the next one are staged, later ones are dropped and NACKed.
+#define NB_MCAST_WINDOW 1024
+static struct {
+    nbfile* file;
+    size_t size;
+    uint32_t session;
+    uint32_t block_size;
+    uint32_t blocks;
+    uint32_t next; // first block not written to |file| yet
+    uint8_t* staging; // ring of NB_MCAST_WINDOW blocks
+    uint8_t* bitmap;  // blocks received
+    ip6_addr group;
+    ip6_addr server;
+    uint16_t server_port;
+    uint64_t last_rx_us;
+} mcast;
+
+// NACK if the host has been quiet for that long
+#define NB_MCAST_QUIET_US 1000000
+
+static void mcast_release(void) {
+    if (mcast.staging) {
+        gBS->FreePool(mcast.staging);
+        mcast.staging = NULL;
+    }
+    if (mcast.bitmap) {
+        gBS->FreePool(mcast.bitmap);
+        mcast.bitmap = NULL;
+    }
+}
+
+static void mcast_stop(void) {
+    mcast_release();
+    if (mcast.file) {
+        ip6_leave_group(&mcast.group);
+    }
+    mcast.file = NULL;
+}
+
+// Gets the buffer for a file that is received from its start. Other transfers of the file
+// stop, the ones that were interrupted cannot be resumed anymore.
+static nbfile* nbfile_open(const char* name, size_t size, tftp_conn* self) {
+    nbfile* file = netboot_get_buffer(name, size);
+    if (!file) {
+        return NULL;
+    }
+    if (mcast.file == file) {
+        mcast_stop();
+    }
+    for (tftp_conn* conn = tftp_conns; conn < tftp_conns + TFTP_SESSIONS; conn++) {
+        if (conn == self || conn->file_info.netboot_file_data != file) {
+            continue;
+        }
+        if (conn->session) {
+            printf("netboot: Aborting the transfer of %s\n", conn->file_info.filename);
+            conn->session = NULL;
+            conn->transport_info.deadline_us = 0;
+        }
+        conn->file_info.netboot_file_data = NULL;
+    }
+    return file;
+}
+
+static bool mcast_have(uint32_t block) {
+    return mcast.bitmap[block / 8] & (1 << (block % 8));
+}
+
+// Tells the host which blocks are missing, or that the whole file is here
+static void mcast_report(void) {
+    size_t max_len;
+    nbmsg* msg = udp6_tx_reserve(&mcast.server, mcast.server_port, NB_SERVER_PORT, &max_len);
+    if (!msg) {
+        return;
+    }
+    msg->magic = NB_MAGIC;
+    msg->cookie = mcast.session;
+    if (mcast.next == mcast.blocks) {
+        msg->cmd = NB_FILE_RECEIVED;
+        msg->arg = mcast.size;
+        udp6_tx_commit(msg, sizeof(nbmsg));
+        return;
+    }
+    msg->cmd = NB_MCAST_NACK;
+    msg->arg = mcast.next;
+    nbmcast_range* range = (void*)msg->data;
+    size_t count = 0, max_count = (max_len - sizeof(nbmsg)) / sizeof(nbmcast_range);
+    for (uint32_t block = mcast.next; block < mcast.blocks && count < max_count;) {
+        if (mcast_have(block)) {
+            block++;
+            continue;
+        }
+        range[count].first = block;
+        while (block < mcast.blocks && !mcast_have(block)) {
+            block++;
+        }
+        range[count].count = block - range[count].first;
+        count++;
+    }
+    udp6_tx_commit(msg, sizeof(nbmsg) + count * sizeof(nbmcast_range));
+}
+
+static size_t mcast_block_len(uint32_t block) {
+    size_t offset = (size_t)block * mcast.block_size;
+    return mcast.size - offset < mcast.block_size ? mcast.size - offset : mcast.block_size;
+}
+
+// Where |block| waits until the ones in front of it are there, NULL if it is too far ahead
+static uint8_t* mcast_slot(uint32_t block) {
+    if (!mcast.staging) {
+        return mcast.file->data + (size_t)block * mcast.block_size;
+    }
+    if (block - mcast.next >= NB_MCAST_WINDOW) {
+        return NULL;
+    }
+    return mcast.staging + (size_t)(block % NB_MCAST_WINDOW) * mcast.block_size;
+}
+
+// Writes the blocks that are in order now to the file
+static void mcast_deliver(void) {
+    while (mcast.next < mcast.blocks && mcast_have(mcast.next)) {
+        size_t offset = (size_t)mcast.next * mcast.block_size;
+        if (nbfile_write(mcast.file, mcast_slot(mcast.next), mcast_block_len(mcast.next), offset)) {
+            printf("netboot: failed to store received data\n");
+            mcast_stop();
+            return;
+        }
+        mcast.next++;
+    }
+    if (mcast.next == mcast.blocks) {
+        printf("Done\n");
+        mcast_release();
+        mcast_report();
+    }
+}
+
+void netboot_mcast_recv(void* data, size_t len, const ip6_addr* daddr, const ip6_addr* saddr) {
+    nbmcast* msg = data;
+    if (!mcast.file || len < sizeof(nbmcast) || msg->magic != NB_MAGIC ||
+        msg->session != mcast.session || memcmp(daddr, &mcast.group, sizeof(ip6_addr)) ||
+        memcmp(saddr, &mcast.server, sizeof(ip6_addr))) {
+        return;
+    }
+    len -= sizeof(nbmcast);
+    nb_active = 1;
+    mcast.last_rx_us = netifc_time_us();
+
+    if (msg->block == NB_MCAST_END) {
+        if (udp6_csum_ok()) {
+            mcast_report();
+        }
+        return;
+    }
+    if (mcast.next == mcast.blocks || msg->block >= mcast.blocks || mcast_have(msg->block) ||
+        len != mcast_block_len(msg->block)) {
+        return;
+    }
+    if (msg->block == mcast.next) {
+        int r = nbfile_write(mcast.file, msg->data, len, (size_t)msg->block * mcast.block_size);
+        if (r == NBFILE_CORRUPTED) {
+            return;
+        } else if (r) {
+            printf("netboot: failed to store received data\n");
+            mcast_stop();
+            return;
+        }
+        mcast.next++;
+    } else {
+        uint8_t* slot = mcast_slot(msg->block);
+        if (!slot) {
+            return;
+        }
+        udp6_csum_copy(slot, msg->data, len);
+        if (!udp6_csum_ok()) {
+            return;
+        }
+    }
+    mcast.bitmap[msg->block / 8] |= 1 << (msg->block % 8);
+    mcast_deliver();
+}
+
+static void mcast_check_timeout(void) {
+    if (!mcast.file || mcast.next == mcast.blocks ||
+        netifc_time_us() - mcast.last_rx_us < NB_MCAST_QUIET_US) {
+        return;
+    }
+    mcast.last_rx_us = netifc_time_us();
+    mcast_report();
+}
+
+// Handles NB_MCAST_FILE, returns the ACK command
+static uint32_t mcast_start(nbmsg* msg, size_t len, const ip6_addr* saddr, uint16_t sport) {
+    nbmcast_session* info = (void*)msg->data;
+    mcast_stop();
+    if (len <= sizeof(nbmcast_session)) {
+        return NB_ERROR_BAD_PARAM;
+    }
+    // the file hash follows the file name, a name that is not terminated loses its last byte
+    char* name = info->filename;
+    size_t max_len = len - sizeof(nbmcast_session);
+    size_t name_len = strnlen(name, max_len);
+    if (name_len == max_len) {
+        name[--name_len] = 0;
+    }
+    size_t opt_len = max_len - name_len - 1;
+    uint8_t hash[NB_HASH_LEN];
+    bool have_hash = opt_len && parse_hash(name + name_len + 1, opt_len, hash);
+
+    size_t max_block = eth_mtu() - IP6_HDR_LEN - UDP_HDR_LEN - sizeof(nbmcast);
+    if (!msg->arg || !info->block_size || info->block_size > max_block) {
+        return NB_ERROR_BAD_PARAM;
+    }
+    nbfile* file = nbfile_open(name, msg->arg, NULL);
+    if (!file) {
+        printf("netboot: Rejected File '%s'...\n", name);
+        return NB_ERROR_BAD_FILE;
+    }
+    file->offset = 0;
+    size_t prefix_len = strlen(NB_FILENAME_PREFIX);
+    if (!strncmp(name, NB_FILENAME_PREFIX, prefix_len)) {
+        name += prefix_len;
+    }
+    if (have_hash && file->cached && file->cached(file->cookie, hash)) {
+        printf("netboot: File '%s' is cached, skipping transfer\n", name);
+        file->offset = msg->arg;
+        return NB_FILE_RECEIVED;
+    }
+
+    mcast.size = msg->arg;
+    mcast.block_size = info->block_size;
+    mcast.blocks = (mcast.size + mcast.block_size - 1) / mcast.block_size;
+    if (gBS->AllocatePool(EfiLoaderData, (mcast.blocks + 7) / 8, (void**)&mcast.bitmap)) {
+        mcast.bitmap = NULL;
+        return NB_ERROR_TOO_LARGE;
+    }
+    memset(mcast.bitmap, 0, (mcast.blocks + 7) / 8);
+    if ((file->write || file->locate) &&
+        gBS->AllocatePool(EfiLoaderData, NB_MCAST_WINDOW * mcast.block_size, (void**)&mcast.staging)) {
+        mcast.staging = NULL;
+        mcast_release();
+        return NB_ERROR_TOO_LARGE;
+    }
+    memcpy(&mcast.group, info->group, sizeof(ip6_addr));
+    if (ip6_join_group(&mcast.group)) {
+        printf("netboot: Cannot join the multicast group, '%s' has to be sent directly\n", name);
+        mcast_release();
+        return NB_ERROR_BAD_PARAM;
+    }
+    mcast.file = file;
+    mcast.session = info->session;
+    mcast.next = 0;
+    memcpy(&mcast.server, saddr, sizeof(ip6_addr));
+    mcast.server_port = sport;
+    mcast.last_rx_us = netifc_time_us();
+    printf("netboot: Receive File '%s' by multicast...\n", name);
+    return NB_ACK;
 }
 
 void netboot_recv(void* data, size_t len, const ip6_addr* saddr, uint16_t sport) {
     nbmsg* msg = data;
-    nbmsg ack;
+    nbmsg stack_ack;
+    nbmsg* ack = &stack_ack;
     int do_transmit = 1;
+    int r;
 
     if (len < sizeof(nbmsg))
         return;
     len -= sizeof(nbmsg);
 
+    // data chunks are verified while they are stored
+    if (msg->cmd != NB_DATA && msg->cmd != NB_LAST_DATA && !udp6_csum_ok())
+        return;
+
     // printf("netboot: MSG %08x %08x %08x %08x datalen %zu\n",
     //        msg->magic, msg->cookie, msg->cmd, msg->arg, len);
 
+    // The reply is built right in a transmit buffer. Data chunks are mostly not answered and
+    // queries get a reply of their own, those build it on the stack if it comes to that.
+    if (msg->cmd != NB_DATA && msg->cmd != NB_QUERY) {
+        size_t max_len;
+        nbmsg* out = udp6_tx_reserve(saddr, sport, NB_SERVER_PORT, &max_len);
+        if (out) {
+            ack = out;
+        }
+    }
+
     if ((last_cookie == msg->cookie) &&
         (last_cmd == msg->cmd) && (last_arg == msg->arg)) {
         // host must have missed the ack. resend
-        ack.magic = NB_MAGIC;
-        ack.cookie = last_cookie;
-        ack.cmd = last_ack_cmd;
-        ack.arg = last_ack_arg;
+        ack->magic = NB_MAGIC;
+        ack->cookie = last_cookie;
+        ack->cmd = last_ack_cmd;
+        ack->arg = last_ack_arg;
         goto transmit;
     }
 
-    ack.cmd = NB_ACK;
-    ack.arg = 0;
+    ack->cmd = NB_ACK;
+    ack->arg = 0;
 
     switch (msg->cmd) {
     case NB_COMMAND:
         if (len == 0)
-            return;
+            goto drop;
         msg->data[len - 1] = 0;
         break;
-    case NB_SEND_FILE:
+    case NB_SEND_FILE: {
         if (len == 0)
-            return;
-        msg->data[len - 1] = 0;
+            goto drop;
+        mcast_stop();
+        // the file hash follows the file name, a name that is not terminated loses its last byte
+        size_t name_len = strnlen((char*)msg->data, len);
+        if (name_len == len) {
+            msg->data[--name_len] = 0;
+        }
+        uint8_t hash[NB_HASH_LEN];
+        bool have_hash = name_len + 1 < len &&
+                         parse_hash((char*)msg->data + name_len + 1, len - name_len - 1, hash);
+        len = name_len + 1;
         for (size_t i = 0; i < (len - 1); i++) {
             if ((msg->data[i] < ' ') || (msg->data[i] > 127)) {
                 msg->data[i] = '.';
             }
         }
-        item = netboot_get_buffer((const char*)msg->data, msg->arg);
+        item = nbfile_open((const char*)msg->data, msg->arg, NULL);
         if (item) {
             item->offset = 0;
-            ack.arg = msg->arg;
+            ack->arg = msg->arg;
             size_t prefix_len = strlen(NB_FILENAME_PREFIX);
             const char* filename;
             if (!strncmp((char*)msg->data, NB_FILENAME_PREFIX, prefix_len)) {
@@ -122,35 +553,51 @@ void netboot_recv(void* data, size_t len, const ip6_addr* saddr, uint16_t sport)
             } else {
                 filename = (const char*)msg->data;
             }
-            printf("netboot: Receive File '%s'...\n", filename);
+            if (have_hash && item->cached && item->cached(item->cookie, hash)) {
+                printf("netboot: File '%s' is cached, skipping transfer\n", filename);
+                item->offset = msg->arg;
+                ack->cmd = NB_FILE_RECEIVED;
+            } else {
+                printf("netboot: Receive File '%s'...\n", filename);
+            }
         } else {
             printf("netboot: Rejected File '%s'...\n", (char*) msg->data);
-            ack.cmd = NB_ERROR_BAD_FILE;
+            ack->cmd = NB_ERROR_BAD_FILE;
         }
         break;
+    }
 
     case NB_DATA:
     case NB_LAST_DATA:
         if (item == 0) {
             printf("netboot: > received chunk before NB_FILE\n");
-            return;
+            goto drop;
         }
         if (msg->arg != item->offset) {
             // printf("netboot: < received chunk at offset %d but current offset is %zu\n", msg->arg, item->offset);
-            ack.arg = item->offset;
-            ack.cmd = NB_ACK;
+            ack->arg = item->offset;
+            ack->cmd = NB_ACK;
         } else if ((item->offset + len) > item->size) {
-            ack.cmd = NB_ERROR_TOO_LARGE;
-            ack.arg = msg->arg;
+            ack->cmd = NB_ERROR_TOO_LARGE;
+            ack->arg = msg->arg;
+        } else if ((r = nbfile_write(item, msg->data, len, item->offset))) {
+            if (r == NBFILE_CORRUPTED) {
+                // the host resends the chunk when the ACK does not come
+                goto drop;
+            }
+            ack->cmd = NB_ERROR_BAD_PARAM;
+            ack->arg = msg->arg;
         } else {
-            memcpy(item->data + item->offset, msg->data, len);
-            item->offset += len;
-            ack.cmd = msg->cmd == NB_LAST_DATA ? NB_FILE_RECEIVED : NB_ACK;
+            ack->cmd = msg->cmd == NB_LAST_DATA ? NB_FILE_RECEIVED : NB_ACK;
             if (msg->cmd != NB_LAST_DATA) {
                 do_transmit = 0;
             }
         }
         break;
+    case NB_MCAST_FILE:
+        ack->cmd = mcast_start(msg, len, saddr, sport);
+        ack->arg = ack->cmd == NB_ACK || ack->cmd == NB_FILE_RECEIVED ? msg->arg : 0;
+        break;
     case NB_BOOT:
         nb_boot_now = 1;
         printf("netboot: Boot Unicycle Application...\n");
@@ -160,58 +607,156 @@ void netboot_recv(void* data, size_t len, const ip6_addr* saddr, uint16_t sport)
         send_query_ack(saddr, sport, msg->cookie);
         return;
     default:
-        ack.cmd = NB_ERROR_BAD_CMD;
-        ack.arg = 0;
+        ack->cmd = NB_ERROR_BAD_CMD;
+        ack->arg = 0;
     }
 
     last_cookie = msg->cookie;
     last_cmd = msg->cmd;
     last_arg = msg->arg;
-    last_ack_cmd = ack.cmd;
-    last_ack_arg = ack.arg;
+    last_ack_cmd = ack->cmd;
+    last_ack_arg = ack->arg;
 
-    ack.cookie = msg->cookie;
-    ack.magic = NB_MAGIC;
+    ack->cookie = msg->cookie;
+    ack->magic = NB_MAGIC;
 transmit:
     nb_active = 1;
+    pull.filename[0] = 0;
     if (do_transmit) {
         // printf("netboot: MSG %08x %08x %08x %08x\n",
-        //   ack.magic, ack.cookie, ack.cmd, ack.arg);
+        //   ack->magic, ack->cookie, ack->cmd, ack->arg);
+
+        if (ack == &stack_ack) {
+            udp6_send(ack, sizeof(nbmsg), saddr, sport, NB_SERVER_PORT);
+        } else {
+            udp6_tx_commit(ack, sizeof(nbmsg));
+        }
+        return;
+    }
+drop:
+    if (ack != &stack_ack) {
+        udp6_tx_cancel(ack);
+    }
+}
 
-        udp6_send(&ack, sizeof(ack), saddr, sport, NB_SERVER_PORT);
+static const char* base_filename(const char* filename) {
+    size_t prefix_len = strlen(NB_FILENAME_PREFIX);
+    if (!strncmp(filename, NB_FILENAME_PREFIX, prefix_len)) {
+        return &filename[prefix_len];
     }
+    return filename;
 }
 
 static tftp_status buffer_open(const char* filename, size_t size, void* cookie) {
-    file_info_t* file_info = cookie;
-    file_info->netboot_file_data = netboot_get_buffer(filename, size);
+    tftp_conn* conn = cookie;
+    file_info_t* file_info = &conn->file_info;
+    file_info->netboot_file_data = nbfile_open(filename, size, conn);
     if (file_info->netboot_file_data == NULL) {
         printf("netboot: unrecognized file %s - rejecting\n", filename);
         return TFTP_ERR_INVALID_ARGS;
     }
     file_info->netboot_file_data->offset = 0;
-    const char* base_filename;
-    size_t prefix_len = strlen(NB_FILENAME_PREFIX);
-    if (!strncmp(filename, NB_FILENAME_PREFIX, prefix_len)) {
-        base_filename = &filename[prefix_len];
+    printf("Receiving %s [%lu bytes]... ", base_filename(filename), (unsigned long)size);
+    file_info->file_size = size;
+    file_info->progress_reported = 0;
+    file_info->receiving = true;
+    strncpy(file_info->filename, filename, sizeof(file_info->filename) - 1);
+    file_info->filename[sizeof(file_info->filename) - 1] = 0;
+    return TFTP_NO_ERROR;
+}
+
+// Lets a host continue the interrupted transfer of the same file, the SHA-256 of what we have
+// tells it whether that is the start of the file it sends now
+static size_t buffer_resume(const char* filename, size_t size, size_t block_size,
+                            char digest[TFTP_MAX_DIGEST_LEN], void* cookie) {
+    tftp_conn* conn = cookie;
+    // the host may come back from another port, the transfer is then found in another slot
+    tftp_conn* from = NULL;
+    for (tftp_conn* c = tftp_conns; c < tftp_conns + TFTP_SESSIONS; c++) {
+        file_info_t* info = &c->file_info;
+        if ((c == conn || !c->session) && info->receiving && info->netboot_file_data &&
+            info->file_size == size && !strcmp(info->filename, filename)) {
+            from = c;
+            break;
+        }
+    }
+    if (!from) {
+        return 0;
+    }
+    nbfile* file = from->file_info.netboot_file_data;
+    if (!file->offset || file->offset >= size || file->offset % block_size) {
+        return 0;
+    }
+    uint8_t hash[NB_HASH_LEN];
+    if (file->prefix_hash) {
+        if (!file->prefix_hash(file->cookie, hash)) {
+            return 0;
+        }
+    } else if (!file->write) {
+        struct sha256_ctx ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, file->data, file->offset);
+        sha256_final(&ctx, hash);
     } else {
-        base_filename = filename;
+        // the data is gone, we cannot tell what it was
+        return 0;
     }
-    printf("Receiving %s [%lu bytes]... ", base_filename, (unsigned long)size);
-    file_info->file_size = size;
+    hash_to_hex(hash, digest);
+
+    if (from != conn) {
+        conn->file_info = from->file_info;
+        from->file_info.netboot_file_data = NULL;
+    }
+    file_info_t* file_info = &conn->file_info;
+    file_info->progress_reported = size >= 100 ? file->offset / (size / 100) : 0;
+    printf("Resuming %s at %lu of %lu bytes... ", base_filename(filename),
+           (unsigned long)file->offset, (unsigned long)size);
+    return file->offset;
+}
+
+static ssize_t buffer_open_read(const char* filename, void* cookie) {
+    tftp_conn* conn = cookie;
+    file_info_t* file_info = &conn->file_info;
+    file_info->netboot_file_data = netboot_get_file(filename);
+    if (file_info->netboot_file_data == NULL) {
+        printf("netboot: unknown file %s requested\n", filename);
+        return TFTP_ERR_NOT_FOUND;
+    }
+    printf("Sending %s [%lu bytes]... ", filename, (unsigned long)file_info->netboot_file_data->size);
+    file_info->file_size = file_info->netboot_file_data->size;
     file_info->progress_reported = 0;
+    file_info->receiving = false;
+    return file_info->file_size;
+}
+
+static tftp_status buffer_read(void* data, size_t* len, off_t offset, void* cookie) {
+    tftp_conn* conn = cookie;
+    nbfile* nb_buf_info = conn->file_info.netboot_file_data;
+    if (offset > nb_buf_info->size) {
+        return TFTP_ERR_INVALID_ARGS;
+    }
+    if (*len > nb_buf_info->size - offset) {
+        *len = nb_buf_info->size - offset;
+    }
+    memcpy(data, nb_buf_info->data + offset, *len);
     return TFTP_NO_ERROR;
 }
 
 static tftp_status buffer_write(const void* data, size_t* len, off_t offset, void* cookie) {
-    file_info_t* file_info = cookie;
+    tftp_conn* conn = cookie;
+    file_info_t* file_info = &conn->file_info;
     nbfile* nb_buf_info = file_info->netboot_file_data;
     if (offset > nb_buf_info->size || (offset + *len) > nb_buf_info->size) {
         printf("netboot: attempt to write past end of buffer\n");
         return TFTP_ERR_INVALID_ARGS;
     }
-    memcpy(&nb_buf_info->data[offset], data, *len);
-    nb_buf_info->offset = offset + *len;
+    int r = nbfile_write(nb_buf_info, data, *len, offset);
+    if (r == NBFILE_CORRUPTED) {
+        return TFTP_ERR_SHOULD_WAIT;
+    } else if (r) {
+        printf("netboot: failed to store received data\n");
+        return TFTP_ERR_IO;
+    }
     if (file_info->file_size >= 100) {
         unsigned int progress_pct = offset / (file_info->file_size / 100);
         if ((progress_pct > file_info->progress_reported) &&
@@ -224,23 +769,154 @@ static tftp_status buffer_write(const void* data, size_t* len, off_t offset, voi
 }
 
 static void buffer_close(void* cookie) {
-    file_info_t* file_info = cookie;
-    file_info->netboot_file_data = NULL;
-    printf("Done\n");
+    tftp_conn* conn = cookie;
+    conn->file_info.netboot_file_data = NULL;
+    if (conn->file_info.receiving) {
+        printf("%s done\n", base_filename(conn->file_info.filename));
+    } else {
+        printf("Done\n");
+    }
 }
 
 static tftp_status udp_send(void* data, size_t len, void* cookie) {
-    transport_info_t* transport_info = cookie;
-    int bytes_sent = udp6_send(data, len, &transport_info->dest_addr, transport_info->dest_port,
+    tftp_conn* conn = cookie;
+    transport_info_t* transport_info = &conn->transport_info;
+    int bytes_sent;
+    if (data == tftp_tx_reserved) {
+        // built right in the transmit buffer, keep a copy in case it has to be resent
+        memcpy(conn->out_scratch, data, len);
+        tftp_tx_reserved = NULL;
+        bytes_sent = udp6_tx_commit(data, len);
+    } else {
+        bytes_sent = udp6_send(data, len, &transport_info->dest_addr, transport_info->dest_port,
                                NB_TFTP_OUTGOING_PORT);
+    }
+    transport_info->ack_sent_us = netifc_time_us();
+    conn->last_msg_len = len;
     return bytes_sent < 0 ? TFTP_ERR_IO : TFTP_NO_ERROR;
 }
 
+// The checksum of the datagram being handled is tracked by the IP stack
+static bool udp_verify(void* cookie) {
+    (void)cookie;
+    return udp6_csum_ok();
+}
+
 static int udp_timeout_set(uint32_t timeout_ms, void* cookie) {
-    // TODO
+    tftp_conn* conn = cookie;
+    transport_info_t* transport_info = &conn->transport_info;
+    transport_info->max_rto_us = timeout_ms * 1000;
+    uint32_t rto = transport_info->rto_us;
+    if (rto > transport_info->max_rto_us) {
+        rto = transport_info->max_rto_us;
+    }
+    transport_info->deadline_us = netifc_time_us() + rto;
     return 0;
 }
 
+// Every session starts without an RTT measurement, with the initial RTO (RFC 6298 2.1). A
+// reused slot must not carry the estimate or the backed off RTO of its previous peer.
+static void rtt_reset(transport_info_t* transport_info) {
+    transport_info->deadline_us = 0;
+    transport_info->ack_sent_us = 0;
+    transport_info->srtt_us = 0;
+    transport_info->rttvar_us = 0;
+    transport_info->rto_us = TFTP_INITIAL_RTO_US;
+}
+
+static void rtt_sample(transport_info_t* transport_info, uint32_t rtt) {
+    if (!transport_info->srtt_us) {
+        transport_info->srtt_us = rtt;
+        transport_info->rttvar_us = rtt / 2;
+    } else {
+        uint32_t delta = rtt > transport_info->srtt_us ? rtt - transport_info->srtt_us
+                                                       : transport_info->srtt_us - rtt;
+        transport_info->rttvar_us = (3 * transport_info->rttvar_us + delta) / 4;
+        transport_info->srtt_us = (7 * transport_info->srtt_us + rtt) / 8;
+    }
+    transport_info->rto_us = transport_info->srtt_us + 4 * transport_info->rttvar_us;
+    if (transport_info->rto_us < TFTP_MIN_RTO_US) {
+        transport_info->rto_us = TFTP_MIN_RTO_US;
+    }
+}
+
+// Reserves a transmit buffer for the next TFTP message of |conn|, falls back to its scratch
+// buffer if none is available
+static void* tftp_tx_buffer(tftp_conn* conn, size_t* len) {
+    void* buf = udp6_tx_reserve(&conn->transport_info.dest_addr, conn->transport_info.dest_port,
+                                NB_TFTP_OUTGOING_PORT, len);
+    if (buf) {
+        tftp_tx_reserved = buf;
+        if (*len > sizeof(conn->out_scratch)) {
+            *len = sizeof(conn->out_scratch);
+        }
+    } else {
+        buf = conn->out_scratch;
+        *len = sizeof(conn->out_scratch);
+    }
+    return buf;
+}
+
+static void tftp_tx_cancel(void) {
+    if (tftp_tx_reserved) {
+        udp6_tx_cancel(tftp_tx_reserved);
+        tftp_tx_reserved = NULL;
+    }
+}
+
+// When the host reads a file the library prepares the first DATA block of a window,
+// the rest of the window is sent from here
+static void tftp_send_pending(tftp_conn* conn) {
+    while (conn->session && tftp_session_has_pending(conn->session)) {
+        size_t outlen;
+        void* outbuf = tftp_tx_buffer(conn, &outlen);
+        uint32_t timeout_ms;
+        tftp_status status = tftp_prepare_data(conn->session, outbuf, &outlen, &timeout_ms, conn);
+        if (status < 0 || !outlen) {
+            tftp_tx_cancel();
+            break;
+        }
+        udp_send(outbuf, outlen, conn);
+    }
+}
+
+// Called when the peer has been silent for longer than the RTO: resend the last message
+// (e.g. our OACK) or re-ACK the last block we have, so the sender restarts its window.
+static void tftp_check_timeout(tftp_conn* conn) {
+    transport_info_t* transport_info = &conn->transport_info;
+    if (!conn->session || !transport_info->deadline_us ||
+        netifc_time_us() < transport_info->deadline_us) {
+        return;
+    }
+    transport_info->deadline_us = 0;
+
+    size_t msg_len = conn->last_msg_len;
+    uint32_t timeout_ms;
+    tftp_status status = tftp_timeout(conn->session, conn->out_scratch, &msg_len,
+                                      sizeof(conn->out_scratch), &timeout_ms, conn);
+    if (status == TFTP_ERR_TIMED_OUT) {
+        printf("netboot: tftp peer stopped responding, aborting transfer\n");
+        conn->session = NULL;
+        return;
+    } else if (status < 0) {
+        printf("netboot: tftp timeout handling failed (%d)\n", status);
+        conn->session = NULL;
+        return;
+    }
+
+    // back off, and don't take RTT samples from retransmissions (Karn's algorithm)
+    transport_info->rto_us *= 2;
+    if (transport_info->rto_us > transport_info->max_rto_us) {
+        transport_info->rto_us = transport_info->max_rto_us;
+    }
+    if (msg_len) {
+        udp_send(conn->out_scratch, msg_len, conn);
+        tftp_send_pending(conn);
+    }
+    transport_info->ack_sent_us = 0;
+    udp_timeout_set(transport_info->max_rto_us / 1000, conn);
+}
+
 static int strcmp8to16(const char* str8, const char16_t* str16) {
     while (*str8 != '\0' && *str8 == *str16) {
         str8++;
@@ -249,59 +925,280 @@ static int strcmp8to16(const char* str8, const char16_t* str16) {
     return *str8 - *str16;
 }
 
-void tftp_recv(void* data, size_t len, const ip6_addr* daddr, uint16_t dport,
-               const ip6_addr* saddr, uint16_t sport) {
-    static tftp_session* session = NULL;
-    static file_info_t file_info = {.netboot_file_data = NULL};
-    static transport_info_t transport_info = {};
+// Firmware that cannot keep up with large TFTP windows
+static const struct {
+    const char* vendor;
+    uint16_t max_window_size;
+} tftp_quirks[] = {
+    {"INSYDE Corp.", 8}, // Acer tablet
+};
 
-    if (dport == NB_TFTP_INCOMING_PORT) {
-        if (session != NULL) {
-            printf("Aborting to service new connection\n");
-        }
-        // Start TFTP session
-        int ret = tftp_init(&session, tftp_session_scratch, sizeof(tftp_session_scratch));
-        if (ret != TFTP_NO_ERROR) {
-            printf("netboot: failed to initiate tftp session\n");
-            session = NULL;
-            return;
+static uint16_t tftp_max_window = NB_TFTP_DEFAULT_WINDOW_SIZE;
+
+void netboot_set_tftp_window(uint16_t window_size) {
+    tftp_max_window = window_size ? window_size : 1;
+}
+
+// Largest block that fits into a single frame on the way to |addr|
+static uint16_t tftp_block_size(const ip6_addr* addr) {
+    return ip6_path_mtu(addr) - IP6_HDR_LEN - UDP_HDR_LEN - TFTP_DATA_HDR_LEN;
+}
+
+static uint16_t tftp_window_size(uint16_t window_size) {
+    for (size_t i = 0; i < sizeof(tftp_quirks) / sizeof(tftp_quirks[0]); i++) {
+        if (!strcmp8to16(tftp_quirks[i].vendor, gSys->FirmwareVendor) &&
+            window_size > tftp_quirks[i].max_window_size) {
+            window_size = tftp_quirks[i].max_window_size;
         }
+    }
+    return window_size;
+}
+
+// The session that received the last DATA block, the next frame most likely belongs to it
+static tftp_conn* rx_conn;
+// block number of the last in-place receive target
+static uint16_t rx_target_block;
+
+void* tftp_rx_target(size_t* hdr_len, size_t* len) {
+    size_t offset, block_len;
+    if (!rx_conn || !rx_conn->session) {
+        return NULL;
+    }
+    nbfile* file = rx_conn->file_info.netboot_file_data;
+    if (!file || !tftp_session_next_block(rx_conn->session, &rx_target_block, &offset, &block_len) ||
+        !block_len || offset != file->offset) {
+        return NULL;
+    }
+    size_t headroom = *hdr_len + TFTP_DATA_HDR_LEN;
+    void* dest = NULL;
+    if (file->locate) {
+        dest = file->locate(file->cookie, offset, block_len, headroom);
+    } else if (!file->write && offset >= headroom && offset + block_len <= file->size) {
+        dest = file->data + offset;
+    }
+    if (dest) {
+        *hdr_len = TFTP_DATA_HDR_LEN;
+        *len = block_len;
+    }
+    return dest;
+}
+
+int tftp_rx_target_hit(const void* data, size_t len, const ip6_addr* saddr, uint16_t sport) {
+    const uint8_t* msg = data;
+    // the upper byte of the opcode might be a retransmission counter
+    return rx_conn && sport == rx_conn->transport_info.dest_port &&
+           !memcmp(saddr, &rx_conn->transport_info.dest_addr, sizeof(ip6_addr)) &&
+           len >= TFTP_DATA_HDR_LEN && msg[1] == TFTP_OPCODE_DATA &&
+           ((msg[2] << 8) | msg[3]) == rx_target_block;
+}
+
+// Finds the session with the host at |addr| port |port|
+static tftp_conn* tftp_conn_find(const ip6_addr* addr, uint16_t port) {
+    for (tftp_conn* conn = tftp_conns; conn < tftp_conns + TFTP_SESSIONS; conn++) {
+        if (conn->session && conn->transport_info.dest_port == port &&
+            !memcmp(&conn->transport_info.dest_addr, addr, sizeof(ip6_addr))) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+// Picks the slot for a new session: a free one, preferably without an interrupted transfer
+// that could be resumed, otherwise the one that has been idle the longest
+static tftp_conn* tftp_conn_alloc(void) {
+    tftp_conn* idle = NULL;
+    tftp_conn* oldest = NULL;
+    for (tftp_conn* conn = tftp_conns; conn < tftp_conns + TFTP_SESSIONS; conn++) {
+        if (!conn->session) {
+            if (!conn->file_info.netboot_file_data) {
+                return conn;
+            }
+            if (!idle) {
+                idle = conn;
+            }
+        } else if (!oldest || conn->last_rx_us < oldest->last_rx_us) {
+            oldest = conn;
+        }
+    }
+    if (idle) {
+        return idle;
+    }
+    printf("Aborting to service new connection\n");
+    return oldest;
+}
+
+static bool tftp_busy(void) {
+    for (tftp_conn* conn = tftp_conns; conn < tftp_conns + TFTP_SESSIONS; conn++) {
+        if (conn->session) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Starts a TFTP session with |addr| in |conn|, the options are what we ask for or accept at most
+static int tftp_conn_open(tftp_conn* conn, const ip6_addr* addr, uint16_t port, uint16_t block_size) {
+    if (pull.conn == conn) {
+        pull.conn = NULL;
+        pull.waiting = false;
+    }
+    if (rx_conn == conn) {
+        rx_conn = NULL;
+    }
+    int ret = tftp_init(&conn->session, conn->session_scratch, sizeof(conn->session_scratch));
+    if (ret != TFTP_NO_ERROR) {
+        printf("netboot: failed to initiate tftp session\n");
+        conn->session = NULL;
+        return -1;
+    }
+
+    // Hosts ask for large windows, blocks that arrive out of order within one are staged
+    uint16_t window_size = tftp_window_size(tftp_max_window);
+    tftp_set_options(conn->session, &block_size, NULL, &window_size);
+
+    // Initialize file interface
+    tftp_file_interface file_ifc = {buffer_open_read, buffer_open, buffer_read, buffer_write,
+                                    buffer_close, buffer_resume};
+    tftp_session_set_file_interface(conn->session, &file_ifc);
+
+    // Initialize transport interface
+    memcpy(&conn->transport_info.dest_addr, addr, sizeof(struct ip6_addr_t));
+    conn->transport_info.dest_port = port;
+    tftp_transport_interface transport_ifc = {udp_send, NULL, udp_timeout_set, udp_verify};
+    tftp_session_set_transport_interface(conn->session, &transport_ifc);
+    tftp_session_set_max_timeouts(conn->session, TFTP_MAX_TIMEOUTS);
+    tftp_session_set_reorder_buffer(conn->session, conn->reorder_scratch,
+                                    conn->reorder_scratch ? tftp_reorder_sz : 0);
+    rtt_reset(&conn->transport_info);
+    conn->last_rx_us = netifc_time_us();
+    return 0;
+}
 
-        // Override our window size on the Acer tablet
-        if (!strcmp8to16("INSYDE Corp.", gSys->FirmwareVendor)) {
-            uint16_t window_size = 8;
-            tftp_set_options(session, NULL, NULL, &window_size);
+int netboot_set_pull(const char* filename, const char* server) {
+    strncpy(pull.filename, filename, sizeof(pull.filename) - 1);
+    if (server) {
+        if (ip6_parse(&pull.server, server)) {
+            pull.filename[0] = 0;
+            return -1;
         }
+        pull.have_server = true;
+    }
+    return 0;
+}
 
-        // Initialize file interface
-        tftp_file_interface file_ifc = {NULL, buffer_open, NULL, buffer_write, buffer_close};
-        tftp_session_set_file_interface(session, &file_ifc);
+// Sends the read request of pull mode once we know the server and are not busy otherwise
+static void pull_start(void) {
+    const ip6_addr* server = pull.have_server ? &pull.server : ip4_next_server();
+    uint64_t now = netifc_time_us();
+    if (!pull.filename[0] || !server || tftp_busy() || now < pull.next_us) {
+        return;
+    }
+    pull.next_us = now + NB_PULL_RETRY_US;
+    tftp_conn* conn = tftp_conn_alloc();
+    if (tftp_conn_open(conn, server, NB_TFTP_SERVER_PORT, tftp_block_size(server))) {
+        return;
+    }
 
-        // Initialize transport interface
-        memcpy(&transport_info.dest_addr, saddr, sizeof(struct ip6_addr_t));
-        transport_info.dest_port = sport;
-        tftp_transport_interface transport_ifc = {udp_send, NULL, udp_timeout_set};
-        tftp_session_set_transport_interface(session, &transport_ifc);
-    } else if (!session) {
-        // Ignore anything sent to the outgoing port unless we've already established a connection
+    // built in the scratch buffer, it is resent from there until the server responds
+    char err_msg[128];
+    tftp_request_opts opts = {.outbuf = conn->out_scratch,
+                              .outbuf_sz = sizeof(conn->out_scratch),
+                              .err_msg = err_msg,
+                              .err_msg_sz = sizeof(err_msg)};
+    tftp_status status = tftp_request_file(conn->session, conn, NB_APP_FILENAME,
+                                           pull.filename, &opts);
+    if (status < 0) {
+        printf("netboot: %s\n", err_msg);
+        conn->session = NULL;
+        conn->transport_info.deadline_us = 0;
         return;
     }
+    char tmp[IP6TOAMAX];
+    printf("netboot: Requesting '%s' from %s\n", pull.filename, ip6toa(tmp, (void*)server));
+    pull.conn = conn;
+    pull.waiting = true;
+}
+
+void tftp_recv(void* data, size_t len, const ip6_addr* daddr, uint16_t dport,
+               const ip6_addr* saddr, uint16_t sport) {
+    tftp_conn* conn;
+    if (dport == NB_TFTP_INCOMING_PORT) {
+        // don't let a corrupted request abort a transfer
+        if (!udp6_csum_ok()) {
+            return;
+        }
+        // a host drives the boot, don't pull over what it sends
+        pull.filename[0] = 0;
+        // a repeated request starts its session over, other sessions keep going
+        conn = tftp_conn_find(saddr, sport);
+        if (!conn) {
+            conn = tftp_conn_alloc();
+        }
+        uint16_t block_size = tftp_block_size(saddr);
+        const uint8_t* req = data;
+        if (len >= 2 && req[1] == TFTP_OPCODE_RRQ && block_size > TFTP_BUF_SZ - TFTP_DATA_HDR_LEN) {
+            // DATA blocks we send are rebuilt in the scratch buffer when they have to be resent
+            block_size = TFTP_BUF_SZ - TFTP_DATA_HDR_LEN;
+        }
+        if (tftp_conn_open(conn, saddr, sport, block_size)) {
+            return;
+        }
+    } else {
+        conn = tftp_conn_find(saddr, sport);
+        if (!conn && pull.conn && pull.waiting &&
+            !memcmp(saddr, &pull.conn->transport_info.dest_addr, sizeof(ip6_addr))) {
+            // the server answers our request from the port it uses for the transfer
+            conn = pull.conn;
+            conn->transport_info.dest_port = sport;
+            pull.waiting = false;
+        }
+        if (!conn) {
+            // Ignore anything sent to the outgoing port unless we've already established a connection
+            return;
+        }
+        if (conn->transport_info.ack_sent_us) {
+            rtt_sample(&conn->transport_info, netifc_time_us() - conn->transport_info.ack_sent_us);
+            conn->transport_info.ack_sent_us = 0;
+        }
+        conn->last_rx_us = netifc_time_us();
+        rx_conn = conn;
+    }
 
-    size_t outlen = sizeof(tftp_out_scratch);
+    // Build the response (usually an ACK) right in a transmit buffer. Most DATA blocks are not
+    // answered, an ACK goes out once per window, so they don't take a buffer. Should one of them
+    // get a response after all, it is copied from the scratch buffer.
+    size_t outlen = sizeof(conn->out_scratch);
+    void* outbuf = conn->out_scratch;
+    if (tftp_session_reply_due(conn->session, data, len)) {
+        outbuf = tftp_tx_buffer(conn, &outlen);
+    }
 
     char err_msg[128];
     tftp_handler_opts handler_opts = {.inbuf = data,
                                       .inbuf_sz = len,
-                                      .outbuf = tftp_out_scratch,
+                                      .outbuf = outbuf,
                                       .outbuf_sz = &outlen,
                                       .err_msg = err_msg,
                                       .err_msg_sz = sizeof(err_msg)};
-    tftp_status status = tftp_handle_msg(session, &transport_info, &file_info, &handler_opts);
+    tftp_status status = tftp_handle_msg(conn->session, conn, conn, &handler_opts);
+    // nothing was sent from it
+    tftp_tx_cancel();
+    if (status >= 0) {
+        tftp_send_pending(conn);
+    }
     if (status < 0) {
         printf("netboot: tftp protocol error: %s\n", err_msg);
-        session = NULL;
+        conn->session = NULL;
     } else if (status == TFTP_TRANSFER_COMPLETED) {
-        session = NULL;
+        conn->session = NULL;
+        if (pull.conn == conn) {
+            // nobody is going to send NB_BOOT
+            nb_boot_now = 1;
+            printf("netboot: Boot Unicycle Application...\n");
+        }
+    }
+    if (!conn->session) {
+        conn->transport_info.deadline_us = 0;
     }
 }
 
@@ -313,6 +1210,14 @@ int netboot_init(const char* nodename) {
         printf("netboot: Failed to open network interface\n");
         return -1;
     }
+    tftp_reorder_sz = TFTP_REORDER_BLOCKS * (eth_mtu() - IP6_HDR_LEN - UDP_HDR_LEN - TFTP_DATA_HDR_LEN);
+    if (gBS->AllocatePool(EfiLoaderData, TFTP_SESSIONS * tftp_reorder_sz, &tftp_reorder_pool)) {
+        // transfers still work, they just drop blocks that arrive out of order
+        tftp_reorder_pool = NULL;
+    }
+    for (size_t i = 0; i < TFTP_SESSIONS; i++) {
+        tftp_conns[i].reorder_scratch = tftp_reorder_pool ? tftp_reorder_pool + i * tftp_reorder_sz : NULL;
+    }
     char buf[DEVICE_ID_MAX];
     if (!nodename || (nodename[0] == 0)) {
         device_id(eth_addr(), buf);
@@ -322,6 +1227,10 @@ int netboot_init(const char* nodename) {
         strncpy(advertise_nodename, nodename, sizeof(advertise_nodename) - 1);
         snprintf(advertise_data, sizeof(advertise_data),
                  "version=%s;nodename=%s", BOOTLOADER_VERSION, nodename);
+        if (advertise_hash[0]) {
+            size_t n = strlen(advertise_data);
+            snprintf(advertise_data + n, sizeof(advertise_data) - n, ";sha256=%s", advertise_hash);
+        }
     }
     return 0;
 }
@@ -359,12 +1268,17 @@ int netboot_poll(void) {
         if (nb_active) {
             // don't advertise if we're in a transfer
             nb_active = 0;
-        } else {
+        } else if (!pull.conn || !pull.conn->session) {
             advertise();
         }
     }
 
     netifc_poll();
+    pull_start();
+    for (size_t i = 0; i < TFTP_SESSIONS; i++) {
+        tftp_check_timeout(&tftp_conns[i]);
+    }
+    mcast_check_timeout();
 
     if (nb_boot_now) {
         nb_boot_now = 0;
@@ -375,5 +1289,10 @@ int netboot_poll(void) {
 }
 
 void netboot_close(void) {
+    mcast_stop();
+    if (tftp_reorder_pool) {
+        gBS->FreePool(tftp_reorder_pool);
+        tftp_reorder_pool = NULL;
+    }
     netifc_close();
 }
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -20,10 +21,21 @@
 #define NB_CMD_PORT_END       33339
 #define NB_TFTP_OUTGOING_PORT 33340
 #define NB_TFTP_INCOMING_PORT 33341
+#define NB_MCAST_PORT         33342
+#define NB_TFTP_SERVER_PORT   69    // TFTP servers the device pulls from
+
+// Upper limit for the TFTP window a host may negotiate, the block size follows the MTU
+#define NB_TFTP_DEFAULT_WINDOW_SIZE 1024
+
+// A host that adds a "RESUME" option to its TFTP write request lets the device continue an
+// interrupted transfer of the same file and size. The OACK carries "RESUME=<offset>", a
+// multiple of the block size, and unless the offset is 0 "RESUMEDIGEST=<hex>", the SHA-256 of
+// the first <offset> bytes the device has. If that matches the file, the host goes on with
+// block <offset> / <block size> + 1, otherwise it sends the request again without "RESUME".
 
 
 #define NB_COMMAND           1   // arg=0, data=command
-#define NB_SEND_FILE         2   // arg=size, data=filename
+#define NB_SEND_FILE         2   // arg=size, data=filename[\0sha256=<hex>]
 #define NB_DATA              3   // arg=offset, data=data
 #define NB_BOOT              4   // arg=0
 #define NB_QUERY             5   // arg=0, data=hostname (or "*")
@@ -34,9 +46,11 @@
 #define NB_CLOSE             10  // arg=0
 #define NB_LAST_DATA         11  // arg=offset, data=data
 #define NB_REBOOT            12  // arg=0
+#define NB_MCAST_FILE        13  // arg=size, data=nbmcast_session, filename[\0sha256=<hex>]
 
 #define NB_ACK                0 // arg=0 or -err, NB_READ: data=data
 #define NB_FILE_RECEIVED      0x70000001 // arg=size
+#define NB_MCAST_NACK         0x70000002 // cookie=session, arg=next block, data=nbmcast_range[]
 
 #define NB_ADVERTISE          0x77777777
 
@@ -52,8 +66,18 @@
 #define NB_VERSION_1_3  0x0001030
 #define NB_VERSION_CURRENT NB_VERSION_1_3
 
+// A host that sees "sha256=<hex>" in the advertisement may append the SHA-256 of the file to
+// NB_SEND_FILE. If the device has a copy with that hash it answers NB_FILE_RECEIVED right away.
+#define NB_HASH_LEN 32
+
 #define NB_FILENAME_PREFIX "<<netboot>>"
 #define NB_APP_FILENAME NB_FILENAME_PREFIX "app.elf"
+// Block map of the cached image (read by the host) and delta against it (sent instead of app.elf)
+#define NB_APP_BLOCKMAP_FILENAME NB_FILENAME_PREFIX "app.blockmap"
+#define NB_APP_DELTA_FILENAME NB_FILENAME_PREFIX "app.delta"
+// Files the application needs next to it, e.g. ramdisks. They may be sent over TFTP sessions
+// of their own while the application is being received.
+#define NB_MODULE_FILENAME_PREFIX NB_FILENAME_PREFIX "module/"
 
 typedef struct nbmsg_t {
     uint32_t magic;
@@ -63,13 +87,69 @@ typedef struct nbmsg_t {
     uint8_t  data[0];
 } nbmsg;
 
+// Multicast transfers let one host boot many devices with a single copy of the file.
+//
+// The host sends NB_MCAST_FILE to every device. A device that takes part joins |group| and
+// ACKs with arg=size, any error means the host has to send the file with NB_SEND_FILE or TFTP.
+// The host then sends every block once to |group| on NB_MCAST_PORT, followed by a block
+// numbered NB_MCAST_END. Devices answer the end of a round, or a second of silence, with
+// NB_MCAST_NACK listing the blocks they miss, the host sends those in the next round.
+// A device that has the whole file sends NB_FILE_RECEIVED with cookie=session, arg=size.
+typedef struct nbmcast_session_t {
+    uint8_t  group[16]; // ff02::/16 IPv6 multicast group
+    uint32_t session;
+    uint32_t block_size; // payload of every block but the last one
+    char     filename[0];
+} nbmcast_session;
+
+#define NB_MCAST_END 0xFFFFFFFF
+
+typedef struct nbmcast_t {
+    uint32_t magic;
+    uint32_t session;
+    uint32_t block; // or NB_MCAST_END
+    uint8_t  data[0];
+} nbmcast;
+
+typedef struct nbmcast_range_t {
+    uint32_t first;
+    uint32_t count;
+} nbmcast_range;
+
 typedef struct nbfile_t {
     uint8_t* data;
     size_t size; // max size of buffer
     size_t offset; // write pointer
+
+    // Optional sink for files that are consumed while they are received.
+    // If set, incoming data is handed to write() instead of being copied to |data|.
+    int (*write)(void* cookie, const void* data, size_t len, size_t offset);
+    // Optional, drops the data written from |offset| on when it turned out to be corrupted
+    void (*rewind)(void* cookie, size_t offset);
+    // Optional, returns where the |len| bytes at |offset| are stored, so they can be received in
+    // place. The |headroom| bytes in front of that location have to belong to the file as well.
+    void* (*locate)(void* cookie, size_t offset, size_t len, size_t headroom);
+    // Optional, gets the file contents in order once they are verified
+    void (*received)(void* cookie, const void* data, size_t len);
+    // Optional, returns true if a local copy of the file with SHA-256 |hash| can be used instead
+    bool (*cached)(void* cookie, const uint8_t hash[NB_HASH_LEN]);
+    // Optional, sets |hash| to the SHA-256 of the first |offset| bytes, returns false if it
+    // cannot tell. Needed to resume an interrupted transfer of a file that has |write|.
+    bool (*prefix_hash)(void* cookie, uint8_t hash[NB_HASH_LEN]);
+    void* cookie;
 } nbfile;
 
 int netboot_init(const char* nodename);
+// Sets the largest TFTP window size accepted from a host. Must be called before netboot_init().
+void netboot_set_tftp_window(uint16_t window_size);
+// Advertises the SHA-256 of the locally cached image. Must be called before netboot_init().
+void netboot_set_cached_hash(const uint8_t hash[NB_HASH_LEN]);
+// Makes the device request the application |filename| from the TFTP server at |server|
+// instead of waiting for a host to send it, it is booted once it is received. Without
+// |server| the next-server named by DHCP is asked. Advertisements keep going out while
+// no transfer is running, so hosts may still push a file. Returns -1 if |server| is not
+// a valid address. Must be called before netboot_init().
+int netboot_set_pull(const char* filename, const char* server);
 const char* netboot_nodename(void);
 int netboot_poll(void);
 void netboot_close(void);
@@ -78,6 +158,10 @@ void netboot_close(void);
 // Return NULL to indicate /name/ is not wanted.
 nbfile* netboot_get_buffer(const char* name, size_t size);
 
+// Ask for a file the host wants to read, it consists of |size| bytes at |data|.
+// Return NULL if there is no such file.
+nbfile* netboot_get_file(const char* name);
+
 #define DEBUGLOG_PORT         33337
 #define DEBUGLOG_ACK_PORT     33338
 
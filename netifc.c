@@ -11,6 +11,7 @@
 #include <xefi.h>
 #include "printf.h"
 
+#include "inet4.h"
 #include "inet6.h"
 #include "netifc.h"
 
@@ -49,8 +50,6 @@ static int txc;
 static int rxc;
 #endif
 
-#define NUM_BUFFER_PAGES 8
-#define ETH_BUFFER_SIZE 1516
 #define ETH_HEADER_SIZE 16
 #define ETH_BUFFER_MAGIC 0x424201020304A7A7UL
 
@@ -61,36 +60,61 @@ struct eth_buffer_t {
     uint8_t data[0];
 };
 
+static uint32_t rx_budget = NETIFC_DEFAULT_RX_BUDGET;
+static netifc_stats stats;
+
+// Frame size and buffer slot size follow the MTU the NIC reports
+static size_t eth_frame_size = ETH_MTU;
+static size_t eth_buffer_slot = 2048;
+
 static efi_physical_addr eth_buffers_base = 0;
 static eth_buffer* eth_buffers = NULL;
 static int num_eth_buffers = 0;
 static int eth_buffers_avail = 0;
+static uint32_t eth_buffers_wanted = NETIFC_DEFAULT_TX_BUFFERS;
+
+// returns true if |addr| points into the buffer pool
+static int eth_buffer_owned(efi_physical_addr addr) {
+    return (addr >= eth_buffers_base) &&
+           (addr < eth_buffers_base + (efi_physical_addr)num_eth_buffers * eth_buffer_slot);
+}
+
+static void netifc_reclaim_tx(void);
 
 void* eth_get_buffer(size_t sz) {
     eth_buffer* buf;
-    if (sz > ETH_BUFFER_SIZE) {
+    // the frame might be preceded by 2 bytes of padding to align the IP header
+    if (sz > eth_frame_size + 2) {
         return NULL;
     }
     if (eth_buffers == NULL) {
+        // the NIC may be sitting on completed transmits
+        netifc_reclaim_tx();
+    }
+    if (eth_buffers == NULL) {
+        stats.tx_exhausted++;
         return NULL;
     }
     buf = eth_buffers;
     eth_buffers = buf->next;
     buf->next = NULL;
     eth_buffers_avail--;
+    if ((uint32_t)eth_buffers_avail < stats.tx_min_avail) {
+        stats.tx_min_avail = eth_buffers_avail;
+    }
     return buf->data;
 }
 
 void eth_put_buffer(void* data) {
     efi_physical_addr buf_paddr = (efi_physical_addr)data;
-    if ((buf_paddr < eth_buffers_base)
-        || (buf_paddr >= (eth_buffers_base + (NUM_BUFFER_PAGES * PAGE_SIZE)))) {
+    if (!eth_buffer_owned(buf_paddr)) {
         printf("fatal: attempt to use buffer outside of allocated range\n");
         for (;;)
             ;
     }
 
-    eth_buffer* buf = (void*)(buf_paddr & (~2047));
+    efi_physical_addr slot = (buf_paddr - eth_buffers_base) / eth_buffer_slot;
+    eth_buffer* buf = (void*)(eth_buffers_base + slot * eth_buffer_slot);
     if (buf->magic != ETH_BUFFER_MAGIC) {
         printf("fatal: eth buffer %p (from %p) bad magic %" PRIx64 "\n",
                buf, data, buf->magic);
@@ -114,6 +138,7 @@ int eth_send(void* data, size_t len) {
 #endif
     efi_status r;
     if ((r = snp->Transmit(snp, 0, len, (void*)data, NULL, NULL, NULL))) {
+        stats.tx_errors++;
         eth_put_buffer(data);
         return -1;
     } else {
@@ -138,13 +163,43 @@ void eth_dump_status(void) {
 #endif
 }
 
+size_t eth_mtu(void) {
+    return eth_frame_size - ETH_HDR_LEN;
+}
+
+static int eth_install_filters(void);
+static int filters_installed = 0;
+
 int eth_add_mcast_filter(const mac_addr* addr) {
+    for (size_t i = 0; i < mcast_filter_count; i++) {
+        if (!memcmp(mcast_filters + i, addr, ETH_ADDR_LEN))
+            return 0;
+    }
     if (mcast_filter_count >= MAX_FILTER)
         return -1;
     if (mcast_filter_count >= snp->Mode->MaxMCastFilterCount)
         return -1;
     memcpy(mcast_filters + mcast_filter_count, addr, ETH_ADDR_LEN);
     mcast_filter_count++;
+    // groups joined once the interface is up need the filters installed again
+    if (filters_installed && eth_install_filters()) {
+        // the NIC kept the filters it had, don't send the rejected set again with the next group
+        mcast_filter_count--;
+        return -1;
+    }
+    return 0;
+}
+
+int eth_remove_mcast_filter(const mac_addr* addr) {
+    size_t i = 0;
+    while (i < mcast_filter_count && memcmp(mcast_filters + i, addr, ETH_ADDR_LEN))
+        i++;
+    if (i == mcast_filter_count)
+        return 0;
+    mcast_filters[i] = mcast_filters[--mcast_filter_count];
+    // a NIC that keeps the old set still gets the frames we want, just some more
+    if (filters_installed && eth_install_filters())
+        return -1;
     return 0;
 }
 
@@ -169,6 +224,22 @@ int netifc_timer_expired(void) {
     return 0;
 }
 
+// TSC ticks per microsecond, calibrated in netifc_open()
+static uint64_t tsc_per_us = 1;
+
+static void netifc_calibrate_time(void) {
+    uint64_t start = __builtin_ia32_rdtsc();
+    gBS->Stall(10000);
+    uint64_t ticks = __builtin_ia32_rdtsc() - start;
+    if (ticks >= 10000) {
+        tsc_per_us = ticks / 10000;
+    }
+}
+
+uint64_t netifc_time_us(void) {
+    return __builtin_ia32_rdtsc() / tsc_per_us;
+}
+
 /* Search the available network interfaces via SimpleNetworkProtocol handles
  * and find the first valid one with a Link detected */
 efi_simple_network_protocol* netifc_find_available(void) {
@@ -260,9 +331,9 @@ link_fail:
 
 int netifc_open(void) {
     efi_boot_services* bs = gSys->BootServices;
-    efi_status ret;
 
     bs->CreateEvent(EVT_TIMER, TPL_CALLBACK, NULL, NULL, &net_timer);
+    netifc_calibrate_time();
 
     snp = netifc_find_available();
     if (!snp) {
@@ -270,32 +341,58 @@ int netifc_open(void) {
         return -1;
     }
 
-    if (bs->AllocatePages(AllocateAnyPages, EfiLoaderData, NUM_BUFFER_PAGES, &eth_buffers_base)) {
+    // MaxPacketSize does not include the media header
+    eth_frame_size = snp->Mode->MediaHeaderSize + snp->Mode->MaxPacketSize;
+    if (snp->Mode->MediaHeaderSize != ETH_HDR_LEN || eth_frame_size < ETH_MTU) {
+        eth_frame_size = ETH_MTU;
+    } else if (eth_frame_size > ETH_MAX_FRAME) {
+        eth_frame_size = ETH_MAX_FRAME;
+    }
+    eth_buffer_slot = 2048;
+    while (eth_buffer_slot < sizeof(eth_buffer) + 2 + eth_frame_size) {
+        eth_buffer_slot *= 2;
+    }
+    printf("netifc: mtu %zu\n", eth_mtu());
+
+    size_t pages = (eth_buffers_wanted * eth_buffer_slot + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &eth_buffers_base)) {
         printf("Failed to allocate net buffers\n");
         return -1;
     }
 
-    num_eth_buffers = NUM_BUFFER_PAGES * 2;
+    num_eth_buffers = eth_buffers_wanted;
     uint8_t* ptr = (void*)eth_buffers_base;
     for (int i = 0; i < num_eth_buffers; ++i) {
         eth_buffer* buf = (void*)ptr;
         buf->magic = ETH_BUFFER_MAGIC;
         eth_put_buffer(buf);
-        ptr += 2048;
+        ptr += eth_buffer_slot;
     }
+    stats.tx_min_avail = num_eth_buffers;
 
     ip6_init(snp->Mode->CurrentAddress.addr);
+    ip4_init(snp->Mode->CurrentAddress.addr);
+
+    if (eth_install_filters())
+        return -1;
+    eth_dump_status();
+    return 0;
+}
+
+static int eth_install_filters(void) {
+    efi_status ret;
 
     ret = snp->ReceiveFilters(snp,
                             EFI_SIMPLE_NETWORK_RECEIVE_UNICAST |
-                                EFI_SIMPLE_NETWORK_RECEIVE_MULTICAST,
+                                EFI_SIMPLE_NETWORK_RECEIVE_MULTICAST |
+                                EFI_SIMPLE_NETWORK_RECEIVE_BROADCAST,
                             0, 0, mcast_filter_count, (void*)mcast_filters);
     if (ret) {
         printf("Failed to install multicast filters %s\n", xefi_strerror(ret));
         return -1;
     }
 
-    eth_dump_status();
+    filters_installed = 1;
 
     if (snp->Mode->MCastFilterCount != mcast_filter_count) {
         printf("OOPS: expected %d filters, found %d\n",
@@ -322,6 +419,7 @@ int netifc_open(void) {
 force_promisc:
     ret = snp->ReceiveFilters(snp,
                             EFI_SIMPLE_NETWORK_RECEIVE_UNICAST |
+                                EFI_SIMPLE_NETWORK_RECEIVE_BROADCAST |
                                 EFI_SIMPLE_NETWORK_RECEIVE_PROMISCUOUS |
                                 EFI_SIMPLE_NETWORK_RECEIVE_PROMISCUOUS_MULTICAST,
                             0, 0, 0, NULL);
@@ -333,59 +431,149 @@ force_promisc:
 }
 
 void netifc_close(void) {
+#ifdef VERBOSE
+    printf("netifc: %lu frames in %lu batches (max %u, budget hit %lu), %lu tx buffers reclaimed\n",
+           stats.rx_frames, stats.rx_batches, stats.max_batch, stats.rx_budget_exhausted, stats.tx_reclaimed);
+    printf("netifc: %lu frames received in place, %lu did not fit\n", stats.rx_in_place, stats.rx_too_small);
+    printf("netifc: %d tx buffers, min free %u, %lu exhaustion events, %lu transmit errors\n",
+           num_eth_buffers, stats.tx_min_avail, stats.tx_exhausted, stats.tx_errors);
+#endif
     gBS->SetTimer(net_timer, TimerCancel, 0);
     gBS->CloseEvent(net_timer);
     snp->Shutdown(snp);
     snp->Stop(snp);
+    filters_installed = 0;
 }
 
 int netifc_active(void) {
     return (snp != 0);
 }
 
-void netifc_poll(void) {
-    uint8_t data[1514];
+void netifc_set_tx_buffers(uint32_t count) {
+    eth_buffers_wanted = count ? count : 1;
+}
+
+void netifc_set_rx_budget(uint32_t frames) {
+    rx_budget = frames ? frames : 1;
+}
+
+const netifc_stats* netifc_get_stats(void) {
+    return &stats;
+}
+
+// Returns all transmit buffers the NIC is done with to the pool
+static void netifc_reclaim_tx(void) {
     efi_status r;
-    size_t hsz, bsz;
     uint32_t irq;
     void* txdone;
 
-    if (eth_buffers_avail < num_eth_buffers) {
-        // Only check for completion if we have operations in progress.
-        // Otherwise, the result of GetStatus is unreliable. See ZX-759.
+    // Only check for completion if we have operations in progress.
+    // Otherwise, the result of GetStatus is unreliable. See ZX-759.
+    while (eth_buffers_avail < num_eth_buffers) {
         if ((r = snp->GetStatus(snp, &irq, &txdone))) {
             return;
         }
-        if (txdone) {
-            // Check to make sure this is one of our buffers (see ZX-1516)
-            efi_physical_addr buf_paddr = (efi_physical_addr)txdone;
-            if ((buf_paddr >= eth_buffers_base)
-                && (buf_paddr < (eth_buffers_base + (NUM_BUFFER_PAGES * PAGE_SIZE)))) {
-                eth_put_buffer(txdone);
-            }
+        if (!txdone) {
+            return;
+        }
+        // Check to make sure this is one of our buffers (see ZX-1516)
+        if (eth_buffer_owned((efi_physical_addr)txdone)) {
+            eth_put_buffer(txdone);
+            stats.tx_reclaimed++;
         }
     }
+}
 
-    hsz = 0;
-    bsz = sizeof(data);
-    r = snp->Receive(snp, &hsz, &bsz, data, NULL, NULL, NULL);
-    if (r != EFI_SUCCESS) {
-        return;
-    }
+void netifc_poll(void) {
+    static uint8_t data[ETH_MAX_FRAME];
+    // data in front of an in-place receive target, overwritten by the headers
+    static uint8_t headroom_save[128];
+    efi_status r;
+    size_t hsz, bsz, headroom;
+    uint8_t* frame;
+    uint32_t frames = 0;
+
+    netifc_reclaim_tx();
+
+    // Drain whatever the NIC has queued (e.g. a whole TFTP window) before going back
+    // to the caller's timer processing, but never spend more than rx_budget frames.
+    while (frames < rx_budget) {
+        // Receive straight into the destination of the next expected TFTP block if there
+        // is one, with the headers in front of it overwriting data that is restored after.
+        hsz = 0;
+        headroom = 0;
+        frame = eth_rx_target(&bsz, &headroom);
+        if (frame && headroom <= sizeof(headroom_save)) {
+            memcpy(headroom_save, frame, headroom);
+            r = snp->Receive(snp, &hsz, &bsz, frame, NULL, NULL, NULL);
+            if (r != EFI_SUCCESS) {
+                memcpy(frame, headroom_save, headroom);
+                headroom = 0;
+            }
+            if (r == EFI_BUFFER_TOO_SMALL) {
+                // some drivers keep the frame, try again with a buffer that fits any frame
+                stats.rx_too_small++;
+                frame = NULL;
+            }
+        } else {
+            frame = NULL;
+            headroom = 0;
+        }
+        if (!frame) {
+            frame = data;
+            bsz = eth_frame_size;
+            r = snp->Receive(snp, &hsz, &bsz, frame, NULL, NULL, NULL);
+        }
+        if (r != EFI_SUCCESS) {
+            break;
+        }
+        frames++;
+        if (headroom && !eth_rx_target_hit(frame, bsz)) {
+            // Not the block we expected. Handle it from the bounce buffer, so nothing
+            // it triggers can touch the destination while the headroom is borrowed.
+            memcpy(data, frame, bsz);
+            memcpy(frame, headroom_save, headroom);
+            frame = data;
+            headroom = 0;
+        }
+        if (headroom) {
+            stats.rx_in_place++;
+        }
 
 #if DROP_PACKETS
-    rxc++;
-    if ((random() % DROP_PACKETS) == 0) {
-        printf("rx drop %d\n", rxc);
-        return;
-    }
+        rxc++;
+        if ((random() % DROP_PACKETS) == 0) {
+            printf("rx drop %d\n", rxc);
+            memcpy(frame, headroom_save, headroom);
+            continue;
+        }
 #endif
 
 #if TRACE
-    printf("RX %02x:%02x:%02x:%02x:%02x:%02x < %02x:%02x:%02x:%02x:%02x:%02x %02x%02x %d\n",
-            data[0], data[1], data[2], data[3], data[4], data[5],
-            data[6], data[7], data[8], data[9], data[10], data[11],
-            data[12], data[13], (int)(bsz - hsz));
+        printf("RX %02x:%02x:%02x:%02x:%02x:%02x < %02x:%02x:%02x:%02x:%02x:%02x %02x%02x %d\n",
+                frame[0], frame[1], frame[2], frame[3], frame[4], frame[5],
+                frame[6], frame[7], frame[8], frame[9], frame[10], frame[11],
+                frame[12], frame[13], (int)(bsz - hsz));
 #endif
-    eth_recv(data, bsz);
+        eth_recv(frame, bsz);
+        memcpy(frame, headroom_save, headroom);
+    }
+
+    stats.polls++;
+    stats.last_batch = frames;
+    if (frames) {
+        stats.rx_batches++;
+        stats.rx_frames += frames;
+        if (frames > stats.max_batch) {
+            stats.max_batch = frames;
+        }
+        if (frames == rx_budget) {
+            stats.rx_budget_exhausted++;
+        }
+        // replies sent while handling the batch might be done already
+        netifc_reclaim_tx();
+    }
+
+    ip6_poll();
+    ip4_poll();
 }
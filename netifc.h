@@ -4,6 +4,28 @@
 
 #pragma once
 
+#include <stdint.h>
+
+// Max number of frames handled by a single netifc_poll() call
+#define NETIFC_DEFAULT_RX_BUDGET 32
+// Number of buffers in the transmit pool
+#define NETIFC_DEFAULT_TX_BUFFERS 64
+
+typedef struct {
+    uint64_t polls;               // netifc_poll() calls
+    uint64_t rx_batches;          // polls that received at least one frame
+    uint64_t rx_frames;           // frames received
+    uint64_t rx_budget_exhausted; // polls that stopped because of the budget
+    uint64_t rx_in_place;         // frames received into the destination of a TFTP block
+    uint64_t rx_too_small;        // frames that did not fit the in-place receive buffer
+    uint64_t tx_reclaimed;        // transmit buffers returned by the NIC
+    uint64_t tx_exhausted;        // eth_get_buffer() calls that found the pool empty
+    uint64_t tx_errors;           // frames the NIC refused to transmit
+    uint32_t tx_min_avail;        // lowest number of free transmit buffers seen
+    uint32_t last_batch;          // frames received by the last poll
+    uint32_t max_batch;           // largest batch seen so far
+} netifc_stats;
+
 // setup networking
 int netifc_open(void);
 
@@ -21,3 +43,15 @@ void netifc_set_timer(uint32_t ms);
 
 // returns true once the timer has expired
 int netifc_timer_expired(void);
+
+// monotonic time in microseconds, for timeouts that need finer resolution than the timer
+uint64_t netifc_time_us(void);
+
+// set the transmit pool size, has to be called before netifc_open()
+void netifc_set_tx_buffers(uint32_t count);
+
+// limit the number of frames netifc_poll() processes before returning
+void netifc_set_rx_budget(uint32_t frames);
+
+// receive/transmit counters
+const netifc_stats* netifc_get_stats(void);
@@ -0,0 +1,198 @@
+#include "sha256.h"
+
+#include <stdbool.h>
+
+#include "string.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static uint32_t load_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static void sha256_blocks_scalar(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    for (; blocks; blocks--, data += SHA256_BLOCK_SIZE) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+
+// The SHA extensions keep the state as ABEF/CDGH halves and do two rounds per instruction
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1); // CDAB
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B); // EFGH
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    for (; blocks; blocks--, data += SHA256_BLOCK_SIZE) {
+        __m128i abef_save = abef, cdgh_save = cdgh;
+        __m128i w[4]; // message schedule, w[i & 3] holds words 4 * i .. 4 * i + 3
+        for (int i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), bswap);
+        }
+        for (int i = 0; i < 16; i++) {
+            if (i >= 4) {
+                __m128i prev = w[(i + 3) & 3];
+                w[i & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+                                  _mm_alignr_epi8(prev, w[(i + 2) & 3], 4)),
+                    prev);
+            }
+            __m128i k = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            // each instruction returns the new ABEF, the previous ABEF is the new CDGH
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(k, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1B);  // FEBA
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1); // DCHG
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+static bool have_sha_ni(void) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+    if (eax < 7) {
+        return false;
+    }
+    __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+    bool ssse3 = (ecx >> 9) & 1, sse41 = (ecx >> 19) & 1;
+    if (!ssse3 || !sse41) {
+        return false;
+    }
+    __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    return (ebx >> 29) & 1;
+}
+
+// Picked by the first sha256_init(). A flag rather than a function pointer, the image is not
+// relocated so a statically initialized pointer would hold the link-time address.
+static int sha256_use_shani = -1;
+
+static void sha256_select(void) {
+    if (sha256_use_shani < 0) {
+        sha256_use_shani = have_sha_ni();
+    }
+}
+
+static void sha256_blocks(uint32_t state[8], const uint8_t *data, size_t blocks) {
+    if (sha256_use_shani) {
+        sha256_blocks_shani(state, data, blocks);
+    } else {
+        sha256_blocks_scalar(state, data, blocks);
+    }
+}
+
+#else
+static void sha256_select(void) {}
+#define sha256_blocks sha256_blocks_scalar
+#endif
+
+void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    sha256_select();
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->len = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    size_t used = ctx->len % SHA256_BLOCK_SIZE;
+    ctx->len += len;
+
+    if (used) {
+        size_t n = SHA256_BLOCK_SIZE - used;
+        if (len < n) {
+            memcpy(ctx->buf + used, p, len);
+            return;
+        }
+        memcpy(ctx->buf + used, p, n);
+        sha256_blocks(ctx->state, ctx->buf, 1);
+        p += n;
+        len -= n;
+    }
+    // whole blocks are hashed right from the caller's buffer
+    sha256_blocks(ctx->state, p, len / SHA256_BLOCK_SIZE);
+    p += len - len % SHA256_BLOCK_SIZE;
+    memcpy(ctx->buf, p, len % SHA256_BLOCK_SIZE);
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->len * 8;
+    size_t used = ctx->len % SHA256_BLOCK_SIZE;
+    ctx->buf[used++] = 0x80;
+    if (used > SHA256_BLOCK_SIZE - 8) {
+        memset(ctx->buf + used, 0, SHA256_BLOCK_SIZE - used);
+        sha256_blocks(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, SHA256_BLOCK_SIZE - 8 - used);
+    store_be32(ctx->buf + 56, bits >> 32);
+    store_be32(ctx->buf + 60, bits);
+    sha256_blocks(ctx->state, ctx->buf, 1);
+
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, ctx->state[i]);
+    }
+}
@@ -0,0 +1,156 @@
+// Host test for the checksum kernels: checks them against the original 16 bit word loop
+// over random buffers, lengths and alignments, then prints their throughput.
+//
+//   make test
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../checksum.c"
+
+// The checksum() this tree shipped before the wide kernels
+static uint16_t checksum_ref(const void* _data, size_t len, uint16_t _sum) {
+    uint32_t sum = _sum;
+    const uint16_t* data = _data;
+    while (len > 1) {
+        sum += *data++;
+        len -= 2;
+    }
+    if (len) {
+        sum += (*data & 0xFF);
+    }
+    while (sum > 0xFFFF) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return sum;
+}
+
+typedef uint64_t (*kernel_t)(const uint8_t* data, size_t len, uint64_t sum);
+
+static const struct {
+    const char* name;
+    kernel_t fn;
+} kernels[] = {
+    {"scalar", checksum_scalar},
+#if defined(__x86_64__)
+    {"sse2", checksum_sse2},
+    {"avx2", checksum_avx2},
+#endif
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+#define MAX_LEN 9000
+#define ROUNDS 200000
+
+static uint8_t buf[MAX_LEN + 64];
+static uint8_t dst[MAX_LEN + 64];
+
+static int kernel_usable(size_t i) {
+#if defined(__x86_64__)
+    if (kernels[i].fn == checksum_avx2) {
+        return have_avx2();
+    }
+#endif
+    (void)i;
+    return 1;
+}
+
+static int check(void) {
+    int failed = 0;
+    for (int round = 0; round < ROUNDS && failed < 10; round++) {
+        // mostly packet sized, sometimes long, always some odd lengths and offsets
+        size_t len = (round & 7) ? rand() % 1600 : rand() % MAX_LEN;
+        size_t off = rand() % 16;
+        uint16_t init = (round & 1) ? rand() : 0;
+        // all ones and all zeros hit the end-around carry corner cases
+        for (size_t i = 0; i < len; i++) {
+            buf[off + i] = round % 5 == 0 ? 0xFF : round % 5 == 1 ? 0x00 : rand();
+        }
+        uint16_t want = checksum_ref(buf + off, len, init);
+
+        for (size_t k = 0; k < NKERNELS; k++) {
+            if (!kernel_usable(k)) {
+                continue;
+            }
+            uint16_t got = csum_fold(kernels[k].fn(buf + off, len, init));
+            if (got != want) {
+                printf("FAIL %s len %zu off %zu: %04x != %04x\n", kernels[k].name, len, off, got, want);
+                failed++;
+            }
+        }
+
+        uint16_t got = csum_fold(csum_partial(buf + off, len, init));
+        if (got != want) {
+            printf("FAIL csum_partial len %zu off %zu: %04x != %04x\n", len, off, got, want);
+            failed++;
+        }
+
+        size_t doff = rand() % 16;
+        got = csum_fold(csum_partial_copy(dst + doff, buf + off, len, init));
+        if (got != want || memcmp(dst + doff, buf + off, len)) {
+            printf("FAIL csum_partial_copy len %zu off %zu/%zu\n", len, off, doff);
+            failed++;
+        }
+
+        // sums of pieces split at even offsets must chain
+        size_t split = len ? (rand() % len) & ~(size_t)1 : 0;
+        got = csum_fold(csum_partial(buf + off + split, len - split, csum_partial(buf + off, split, init)));
+        if (got != want) {
+            printf("FAIL split at %zu len %zu: %04x != %04x\n", split, len, got, want);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t ref_kernel(const uint8_t* data, size_t len, uint64_t sum) {
+    return checksum_ref(data, len, sum);
+}
+
+static void bench(const char* name, kernel_t fn, size_t len) {
+    const size_t total = (size_t)1 << 30;
+    size_t iters = total / len;
+    volatile uint64_t sink = 0;
+    double t = now();
+    for (size_t i = 0; i < iters; i++) {
+        sink += fn(buf, len, sink & 0xFFFF);
+    }
+    t = now() - t;
+    printf("  %-8s %5zu bytes: %8.0f MB/s\n", name, len, iters * len / t / 1e6);
+}
+
+int main(void) {
+    srand(1);
+    checksum_init();
+
+    int failed = check();
+    if (failed) {
+        printf("checksum: %d failures\n", failed);
+        return 1;
+    }
+    printf("checksum: %d random buffers ok\n", ROUNDS);
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = rand();
+    }
+    static const size_t sizes[] = {64, 1452, 8192};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        bench("original", ref_kernel, sizes[s]);
+        for (size_t k = 0; k < NKERNELS; k++) {
+            if (kernel_usable(k)) {
+                bench(kernels[k].name, kernels[k].fn, sizes[s]);
+            }
+        }
+    }
+    return 0;
+}
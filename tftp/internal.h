@@ -178,9 +178,32 @@ struct tftp_session_t {
     uint16_t block_size;
     uint8_t timeout;
 
+    // When receiving, the last block of the window the peer is sending, 0 until the first
+    // DATA block. The peer sends window_size blocks after every ACK (RFC 7440) and resends
+    // whatever it has in flight when it gets an ACK early, so we ACK only when this block
+    // arrives or when a gap is too wide for the reorder buffer. Smaller holes are filled from
+    // the reorder buffer.
+    uint64_t window_end;
+
+    // Staging area for blocks that arrive ahead of the next expected one. Slot i of the
+    // buffer holds block (n % reorder_slots) and bit i of reorder_mask marks block
+    // block_number + 2 + i as received. Blocks are passed to the file interface in order
+    // once the hole in front of them is filled.
+    uint8_t* reorder_buf;
+    size_t reorder_buf_sz;
+    uint32_t reorder_slots;
+    uint64_t reorder_mask;
+
+    // Bytes of the file the receiver kept from an earlier transfer, see tftp_file_resume_cb.
+    // Kept so that the OACK can be repeated if the client sends its request again.
+    size_t resume_offset;
+    char resume_digest[TFTP_MAX_DIGEST_LEN];
+
     // Callbacks
     tftp_file_interface file_interface;
     tftp_transport_interface transport_interface;
+    // transport cookie of the message being processed, for the verify callback
+    void* transport_cookie;
 };
 
 // Generates a read or write request to send to a tftp server. |filename| is
@@ -211,7 +234,10 @@ tftp_status tftp_generate_request(tftp_session* session,
 // assemble the next packet to send. |outlen| is the size of the outgoing
 // scratch buffer. |timeout_ms| is set to the next timeout value the user of the
 // library should use when waiting for a response. |cookie| will be passed to
-// the tftp callback functions.
+// the tftp callback functions. A corrupted message is dropped with
+// TFTP_MSG_DROPPED, there is nothing to send and the timeout is not to be
+// re-armed then.
+#define TFTP_MSG_DROPPED 2
 tftp_status tftp_process_msg(tftp_session* session,
                              void* incoming,
                              size_t inlen,
@@ -59,6 +59,12 @@ static const char* kWindowSize = "WINDOWSIZE";
 static const size_t kWindowSizeLen = 10; // strlen(kWindowSize);
 static const size_t kMaxWindowSizeOpt = 18; // kWindowSizeLen + strlen("!") + 1 + strlen(65535) + 1;
 
+static const char* kResume = "RESUME";
+static const size_t kResumeLen = 6; // strlen(kResume)
+static const char* kResumeDigest = "RESUMEDIGEST";
+static const size_t kMaxResumeOpt = 28; // kResumeLen + 1 + strlen(2^64 - 1) + 1
+static const size_t kMaxResumeDigestOpt = 13 + TFTP_MAX_DIGEST_LEN; // strlen(kResumeDigest) + 1 + digest
+
 // Since RRQ and WRQ come before option negotation, they are limited to max TFTP
 // blocksize of 512 (RFC 1350 and 2347).
 static const size_t kMaxRequestSize = 512;
@@ -272,6 +278,47 @@ bool tftp_session_has_pending(tftp_session* session) {
             session->file_size;
 }
 
+static size_t tftp_block_len(tftp_session* session, uint64_t block);
+
+bool tftp_session_next_block(tftp_session* session, uint16_t* block, size_t* offset,
+                             size_t* length) {
+    if (session->direction != RECV_FILE ||
+        (session->state != REQ_RECEIVED && session->state != FIRST_DATA &&
+         session->state != RECEIVING_DATA)) {
+        return false;
+    }
+    *block = session->block_number + 1;
+    *offset = session->block_number * session->block_size;
+    *length = tftp_block_len(session, session->block_number + 1);
+    return true;
+}
+
+static uint32_t tftp_reorder_capacity(tftp_session* session);
+
+bool tftp_session_reply_due(tftp_session* session, const void* msg, size_t len) {
+    const tftp_data_msg* data = msg;
+    if (len < sizeof(*data) || (ntohs(data->opcode) & 0xff) != OPCODE_DATA ||
+        session->direction != RECV_FILE || session->state != RECEIVING_DATA) {
+        return true;
+    }
+    // the next block or one that gets staged, anything else is answered right away
+    int16_t block_delta = ntohs(data->block) - (uint16_t)session->block_number;
+    if (block_delta < 1 || block_delta - 1 > (int)tftp_reorder_capacity(session)) {
+        return true;
+    }
+    uint64_t block = session->block_number + block_delta;
+    uint64_t window_end = session->window_end ? session->window_end : session->block_number + session->window_size;
+    uint64_t last = block;
+    if (block_delta == 1) {
+        // the blocks staged behind it are delivered with it
+        for (uint64_t mask = session->reorder_mask; mask & 1; mask >>= 1) {
+            last++;
+        }
+    }
+    return block >= window_end || session->window_index + 1 >= session->window_size ||
+           last * session->block_size > session->file_size;
+}
+
 tftp_status tftp_set_options(tftp_session* session, const uint16_t* block_size,
                              const uint8_t* timeout, const uint16_t* window_size) {
     session->options.mask = 0;
@@ -312,6 +359,9 @@ tftp_status tftp_generate_request(tftp_session* session,
     session->block_size = DEFAULT_BLOCKSIZE;
     session->timeout = DEFAULT_TIMEOUT;
     session->window_size = DEFAULT_WINDOWSIZE;
+    session->reorder_slots = 0;
+    session->reorder_mask = 0;
+    session->window_end = 0;
 
     tftp_msg* ack = outgoing;
     OPCODE(session, ack, (direction == SEND_FILE) ? OPCODE_WRQ : OPCODE_RRQ);
@@ -465,11 +515,15 @@ tftp_status tftp_handle_request(tftp_session* session,
     session->block_size = DEFAULT_BLOCKSIZE;
     session->timeout = DEFAULT_TIMEOUT;
     session->window_size = DEFAULT_WINDOWSIZE;
+    session->reorder_slots = 0;
+    session->reorder_mask = 0;
+    session->window_end = 0;
 
     // TODO(tkilbourn): refactor option handling code to share with
     // tftp_handle_oack
     cur += offset;
     bool file_size_seen = false;
+    bool resume_requested = false;
     tftp_options requested_options = {.mask = 0};
     tftp_options* override_opts = &session->options;
     while (offset > 0 && left > 0) {
@@ -507,7 +561,7 @@ tftp_status tftp_handle_request(tftp_session* session,
             if (force_block_size || !(override_opts->mask & BLOCKSIZE_OPTION)) {
                 session->block_size = val;
             } else {
-                session->block_size = override_opts->block_size;
+                session->block_size = MIN(val, override_opts->block_size);
             }
         } else if (!strncasecmp(option, kTimeout, kTimeoutLen)) { // RFC 2349
             bool force_timeout_val = (option[kTimeoutLen] == '!');
@@ -540,8 +594,11 @@ tftp_status tftp_handle_request(tftp_session* session,
             if (force_window_size || !(override_opts->mask & WINDOWSIZE_OPTION)) {
                 session->window_size = val;
             } else {
-                session->window_size = override_opts->window_size;
+                session->window_size = MIN(val, override_opts->window_size);
             }
+        } else if (!strncasecmp(option, kResume, kResumeLen) && option[kResumeLen] == '\0') {
+            // the value the client sends does not matter
+            resume_requested = direction == RECV_FILE;
         } else {
             // Options which the server does not support should be omitted from the
             // OACK; they should not cause an ERROR packet to be generated.
@@ -560,28 +617,45 @@ tftp_status tftp_handle_request(tftp_session* session,
     // Open file, if we haven't already
     if (session->state == NONE) {
         if (direction == RECV_FILE) {
-            if (!session->file_interface.open_write) {
-                xprintf("Unable to service write request: no open_write implementation\n");
-                set_error(session, TFTP_ERR_CODE_UNDEF, resp, resp_len, "internal error");
-                return TFTP_ERR_BAD_STATE;
+            session->resume_offset = 0;
+            if (resume_requested && session->file_interface.resume) {
+                session->resume_offset = session->file_interface.resume(
+                    session->filename, session->file_size, session->block_size,
+                    session->resume_digest, cookie);
+                if (session->resume_offset && (session->resume_offset % session->block_size ||
+                                               session->resume_offset >= session->file_size)) {
+                    xprintf("Invalid resume offset %zu\n", session->resume_offset);
+                    set_error(session, TFTP_ERR_CODE_UNDEF, resp, resp_len, "internal error");
+                    return TFTP_ERR_BAD_STATE;
+                }
             }
-            switch(session->file_interface.open_write(session->filename, session->file_size,
-                                                      cookie)) {
-            case TFTP_ERR_SHOULD_WAIT:
-                // The open_write() callback can return an ERR_SHOULD_WAIT response if it isn't
-                // prepared to service another request at the moment and the client should retry
-                // later.
-                xprintf("Denying write request received when not ready\n");
-                set_error(session, TFTP_ERR_CODE_BUSY, resp, resp_len, "not ready to receive");
-                session->state = NONE;
-                return TFTP_ERR_SHOULD_WAIT;
-            case TFTP_NO_ERROR:
-                break;
-            default:
-                xprintf("Could not open file on write request\n");
-                set_error(session, TFTP_ERR_CODE_ACCESS_VIOLATION, resp, resp_len,
-                          "could not open file for writing");
-                return TFTP_ERR_BAD_STATE;
+            if (session->resume_offset) {
+                // the file is still open from the earlier transfer
+                xprintf("Resuming at %zu\n", session->resume_offset);
+            } else {
+                if (!session->file_interface.open_write) {
+                    xprintf("Unable to service write request: no open_write implementation\n");
+                    set_error(session, TFTP_ERR_CODE_UNDEF, resp, resp_len, "internal error");
+                    return TFTP_ERR_BAD_STATE;
+                }
+                switch(session->file_interface.open_write(session->filename, session->file_size,
+                                                          cookie)) {
+                case TFTP_ERR_SHOULD_WAIT:
+                    // The open_write() callback can return an ERR_SHOULD_WAIT response if it isn't
+                    // prepared to service another request at the moment and the client should retry
+                    // later.
+                    xprintf("Denying write request received when not ready\n");
+                    set_error(session, TFTP_ERR_CODE_BUSY, resp, resp_len, "not ready to receive");
+                    session->state = NONE;
+                    return TFTP_ERR_SHOULD_WAIT;
+                case TFTP_NO_ERROR:
+                    break;
+                default:
+                    xprintf("Could not open file on write request\n");
+                    set_error(session, TFTP_ERR_CODE_ACCESS_VIOLATION, resp, resp_len,
+                              "could not open file for writing");
+                    return TFTP_ERR_BAD_STATE;
+                }
             }
         } else {
             ssize_t file_size;
@@ -635,6 +709,18 @@ tftp_status tftp_handle_request(tftp_session* session,
     if (requested_options.mask & WINDOWSIZE_OPTION) {
         append_option(&body, &left, kWindowSize, false, "%d", session->window_size);
     }
+    if (resume_requested) {
+        if (left < kMaxResumeOpt + kMaxResumeDigestOpt) {
+            set_error(session, TFTP_ERR_CODE_UNDEF, resp, resp_len, "internal error");
+            return TFTP_ERR_BUFFER_TOO_SMALL;
+        }
+        append_option(&body, &left, kResume, false, "%zu", session->resume_offset);
+        if (session->resume_offset) {
+            append_option(&body, &left, kResumeDigest, false, "%s", session->resume_digest);
+        }
+        // the client goes on with the block behind the ones we have
+        session->block_number = session->resume_offset / session->block_size;
+    }
     *resp_len = *resp_len - left;
     session->state = REQ_RECEIVED;
     session->direction = direction;
@@ -685,11 +771,71 @@ static void tftp_prepare_ack(tftp_session* session,
     tftp_data_msg* ack_data = (tftp_data_msg*)msg;
     xprintf(" -> Ack %" PRIu64 "\n", session->block_number);
     session->window_index = 0;
+    // the peer sends the next window from the block after this one
+    session->window_end = session->block_number + session->window_size;
     OPCODE(session, ack_data, OPCODE_ACK);
     ack_data->block = htons(session->block_number & 0xffff);
     *msg_len = sizeof(*ack_data);
 }
 
+static tftp_status tftp_write_block(tftp_session* session,
+                                    void* buf,
+                                    size_t len,
+                                    void* cookie) {
+    size_t off = session->block_number * session->block_size;
+    while (len > 0) {
+        tftp_status ret;
+        // TODO(tkilbourn): assert that these function pointers are set
+        size_t wr = len;
+        ret = session->file_interface.write(buf, &wr, off, cookie);
+        if (ret < 0) {
+            xprintf("Error writing: %d\n", ret);
+            return ret;
+        }
+        buf += wr;
+        off += wr;
+        len -= wr;
+    }
+    session->block_number++;
+    return TFTP_NO_ERROR;
+}
+
+// Number of blocks past the next expected one that can be staged
+static uint32_t tftp_reorder_capacity(tftp_session* session) {
+    if (!session->reorder_buf || !session->block_size) {
+        return 0;
+    }
+    if (!session->reorder_slots) {
+        // The block size is only known once the options are negotiated
+        size_t slots = session->reorder_buf_sz / session->block_size;
+        session->reorder_slots = slots > 64 ? 64 : slots;
+    }
+    return session->reorder_slots;
+}
+
+// Checks the integrity of the message being processed with the transport, if it
+// can tell
+static bool tftp_verify(tftp_session* session) {
+    if (!session->transport_interface.verify) {
+        return true;
+    }
+    return session->transport_interface.verify(session->transport_cookie);
+}
+
+// Size of the payload of block number |block|, the last one is shorter than the others
+static size_t tftp_block_len(tftp_session* session, uint64_t block) {
+    size_t start = (block - 1) * session->block_size;
+    if (start >= session->file_size) {
+        return 0;
+    }
+    size_t left = session->file_size - start;
+    return left < session->block_size ? left : session->block_size;
+}
+
+static uint8_t* tftp_reorder_slot(tftp_session* session, uint64_t block) {
+    return session->reorder_buf + (block % session->reorder_slots) * session->block_size;
+}
+
 tftp_status tftp_handle_data(tftp_session* session,
                              tftp_msg* msg,
                              size_t msg_len,
@@ -707,6 +853,11 @@ tftp_status tftp_handle_data(tftp_session* session,
         return TFTP_ERR_INTERNAL;
     }
 
+    if (!session->window_end) {
+        // the first window follows the OACK or the ACK of the block we resume after
+        session->window_end = session->block_number + session->window_size;
+    }
+
     tftp_data_msg* data = (tftp_data_msg*)msg;
 
     uint16_t block_num = ntohs(data->block);
@@ -715,6 +866,7 @@ tftp_status tftp_handle_data(tftp_session* session,
     // (> 65535 * blocksize bytes), we allow the block number to wrap. We use signed modulo
     // math to determine the relative location of the block to our current position.
     int16_t block_delta = block_num - (uint16_t)session->block_number;
+    uint64_t block = session->block_number + block_delta;
     xprintf(" <- Block %" PRIu64 " (Last = %" PRIu64 ", Offset = %" PRIu64
                 ", Size = %zd, Left = %" PRIu64 ")\n",
             session->block_number + block_delta, session->block_number,
@@ -722,23 +874,43 @@ tftp_status tftp_handle_data(tftp_session* session,
             session->file_size - session->block_number * session->block_size);
     if (block_delta == 1) {
         xprintf("Advancing normally + 1\n");
-        void* buf = data->data;
-        size_t len = msg_len - sizeof(tftp_data_msg);
-        size_t off = session->block_number * session->block_size;
-        while (len > 0) {
-            tftp_status ret;
-            // TODO(tkilbourn): assert that these function pointers are set
-            size_t wr = len;
-            ret = session->file_interface.write(buf, &wr, off, cookie);
+        tftp_status ret = tftp_write_block(session, data->data, msg_len - sizeof(tftp_data_msg),
+                                           cookie);
+        session->window_index++;
+        if (ret == TFTP_ERR_SHOULD_WAIT) {
+            // The block was corrupted in transit, treat it like a lost one
+            xprintf("Dropped corrupted block\n");
+            goto ack;
+        } else if (ret < 0) {
+            return ret;
+        }
+
+        // The block might have filled a hole, deliver the blocks staged behind it
+        while (session->reorder_mask & 1) {
+            uint8_t* slot = tftp_reorder_slot(session, session->block_number + 1);
+            size_t len = tftp_block_len(session, session->block_number + 1);
+            session->reorder_mask >>= 1;
+            ret = tftp_write_block(session, slot, len, cookie);
             if (ret < 0) {
-                xprintf("Error writing: %d\n", ret);
                 return ret;
             }
-            buf += wr;
-            off += wr;
-            len -= wr;
         }
-        session->block_number++;
+        session->reorder_mask >>= 1;
+    } else if (block_delta > 1 && block_delta - 1 <= (int)tftp_reorder_capacity(session)) {
+        // Stage the block until the ones in front of it arrive
+        uint64_t bit = 1ull << (block_delta - 2);
+        if (!(session->reorder_mask & bit) && tftp_verify(session)) {
+            uint64_t abs_block = session->block_number + block_delta;
+            size_t len = msg_len - sizeof(tftp_data_msg);
+            if (len != tftp_block_len(session, abs_block)) {
+                set_error(session, TFTP_ERR_CODE_UNDEF, resp, resp_len, "bad block length");
+                return TFTP_ERR_BAD_STATE;
+            }
+            memcpy(tftp_reorder_slot(session, abs_block), data->data, len);
+            session->reorder_mask |= bit;
+            xprintf("Staged: got %" PRIu64 ", expected %" PRIu64 "\n", abs_block,
+                    session->block_number + 1);
+        }
         session->window_index++;
     } else if (block_delta > 1) {
         // Force sending a ACK with the last block_number we received
@@ -749,9 +921,16 @@ tftp_status tftp_handle_data(tftp_session* session,
         if (session->use_opcode_prefix) {
             session->opcode_prefix++;
         }
+    } else if (session->reorder_buf) {
+        // A retransmission of a block we have already. The peer restarted its window
+        // after a loss, count it so the next ACK goes out when that window ends.
+        session->window_index++;
     }
 
-    if (session->window_index == session->window_size ||
+ack:
+    // A hole left in the window is reported by this ACK, the peer then sends the next
+    // window from the hole and the staged blocks behind it are not needed again
+    if (block >= session->window_end || session->window_index >= session->window_size ||
             session->block_number * session->block_size > session->file_size) {
         tftp_prepare_ack(session, resp, resp_len);
         if (session->block_number * session->block_size > session->file_size) {
@@ -977,6 +1156,13 @@ tftp_status tftp_process_msg(tftp_session* session,
     // Set default timeout
     *timeout_ms = 1000 * session->timeout;
 
+    // DATA blocks are verified by the file interface as they are written
+    if (opcode != OPCODE_DATA && !tftp_verify(session)) {
+        xprintf("Dropping corrupted message\n");
+        *outlen = 0;
+        return TFTP_MSG_DROPPED;
+    }
+
     // Reset timeout count
     session->consecutive_timeouts = 0;
 
@@ -1024,6 +1210,14 @@ void tftp_session_set_max_timeouts(tftp_session* session,
     session->max_timeouts = max_timeouts;
 }
 
+void tftp_session_set_reorder_buffer(tftp_session* session, void* buffer, size_t size) {
+    session->reorder_buf = buffer;
+    session->reorder_buf_sz = size;
+    session->reorder_slots = 0;
+    session->reorder_mask = 0;
+    session->window_end = 0;
+}
+
 void tftp_session_set_opcode_prefix_use(tftp_session* session,
                                         bool enable) {
     session->use_opcode_prefix = enable;
@@ -1144,6 +1338,7 @@ static tftp_status tftp_msg_loop(tftp_session* session,
         }
 
         out_sz = opts->out_buf_sz;
+        session->transport_cookie = transport_cookie;
         ret = tftp_process_msg(session,
                                opts->incoming,
                                n,
@@ -1261,6 +1456,48 @@ tftp_status tftp_pull_file(tftp_session* session,
                          local_filename, remote_filename, opts);
 }
 
+tftp_status tftp_request_file(tftp_session* session,
+                              void* transport_cookie,
+                              const char* local_filename,
+                              const char* remote_filename,
+                              tftp_request_opts* opts) {
+    if (!opts || !opts->outbuf || !opts->outbuf_sz) {
+        return TFTP_ERR_INVALID_ARGS;
+    }
+
+    tftp_mode mode = opts->mode ? *opts->mode : TFTP_DEFAULT_CLIENT_MODE;
+    size_t out_sz = opts->outbuf_sz;
+    uint32_t timeout_ms;
+    tftp_status status = tftp_generate_request(session,
+                                               RECV_FILE,
+                                               local_filename,
+                                               remote_filename,
+                                               mode,
+                                               0,
+                                               opts->block_size,
+                                               opts->timeout,
+                                               opts->window_size,
+                                               opts->outbuf,
+                                               &out_sz,
+                                               &timeout_ms);
+    if (status < 0) {
+        REPORT_ERR(opts, "failed to generate read request");
+        return status;
+    }
+
+    session->transport_cookie = transport_cookie;
+    status = session->transport_interface.send(opts->outbuf, out_sz, transport_cookie);
+    if (status != TFTP_NO_ERROR) {
+        REPORT_ERR(opts, "failed during transport send callback");
+        return status;
+    }
+    if (session->transport_interface.timeout_set(timeout_ms, transport_cookie) < 0) {
+        REPORT_ERR(opts, "failed during transport timeout set callback");
+        return TFTP_ERR_INTERNAL;
+    }
+    return TFTP_NO_ERROR;
+}
+
 tftp_status tftp_service_request(tftp_session* session,
                                  void* transport_cookie,
                                  void* file_cookie,
@@ -1292,8 +1529,13 @@ tftp_status tftp_handle_msg(tftp_session* session,
     }
     uint32_t timeout_ms;
     tftp_status ret;
+    session->transport_cookie = transport_cookie;
     ret = tftp_process_msg(session, opts->inbuf, opts->inbuf_sz,
                            opts->outbuf, opts->outbuf_sz, &timeout_ms, file_cookie);
+    if (ret == TFTP_MSG_DROPPED) {
+        // as if it never arrived, the pending timeout stays as it is
+        return TFTP_NO_ERROR;
+    }
     if (*opts->outbuf_sz) {
         tftp_status send_status = session->transport_interface.send(opts->outbuf, *opts->outbuf_sz,
                                                                     transport_cookie);
@@ -165,12 +165,27 @@ typedef tftp_status (*tftp_file_write_cb)(const void* data,
 // tftp_process_msg.
 typedef void (*tftp_file_close_cb)(void* file_cookie);
 
+// tftp_file_resume_cb is optional. It is called before open_write when the client
+// offers to resume an interrupted transfer (a "RESUME" option in the write request).
+// If the start of the file, up to a multiple of |block_size| that is smaller than |size|,
+// is still there from an earlier transfer of |filename|, the callback keeps the file
+// open and returns that offset, the transfer continues right behind it. It sets |digest|
+// to a string the client checks the kept bytes with ("RESUMEDIGEST" in the OACK).
+// Returning 0 receives the whole file, open_write is called then.
+#define TFTP_MAX_DIGEST_LEN 72
+typedef size_t (*tftp_file_resume_cb)(const char* filename,
+                                      size_t size,
+                                      size_t block_size,
+                                      char digest[TFTP_MAX_DIGEST_LEN],
+                                      void* file_cookie);
+
 typedef struct {
     tftp_file_open_read_cb open_read;
     tftp_file_open_write_cb open_write;
     tftp_file_read_cb read;
     tftp_file_write_cb write;
     tftp_file_close_cb close;
+    tftp_file_resume_cb resume;
 } tftp_file_interface;
 
 // tftp_transport_send_cb is called by the library to send |len| bytes from
@@ -198,10 +213,19 @@ typedef int (*tftp_transport_recv_cb)(void* data,
 typedef int (*tftp_transport_timeout_set_cb)(uint32_t timeout_ms,
                                              void* transport_cookie);
 
+// tftp_transport_verify_cb is optional. Transports that hand over messages
+// before their integrity has been checked (e.g. to fold a checksum into the
+// copy of the payload) provide it and return false for a corrupted message.
+// The library calls it before it acts on a message, except for DATA blocks it
+// passes straight to the file write callback: that callback verifies the data
+// and returns TFTP_ERR_SHOULD_WAIT to have a corrupted block dropped.
+typedef bool (*tftp_transport_verify_cb)(void* transport_cookie);
+
 typedef struct {
     tftp_transport_send_cb send;
     tftp_transport_recv_cb recv;
     tftp_transport_timeout_set_cb timeout_set;
+    tftp_transport_verify_cb verify;
 } tftp_transport_interface;
 
 // Returns the number of bytes needed to hold a tftp_session.
@@ -227,6 +251,13 @@ tftp_status tftp_session_set_transport_interface(tftp_session* session,
 void tftp_session_set_max_timeouts(tftp_session* session,
                                    uint16_t max_timeouts);
 
+// Provides a buffer where a receiving session stages blocks that arrive ahead of the
+// next expected block (e.g. because a frame was reordered or lost). Up to 64 blocks, or
+// as many as fit into |size| bytes, are kept and delivered to the file interface in
+// order once the missing block arrives. Without the buffer such blocks are dropped and
+// the window is re-ACKed from the last contiguous block.
+void tftp_session_set_reorder_buffer(tftp_session* session, void* buffer, size_t size);
+
 // Specify whether to use the upper 8 bits of the opcode field as a pseudo
 // retransmission count. When enabled, this tweaks the contents of a
 // retransmitted packet just enough that it will have a different checksum,
@@ -236,9 +267,10 @@ void tftp_session_set_opcode_prefix_use(tftp_session* session,
                                         bool enable);
 
 // When acting as a server, the options that will be overridden when a
-// value is requested by the client. Note that if the client does not
-// specify a setting, the default will be used regardless of server
-// setting.
+// value is requested by the client. Block and window sizes act as upper
+// limits, a smaller value requested by the client is kept. Note that if the
+// client does not specify a setting, the default will be used regardless of
+// server setting. A value the client marks as forced is never overridden.
 // When acting as a client, the default options that will be used when
 // initiating a transfer. If any of the values are not set, it will not be
 // specified in the request packet, and so the tftp defaults will be used.
@@ -253,6 +285,20 @@ tftp_status tftp_set_options(tftp_session* session,
 // before sending additional data packets.
 bool tftp_session_has_pending(tftp_session* session);
 
+// tftp_session_next_block returns true if the session is receiving a file and
+// sets |block| to the number the next expected DATA block carries and |offset|
+// and |length| to the file range it covers. It lets the transport receive the
+// block right into its destination.
+bool tftp_session_next_block(tftp_session* session, uint16_t* block, size_t* offset,
+                             size_t* length);
+
+// tftp_session_reply_due returns false if handling the message |msg| is not
+// going to produce a response, e.g. for a DATA block in the middle of a window.
+// It lets the transport build responses right in a transmit buffer without
+// taking one for every message. It may return true for a message that turns out
+// to need no response.
+bool tftp_session_reply_due(tftp_session* session, const void* msg, size_t len);
+
 // Prepare a DATA packet to send to the remote host. This is only required when
 // tftp_session_has_pending(session) returns true, as tftp_process_msg() will
 // prepare the first DATA message in each window.
@@ -303,6 +349,16 @@ tftp_status tftp_pull_file(tftp_session* session,
                            const char* local_filename,
                            tftp_request_opts* options);
 
+// Sends the request to retrieve |remote_filename| to |local_filename| and returns
+// without waiting for the response. The messages of the remote host are then passed
+// to tftp_handle_msg(), so the transfer can run from the caller's own event loop.
+// Only the output buffer of |options| is required.
+tftp_status tftp_request_file(tftp_session* session,
+                              void* transport_cookie,
+                              const char* local_filename,
+                              const char* remote_filename,
+                              tftp_request_opts* options);
+
 // Wait for a client to request an operation, then service that request.
 // Returns (with TFTP_TRANSFER_COMPLETED) after each successful operation, or
 // on error. This function will call the transport send, recv, and timeout_set
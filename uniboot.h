@@ -24,12 +24,14 @@ struct __attribute__((packed)) uniboot_entry {
 #define UNIBOOT_ENTRY_SECTION_LIST 3
 #define UNIBOOT_ENTRY_FRAMEBUFFER 4
 #define UNIBOOT_ENTRY_ACPI_INFO 5
+#define UNIBOOT_ENTRY_MODULE 6
 
 #define UNIBOOT_MEM_RESERVED 1
 #define UNIBOOT_MEM_UNUSABLE 2
 #define UNIBOOT_MEM_ACPI 3
 #define UNIBOOT_MEM_RAM 4
 #define UNIBOOT_MEM_NVS 5
+#define UNIBOOT_MEM_MODULE 6 // holds a module, see struct uniboot_module
 
 struct __attribute__((packed)) uniboot_memory_area {
     uint64_t type;   // UNIBOOT_MEM_*
@@ -131,4 +133,15 @@ struct __attribute__((packed)) uniboot_acpi_info {
     uint64_t acpi_root; // ACPI structure address
 };
 
+#define UNIBOOT_MODULE_NAME_LEN 64
+
+// A file loaded for the application, e.g. a ramdisk. Every module has an entry of its own.
+// The module memory is reported as UNIBOOT_MEM_MODULE, the application may reuse it as RAM once done.
+struct __attribute__((packed)) uniboot_module {
+    uint64_t base;  // physical base addr
+    uint64_t size;  // in bytes
+    uint64_t align; // |base| is a multiple of it, at least 4096
+    char name[UNIBOOT_MODULE_NAME_LEN]; // nul-terminated
+};
+
 typedef __attribute__((noreturn)) void (*uniboot_entry_point_t)(struct uniboot_info *info);
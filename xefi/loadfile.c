@@ -14,7 +14,7 @@
 #define xprintf(fmt...) printf(fmt)
 #endif
 
-efi_file_protocol* xefi_open_file(const char16_t* filename) {
+static efi_file_protocol* xefi_open_file_mode(const char16_t* filename, uint64_t mode) {
     efi_loaded_image_protocol* loaded;
     efi_status r;
     efi_file_protocol* file = NULL;
@@ -45,8 +45,9 @@ efi_file_protocol* xefi_open_file(const char16_t* filename) {
         goto exit2;
     }
 
-    r = root->Open(root, &file, filename, EFI_FILE_MODE_READ, 0);
+    r = root->Open(root, &file, filename, mode, 0);
     if (r) {
+        file = NULL;
         goto exit3;
     }
 
@@ -60,6 +61,38 @@ exit0:
     return file;
 }
 
+efi_file_protocol* xefi_open_file(const char16_t* filename) {
+    return xefi_open_file_mode(filename, EFI_FILE_MODE_READ);
+}
+
+void xefi_delete_file(const char16_t* filename) {
+    efi_file_protocol* file = xefi_open_file_mode(filename, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE);
+    if (file) {
+        // closes the handle as well
+        file->Delete(file);
+    }
+}
+
+efi_file_protocol* xefi_create_file(const char16_t* filename) {
+    // start from an empty file, a longer old one would keep its tail otherwise
+    xefi_delete_file(filename);
+    return xefi_open_file_mode(filename, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE);
+}
+
+efi_status xefi_write_file(const char16_t* filename, const void* data, size_t size) {
+    efi_file_protocol* file = xefi_create_file(filename);
+    if (!file) {
+        return EFI_NOT_FOUND;
+    }
+    size_t sz = size;
+    efi_status r = file->Write(file, &sz, (void*)data);
+    if (!r && sz != size) {
+        r = EFI_VOLUME_FULL;
+    }
+    efi_status r2 = file->Close(file);
+    return r ? r : r2;
+}
+
 void* xefi_read_file(efi_file_protocol* file, size_t* _sz, size_t front_bytes) {
     efi_status r;
     size_t pages = 0;
@@ -4,10 +4,90 @@
 
 #include <string.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// Copies of at least this size bypass the cache with non-temporal stores. Such copies are
+// much larger than the cache and their destination is not read back soon (e.g. ELF segments).
+#define NT_COPY_THRESHOLD (1024 * 1024)
+// Below this size a plain word loop beats the startup cost of string instructions
+#define REP_THRESHOLD 128
+
+typedef uint64_t __attribute__((__may_alias__, __aligned__(1))) unaligned_u64;
+
+// Enhanced REP MOVSB/STOSB (ERMS) makes byte string instructions the fastest way to move
+// large blocks. Without it we move quadwords and finish the tail bytewise.
+static bool have_erms(void) {
+    static int erms = -1;
+    if (erms < 0) {
+        uint32_t eax, ebx, ecx, edx;
+        __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+        erms = 0;
+        if (eax >= 7) {
+            __asm__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+            erms = (ebx >> 9) & 1;
+        }
+    }
+    return erms;
+}
+
+static void copy_words(uint8_t* dst, const uint8_t* src, size_t n) {
+    for (; n >= 8; n -= 8, dst += 8, src += 8) {
+        *(unaligned_u64*)dst = *(const unaligned_u64*)src;
+    }
+    while (n-- > 0) {
+        *dst++ = *src++;
+    }
+}
+
+static void copy_rep(void* dst, const void* src, size_t n) {
+    if (!have_erms()) {
+        size_t words = n / 8;
+        __asm__ volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(words) : : "memory");
+        n %= 8;
+    }
+    __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static void copy_nt(uint8_t* dst, const uint8_t* src, size_t n) {
+    size_t head = -(uintptr_t)dst & 7;
+    copy_words(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+
+    for (; n >= 32; n -= 32, dst += 32, src += 32) {
+        uint64_t a = ((const unaligned_u64*)src)[0];
+        uint64_t b = ((const unaligned_u64*)src)[1];
+        uint64_t c = ((const unaligned_u64*)src)[2];
+        uint64_t d = ((const unaligned_u64*)src)[3];
+        __builtin_ia32_movnti64((long long*)dst, a);
+        __builtin_ia32_movnti64((long long*)dst + 1, b);
+        __builtin_ia32_movnti64((long long*)dst + 2, c);
+        __builtin_ia32_movnti64((long long*)dst + 3, d);
+    }
+    // make the weakly-ordered stores visible before anyone looks at the data
+    __builtin_ia32_sfence();
+    copy_words(dst, src, n);
+}
+
 void* memset(void* _dst, int c, size_t n) {
     uint8_t* dst = _dst;
+    if (n >= REP_THRESHOLD) {
+        if (!have_erms()) {
+            uint64_t pattern = (uint8_t)c * 0x0101010101010101UL;
+            size_t words = n / 8;
+            __asm__ volatile("rep stosq" : "+D"(dst), "+c"(words) : "a"(pattern) : "memory");
+            n %= 8;
+        }
+        __asm__ volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(c) : "memory");
+        return _dst;
+    }
+
+    uint64_t pattern = (uint8_t)c * 0x0101010101010101UL;
+    for (; n >= 8; n -= 8, dst += 8) {
+        *(unaligned_u64*)dst = pattern;
+    }
     while (n-- > 0) {
         *dst++ = c;
     }
@@ -15,10 +95,12 @@ void* memset(void* _dst, int c, size_t n) {
 }
 
 void* memcpy(void* _dst, const void* _src, size_t n) {
-    uint8_t* dst = _dst;
-    const uint8_t* src = _src;
-    while (n-- > 0) {
-        *dst++ = *src++;
+    if (n >= NT_COPY_THRESHOLD) {
+        copy_nt(_dst, _src, n);
+    } else if (n >= REP_THRESHOLD) {
+        copy_rep(_dst, _src, n);
+    } else {
+        copy_words(_dst, _src, n);
     }
     return _dst;
 }
@@ -26,6 +108,12 @@ void* memcpy(void* _dst, const void* _src, size_t n) {
 int memcmp(const void* _a, const void* _b, size_t n) {
     const uint8_t* a = _a;
     const uint8_t* b = _b;
+    // skip the equal prefix a word at a time, the differing word is resolved bytewise
+    for (; n >= 8; n -= 8, a += 8, b += 8) {
+        if (*(const unaligned_u64*)a != *(const unaligned_u64*)b) {
+            break;
+        }
+    }
     while (n-- > 0) {
         int x = *a++ - *b++;
         if (x != 0) {